@@ -0,0 +1,136 @@
+#include "../vsfs_helpers.h"
+
+#include <chrono>
+
+/*
+ * Microbenchmark of the record boundary scanner against the read_line loop it replaced.
+ *
+ * Usage: bench/scan_bench FS [repeats]
+ */
+
+struct scan_counts
+{
+    size_t records;
+    size_t content_lines;
+
+    bool operator==(const scan_counts& other) const
+    {
+        return records == other.records && content_lines == other.content_lines;
+    }
+};
+
+// Count records and content lines the way build_tree used to read them
+scan_counts scan_read_line(const std::string& fs_path)
+{
+    std::fstream fs_file(fs_path, std::ios::in);
+    scan_counts counts{};
+    std::string fs_line;
+    bool is_deleted{};
+
+    while (read_line(fs_file, fs_line))
+    {
+        char record_type = fs_line.empty() ? '\0' : fs_line.front();
+        if (record_type == FILE_RECORD_IDENTIFIER || record_type == DIR_RECORD_IDENTIFIER)
+            counts.records++;
+        else if (record_type == RECORD_CONTENT_IDENTIFIER && !is_deleted)
+            counts.content_lines++;
+
+        // Content lines after a deleted file are deleted with it, those after a deleted dir are not
+        if (record_type != RECORD_CONTENT_IDENTIFIER)
+            is_deleted = record_type == DELETED_RECORD_IDENTIFIER && fs_line.back() != '/';
+    }
+
+    return counts;
+}
+
+// Count records and content lines the way scan_records reads them, with the given kernel
+scan_counts scan_kernel(std::string_view fs_data, find_line_kernel kernel)
+{
+    scan_counts counts{};
+    size_t line_start = 0;
+    size_t newline_count;
+
+    while (line_start < fs_data.size())
+    {
+        char record_type = fs_data[line_start];
+        if (record_type == RECORD_CONTENT_IDENTIFIER)
+        {
+            line_start = kernel(fs_data.data(), fs_data.size(), line_start, ANY_LINE & ~CONTENT_LINE, newline_count);
+            counts.content_lines += newline_count;
+        }
+        else if (record_type == DELETED_RECORD_IDENTIFIER)
+        {
+            line_start = find_deleted_run_end(fs_data, line_start, kernel, newline_count);
+        }
+        else
+        {
+            line_start = kernel(fs_data.data(), fs_data.size(), line_start, ANY_LINE, newline_count);
+
+            if (record_type == FILE_RECORD_IDENTIFIER || record_type == DIR_RECORD_IDENTIFIER)
+                counts.records++;
+        }
+    }
+
+    return counts;
+}
+
+template<typename Scan>
+scan_counts run(const char* name, double size_mb, int repeats, Scan&& scan)
+{
+    scan_counts counts{};
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeats; i++)
+        counts = scan();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("%-10s %10.1f MB/s %8zu records %10zu content lines\n",
+        name, size_mb * repeats / elapsed.count(), counts.records, counts.content_lines);
+    return counts;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s FS [repeats]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::string fs_path = argv[1];
+    int repeats = argc > 2 ? atoi(argv[2]) : 3;
+
+    fs_map fs_mapping;
+    if (!fs_mapping.map(fs_path))
+    {
+        fprintf(stderr, "Could not map %s\n", fs_path.c_str());
+        return EXIT_FAILURE;
+    }
+
+    std::string_view fs_data = fs_mapping.get_data();
+    double size_mb = (double) fs_data.size() / (1024 * 1024);
+
+    scan_counts expected = run("read_line", size_mb, repeats, [&]()
+    { return scan_read_line(fs_path); });
+
+    std::vector<std::pair<const char*, find_line_kernel>> kernels{{"scalar", find_line_scalar}};
+#ifdef VSFS_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels.emplace_back("sse2", find_line_sse2);
+    if (__builtin_cpu_supports("avx2"))
+        kernels.emplace_back("avx2", find_line_avx2);
+#endif
+
+    int mismatches = 0;
+    for (auto& [name, kernel]: kernels)
+    {
+        if (!(run(name, size_mb, repeats, [&]()
+        { return scan_kernel(fs_data, kernel); }) == expected))
+        {
+            fprintf(stderr, "%s disagrees with read_line\n", name);
+            mismatches++;
+        }
+    }
+
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
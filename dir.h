@@ -2,27 +2,25 @@
 #define DIR_H
 
 #include "file.h"
+#include "vsfs_constants.h"
 
-#include <vector>
-#include <algorithm>
+#include <list>
+#include <string_view>
+#include <unordered_map>
 
 /**
  * Class that represents a directory in VSFS.
+ *
+ * Children are kept in insertion order and indexed by name, the index keys view into the children's own names.
+ * Children are not owned by the dir, the whole tree is released with the fs_arena it was created in.
  */
 class dir : public file
 {
 public:
-    explicit dir(const std::string& name, const std::string& path) : file(name, path)
+    explicit dir(std::string_view name, std::string_view path, std::pmr::memory_resource* resource)
+        : file(name, path, resource), m_children(resource), m_index(resource)
     {}
 
-    ~dir() override
-    {
-        std::for_each(m_children.begin(), m_children.end(), [](file* child)
-        {
-            delete child;
-        });
-    }
-
     void add_child(file* child)
     {
         // Detach child's parent
@@ -32,59 +30,90 @@ public:
 
         // Add the child file
         m_children.push_back(child);
+        m_index.emplace(child->get_name(), std::prev(m_children.end()));
         m_children.back()->set_parent(this);
     }
 
     void remove_child(file* child)
     {
-        size_t index = find_by_name(child);
-        if (index != m_children.size())
-            m_children.erase(m_children.begin() + (int) index);
+        auto found = m_index.find(child->get_name());
+        if (found != m_index.end() && *found->second == child)
+        {
+            m_children.erase(found->second);
+            m_index.erase(found);
+        }
+    }
+
+    // Re-key a child in the index when it gets renamed, keeping its position
+    void rename_child(file* child, std::string_view name)
+    {
+        auto node = m_index.extract(child->get_name());
+        child->m_name = name;
+
+        if (!node.empty())
+        {
+            node.key() = child->get_name();
+            m_index.insert(std::move(node));
+        }
     }
 
-    size_t find_by_name(file* child)
+    file* find_by_name(file* child)
     {
         return find_by_name(child->get_name());
     }
 
-    size_t find_by_path(file* child)
+    file* find_by_path(file* child)
     {
         return find_by_path(child->get_path());
     }
 
-    size_t find_by_name(const std::string& child_name)
+    file* find_by_name(std::string_view child_name)
     {
-        size_t index = 0;
-        for (; index < m_children.size(); index++)
-            if (m_children.at(index)->get_name() == child_name)
-                break;
-
-        return index;
+        auto found = m_index.find(child_name);
+        return found != m_index.end() ? *found->second : nullptr;
     }
 
-    size_t find_by_path(const std::string& child_path)
+    file* find_by_path(std::string_view child_path)
     {
-        size_t index = 0;
-        for (; index < m_children.size(); index++)
-            if (m_children.at(index)->get_path() == child_path)
-                break;
-
-        return index;
+        // A child's name is the last component of its path, including the trailing '/' for dirs
+        size_t name_start = child_path.size() < 2
+            ? std::string_view::npos
+            : child_path.find_last_of(PATH_SEPARATOR, child_path.size() - 2);
+        std::string_view child_name = name_start == std::string_view::npos
+            ? child_path
+            : child_path.substr(name_start + 1);
+
+        file* child = find_by_name(child_name);
+        return child && child->get_path() == child_path ? child : nullptr;
     }
 
-    [[nodiscard]] std::vector<file*>& get_children()
+    [[nodiscard]] std::pmr::list<file*>& get_children()
     {
         return m_children;
     }
 
 private:
-    std::vector<file*> m_children;
+    std::pmr::list<file*> m_children;
+    std::pmr::unordered_map<std::string_view, std::pmr::list<file*>::iterator> m_index;
 
     // Disable meaningless functions
+    using file::get_content_spans;
+    using file::get_line_count;
     using file::get_content;
-    using file::set_content;
     using file::append_content;
+    using file::add_line_count;
+    using file::get_body;
+    using file::set_body;
 
 };
 
+inline void file::set_name(std::string_view name)
+{
+    // Parent's index is keyed by name
+    if (m_parent)
+        m_parent->rename_child(this, name);
+    else
+        m_name = name;
+}
+
 #endif // DIR_H
@@ -1,16 +1,28 @@
 #ifndef FILE_H
 #define FILE_H
 
+#include <string>
+#include <string_view>
 #include <iostream>
+#include <vector>
 #include <utility>
+#include <algorithm>
+#include <memory_resource>
 
 class dir;
 
+/**
+ * Class that represents a file in VSFS.
+ *
+ * Strings are allocated from the given memory resource, usually the fs_arena the file itself was created in.
+ * Content is not copied, the file keeps spans of content records that point into the FS backing store instead.
+ * Content several files share is kept by a body, a file outside the tree that those files refer to.
+ */
 class file
 {
 public:
-    explicit file(std::string name, std::string path)
-        : m_name(std::move(name)), m_path(std::move(path)), m_parent(nullptr)
+    explicit file(std::string_view name, std::string_view path, std::pmr::memory_resource* resource)
+        : m_name(name, resource), m_path(path, resource), m_parent(nullptr), m_content_spans(resource)
     {}
 
     virtual ~file()
@@ -18,22 +30,20 @@ public:
         m_parent = nullptr;
     }
 
-    [[nodiscard]] virtual std::string get_name() const
+    [[nodiscard]] virtual const std::pmr::string& get_name() const
     {
         return m_name;
     }
 
-    virtual void set_name(const std::string& name)
-    {
-        m_name = name;
-    }
+    // Defined in dir.h as the parent's index is keyed by name
+    virtual void set_name(std::string_view name);
 
-    [[nodiscard]] virtual const std::string& get_path() const
+    [[nodiscard]] virtual const std::pmr::string& get_path() const
     {
         return m_path;
     }
 
-    virtual void set_path(const std::string& path)
+    virtual void set_path(std::string_view path)
     {
         file::m_path = path;
     }
@@ -48,28 +58,86 @@ public:
         m_parent = parent;
     }
 
-    [[nodiscard]] virtual const std::string& get_content() const
+    // Content lines as stored in the backing FS, each prefixed by the record content identifier
+    [[nodiscard]] virtual const std::pmr::vector<std::string_view>& get_content_spans() const
+    {
+        return m_content_spans;
+    }
+
+    [[nodiscard]] virtual size_t get_line_count() const
+    {
+        return m_line_count;
+    }
+
+    // Body the file shares its content with instead of having content records of its own, nullptr if none
+    [[nodiscard]] virtual file* get_body() const
     {
-        return m_content;
+        return m_body;
     }
 
-    virtual void set_content(const std::string& content)
+    // Share the content of a body, the lines of which the file then counts as its own
+    virtual void set_body(file* body)
     {
-        m_content = content;
+        m_body = body;
+        m_line_count += body->get_line_count();
     }
 
-    virtual void append_content(const std::string& content)
+    // Materialize the content with one '\n' terminated line per content record, blocks are not inflated
+    [[nodiscard]] virtual std::string get_content() const
     {
-        m_content.append(content);
+        if (m_body)
+            return m_body->get_content();
+
+        std::string content;
+        for (std::string_view span: m_content_spans)
+        {
+            size_t line_start = 0;
+            while (line_start < span.size())
+            {
+                size_t line_end = std::min(span.find('\n', line_start), span.size());
+                content.append(span.substr(line_start + 1, line_end - line_start - 1)).push_back('\n');
+                line_start = line_end + 1;
+            }
+        }
+
+        return content;
+    }
+
+    // Append content record lines, including their '\n', that live in the backing FS for as long as the file does
+    virtual void append_content(std::string_view record_lines, size_t line_count)
+    {
+        // Extend the last span when the lines directly follow it
+        if (!m_content_spans.empty()
+            && m_content_spans.back().data() + m_content_spans.back().size() == record_lines.data())
+        {
+            std::string_view& span = m_content_spans.back();
+            span = std::string_view(span.data(), span.size() + record_lines.size());
+        }
+        else
+        {
+            m_content_spans.push_back(record_lines);
+        }
+
+        m_line_count += line_count;
+    }
+
+    // Count content record lines without keeping their spans, for files whose content is never read
+    virtual void add_line_count(size_t line_count)
+    {
+        m_line_count += line_count;
     }
 
 protected:
-    std::string m_name;
-    std::string m_path;
+    friend class dir;
+
+    std::pmr::string m_name;
+    std::pmr::string m_path;
     dir* m_parent;
 
 private:
-    std::string m_content;
+    std::pmr::vector<std::string_view> m_content_spans;
+    size_t m_line_count{};
+    file* m_body = nullptr;
 };
 
 #endif // FILE_H
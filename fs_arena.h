@@ -0,0 +1,48 @@
+#ifndef FS_ARENA_H
+#define FS_ARENA_H
+
+#include <memory_resource>
+#include <utility>
+
+/**
+ * Class that represents the memory arena an FS tree is built in.
+ *
+ * Nodes, their strings and their children containers are bump allocated from the arena and released together in one
+ * step, node destructors are never run.
+ */
+class fs_arena
+{
+public:
+    fs_arena() : m_resource(INITIAL_BLOCK_SIZE)
+    {}
+
+    // An arena is uniquely owned
+    fs_arena(const fs_arena&) = delete;
+    fs_arena& operator=(const fs_arena&) = delete;
+
+    // Construct a node in the arena, the arena's resource is passed on as the last constructor argument
+    template<typename T, typename... Args>
+    T* create(Args&& ... args)
+    {
+        void* node = m_resource.allocate(sizeof(T), alignof(T));
+        return new(node) T(std::forward<Args>(args)..., get_resource());
+    }
+
+    // Release every node at once, any pointer into the arena is invalidated
+    void release()
+    {
+        m_resource.release();
+    }
+
+    [[nodiscard]] std::pmr::memory_resource* get_resource()
+    {
+        return &m_resource;
+    }
+
+private:
+    static constexpr size_t INITIAL_BLOCK_SIZE = 64 * 1024;
+
+    std::pmr::monotonic_buffer_resource m_resource;
+};
+
+#endif // FS_ARENA_H
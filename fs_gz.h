@@ -0,0 +1,413 @@
+#ifndef FS_GZ_H
+#define FS_GZ_H
+
+#include "fs_map.h"
+#include "vsfs_constants.h"
+
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <string_view>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/**
+ * Class that represents a compressed FS written as a sequence of gzip members, each inflated without the others.
+ *
+ * As in BGZF, every member holds at most GZ_MEMBER_SIZE bytes of the FS and its header carries a "BC" extra subfield
+ * with the member's own size, and the last member is empty. The members together are one valid gzip file. The block
+ * index maps the offset in the FS each member starts at to where the member is, read from the sidecar FS.gz.gzi when
+ * it is stamped with the compressed FS' size and modification time, or else from the headers and trailers of the
+ * members, neither of which inflates any.
+ */
+class fs_gz
+{
+public:
+    struct member
+    {
+        // Offset of the member in the compressed FS
+        uint64_t offset;
+        // Offset in the FS of the first byte the member holds
+        uint64_t fs_offset;
+    };
+
+    fs_gz() = default;
+
+    // A compressed FS is uniquely owned
+    fs_gz(const fs_gz&) = delete;
+    fs_gz& operator=(const fs_gz&) = delete;
+
+    // Map the compressed FS and read its block index, false if it cannot be mapped or was not written in members
+    bool open(const std::string& gz_path)
+    {
+        clear();
+        struct stat gz_attr{};
+        if (stat(gz_path.c_str(), &gz_attr) != EXIT_SUCCESS || !m_mapping.map(gz_path))
+            return false;
+
+        m_data = m_mapping.get_data();
+        if (!load(gz_path + '.' + GZ_INDEX_EXTENSION, gz_attr) && !read_members())
+        {
+            clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    void clear()
+    {
+        m_mapping.unmap();
+        m_data = {};
+        m_members.clear();
+        m_fs_size = 0;
+        m_inflated_member = SIZE_MAX;
+        m_inflated.clear();
+    }
+
+    [[nodiscard]] uint64_t get_fs_size() const
+    {
+        return m_fs_size;
+    }
+
+    // Append size bytes of the FS from fs_offset on to data, or those up to its end, inflating only the members they
+    // lie in, false if one of them is malformed
+    bool read(uint64_t fs_offset, uint64_t size, std::string& data)
+    {
+        if (fs_offset >= m_fs_size)
+            return true;
+
+        uint64_t fs_end = fs_offset + std::min(size, m_fs_size - fs_offset);
+
+        // Last member starting at or before fs_offset
+        auto next = std::upper_bound(m_members.begin(), m_members.end(), fs_offset,
+            [](uint64_t offset, const member& found) { return offset < found.fs_offset; });
+        for (size_t i = next - m_members.begin() - 1; i < m_members.size() && get_member_start(i) < fs_end; i++)
+        {
+            if (!inflate_member(i))
+                return false;
+
+            uint64_t member_start = get_member_start(i);
+            uint64_t copy_start = std::max(fs_offset, member_start) - member_start;
+            uint64_t copy_end = std::min(fs_end, get_member_end(i)) - member_start;
+            data.append(m_inflated, copy_start, copy_end - copy_start);
+        }
+
+        return true;
+    }
+
+    /*
+     * Compress the FS into members written to fd, keeping their block index for save, false if any could not be
+     * compressed or written, errno being set for the latter.
+     */
+    bool write(int fd, std::string_view fs_data)
+    {
+        clear();
+        std::string compressed;
+        uint64_t offset = 0;
+        for (size_t fs_offset = 0;; fs_offset += GZ_MEMBER_SIZE)
+        {
+            // The last member is always empty, ending the FS as BGZF does
+            std::string_view held = fs_offset < fs_data.size() ? fs_data.substr(fs_offset, GZ_MEMBER_SIZE) : "";
+            if (!compress_member(held, compressed) || !write_all(fd, compressed))
+                return false;
+
+            if (!held.empty())
+                m_members.push_back({offset, fs_offset});
+
+            offset += compressed.size();
+            if (held.empty())
+                break;
+        }
+
+        m_fs_size = fs_data.size();
+        return true;
+    }
+
+    // Save the block index to the given path, stamped with the attributes of the compressed FS it was written for
+    bool save(const std::string& index_path, const struct stat& gz_attr) const
+    {
+        header index_header{};
+        memcpy(index_header.magic, GZ_INDEX_MAGIC, sizeof(index_header.magic));
+        index_header.gz_size = (uint64_t) gz_attr.st_size;
+        index_header.gz_mtime_sec = (int64_t) gz_attr.st_mtim.tv_sec;
+        index_header.gz_mtime_nsec = (int64_t) gz_attr.st_mtim.tv_nsec;
+        index_header.fs_size = m_fs_size;
+        index_header.member_count = m_members.size();
+
+        // Write next to the index and rename over it, so readers never see a partial index, each save to a file of
+        // its own so that concurrent ones do not interleave
+        std::string tmp_path = index_path + ".XXXXXX";
+        int fd = mkstemp(tmp_path.data());
+        if (fd == -1)
+            return false;
+
+        close(fd);
+        std::ofstream index_file(tmp_path, std::ios::out | std::ios::trunc | std::ios::binary);
+        if (!index_file.is_open())
+        {
+            unlink(tmp_path.c_str());
+            return false;
+        }
+
+        index_file.write(reinterpret_cast<const char*>(&index_header), sizeof(index_header));
+        index_file.write(reinterpret_cast<const char*>(m_members.data()),
+            (std::streamsize) (m_members.size() * sizeof(member)));
+
+        // The file was created owner-only, it gets the permissions of any other new file
+        mode_t mask = umask(0);
+        umask(mask);
+
+        index_file.close();
+        if (!index_file || chmod(tmp_path.c_str(), 0666 & ~mask) != 0
+            || rename(tmp_path.c_str(), index_path.c_str()) != 0)
+        {
+            unlink(tmp_path.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+    static constexpr char GZ_INDEX_MAGIC[8] = {'V', 'S', 'F', 'S', 'G', 'Z', 'I', '1'};
+
+    // Fixed part of a member's header up to its extra field, then the "BC" subfield, then the trailer
+    static constexpr size_t MEMBER_FIXED_SIZE = 12;
+    static constexpr size_t MEMBER_EXTRA_SIZE = 6;
+    static constexpr size_t MEMBER_TRAILER_SIZE = 8;
+
+    // A member's size is stored less 1 in 16 bits
+    static constexpr size_t MEMBER_MAX_SIZE = 65536;
+
+    struct header
+    {
+        char magic[8];
+        uint64_t gz_size;
+        int64_t gz_mtime_sec;
+        int64_t gz_mtime_nsec;
+        uint64_t fs_size;
+        uint64_t member_count;
+    };
+
+    static uint32_t read_le(const char* data, size_t size)
+    {
+        uint32_t value = 0;
+        for (size_t i = size; i > 0; i--)
+            value = value << 8 | (unsigned char) data[i - 1];
+
+        return value;
+    }
+
+    static void append_le(std::string& data, uint32_t value, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+            data.push_back((char) (value >> (8 * i) & 0xff));
+    }
+
+    static bool write_all(int fd, std::string_view data)
+    {
+        while (!data.empty())
+        {
+            ssize_t written = ::write(fd, data.data(), data.size());
+            if (written == -1 && errno == EINTR)
+                continue;
+
+            if (written <= 0)
+                return false;
+
+            data.remove_prefix((size_t) written);
+        }
+
+        return true;
+    }
+
+    // Compress data into a single member, false if it could not be or would not fit a member
+    static bool compress_member(std::string_view data, std::string& compressed)
+    {
+        z_stream stream{};
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+
+        size_t header_size = MEMBER_FIXED_SIZE + MEMBER_EXTRA_SIZE;
+        compressed.assign(header_size + deflateBound(&stream, (uLong) data.size()), '\0');
+
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        stream.avail_in = (uInt) data.size();
+        stream.next_out = reinterpret_cast<Bytef*>(compressed.data() + header_size);
+        stream.avail_out = (uInt) (compressed.size() - header_size);
+        int status = deflate(&stream, Z_FINISH);
+        size_t deflated_size = stream.total_out;
+        deflateEnd(&stream);
+
+        size_t member_size = header_size + deflated_size + MEMBER_TRAILER_SIZE;
+        if (status != Z_STREAM_END || member_size > MEMBER_MAX_SIZE)
+            return false;
+
+        // Magic, deflate, only the extra field flag, no modification time, no extra flags and an unknown OS
+        std::string member_header = {'\x1f', '\x8b', '\x08', '\x04', 0, 0, 0, 0, 0, '\xff'};
+        append_le(member_header, MEMBER_EXTRA_SIZE, 2);
+        member_header.append({'B', 'C', '\x02', '\x00'});
+        append_le(member_header, (uint32_t) (member_size - 1), 2);
+        compressed.replace(0, header_size, member_header);
+
+        compressed.resize(header_size + deflated_size);
+        uLong crc = crc32(0, reinterpret_cast<const Bytef*>(data.data()), (uInt) data.size());
+        append_le(compressed, (uint32_t) crc, 4);
+        append_le(compressed, (uint32_t) data.size(), 4);
+        return true;
+    }
+
+    // Load the block index saved for the compressed FS, false if it is missing, malformed or stale
+    bool load(const std::string& index_path, const struct stat& gz_attr)
+    {
+        std::ifstream index_file(index_path, std::ios::in | std::ios::binary);
+        header index_header{};
+        if (!index_file.read(reinterpret_cast<char*>(&index_header), sizeof(index_header)))
+            return false;
+
+        bool is_valid = memcmp(index_header.magic, GZ_INDEX_MAGIC, sizeof(index_header.magic)) == 0
+            && index_header.gz_size == (uint64_t) gz_attr.st_size
+            && index_header.gz_mtime_sec == (int64_t) gz_attr.st_mtim.tv_sec
+            && index_header.gz_mtime_nsec == (int64_t) gz_attr.st_mtim.tv_nsec
+            && index_header.member_count > 0
+            && index_header.member_count <= m_data.size() / (MEMBER_FIXED_SIZE + MEMBER_EXTRA_SIZE);
+        if (!is_valid)
+            return false;
+
+        m_members.resize(index_header.member_count);
+        if (!index_file.read(reinterpret_cast<char*>(m_members.data()),
+            (std::streamsize) (m_members.size() * sizeof(member))))
+        {
+            m_members.clear();
+            return false;
+        }
+
+        // Members must lie within the compressed FS and follow each other in both
+        m_fs_size = index_header.fs_size;
+        for (size_t i = 0; i < m_members.size(); i++)
+        {
+            if (m_members[i].offset >= m_data.size() || get_member_start(i) >= get_member_end(i)
+                || (i == 0 ? m_members[i].offset != 0 || m_members[i].fs_offset != 0
+                    : m_members[i].offset <= m_members[i - 1].offset))
+            {
+                m_members.clear();
+                m_fs_size = 0;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Size of the member at the given offset from its header, 0 if it is not a member with the "BC" subfield
+    [[nodiscard]] size_t get_member_size(uint64_t offset) const
+    {
+        if (m_data.size() - offset < MEMBER_FIXED_SIZE + MEMBER_EXTRA_SIZE)
+            return 0;
+
+        const char* data = m_data.data() + offset;
+        bool is_member = data[0] == '\x1f' && data[1] == '\x8b' && data[2] == '\x08' && data[3] == '\x04'
+            && read_le(data + 10, 2) == MEMBER_EXTRA_SIZE && data[12] == 'B' && data[13] == 'C'
+            && read_le(data + 14, 2) == 2;
+        if (!is_member)
+            return 0;
+
+        size_t member_size = read_le(data + 16, 2) + 1;
+        if (member_size < MEMBER_FIXED_SIZE + MEMBER_EXTRA_SIZE + MEMBER_TRAILER_SIZE
+            || member_size > m_data.size() - offset)
+        {
+            return 0;
+        }
+
+        return member_size;
+    }
+
+    // Build the block index from the members' headers, for their sizes, and trailers, for the size each holds
+    bool read_members()
+    {
+        uint64_t fs_offset = 0;
+        for (uint64_t offset = 0; offset < m_data.size();)
+        {
+            size_t member_size = get_member_size(offset);
+            if (member_size == 0)
+                return false;
+
+            uint32_t held_size = read_le(m_data.data() + offset + member_size - 4, 4);
+            if (held_size > 0)
+                m_members.push_back({offset, fs_offset});
+
+            fs_offset += held_size;
+            offset += member_size;
+        }
+
+        m_fs_size = fs_offset;
+        return !m_members.empty();
+    }
+
+    [[nodiscard]] uint64_t get_member_start(size_t i) const
+    {
+        return m_members[i].fs_offset;
+    }
+
+    [[nodiscard]] uint64_t get_member_end(size_t i) const
+    {
+        return i + 1 < m_members.size() ? m_members[i + 1].fs_offset : m_fs_size;
+    }
+
+    // Inflate the member at the given index of the block index, which the last one inflated is kept for
+    bool inflate_member(size_t i)
+    {
+        if (m_inflated_member == i)
+            return true;
+
+        m_inflated_member = SIZE_MAX;
+        size_t member_size = get_member_size(m_members[i].offset);
+        size_t held_size = get_member_end(i) - get_member_start(i);
+        size_t header_size = MEMBER_FIXED_SIZE + MEMBER_EXTRA_SIZE;
+        if (member_size == 0)
+            return false;
+
+        const char* data = m_data.data() + m_members[i].offset;
+        if (read_le(data + member_size - 4, 4) != held_size)
+            return false;
+
+        z_stream stream{};
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+            return false;
+
+        m_inflated.resize(held_size);
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data + header_size));
+        stream.avail_in = (uInt) (member_size - header_size - MEMBER_TRAILER_SIZE);
+        stream.next_out = reinterpret_cast<Bytef*>(m_inflated.data());
+        stream.avail_out = (uInt) m_inflated.size();
+        int status = inflate(&stream, Z_FINISH);
+        bool is_inflated = status == Z_STREAM_END && stream.total_out == held_size
+            && crc32(0, reinterpret_cast<const Bytef*>(m_inflated.data()), (uInt) held_size)
+                == read_le(data + member_size - MEMBER_TRAILER_SIZE, 4);
+        inflateEnd(&stream);
+
+        if (is_inflated)
+            m_inflated_member = i;
+
+        return is_inflated;
+    }
+
+    fs_map m_mapping;
+    std::string_view m_data;
+    std::vector<member> m_members;
+    uint64_t m_fs_size = 0;
+
+    // The member inflated last, which reads that continue within it take from
+    size_t m_inflated_member = SIZE_MAX;
+    std::string m_inflated;
+};
+
+#endif // FS_GZ_H
@@ -0,0 +1,303 @@
+#ifndef FS_INDEX_H
+#define FS_INDEX_H
+
+#include "fs_map.h"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <algorithm>
+#include <string_view>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * Class that represents the sidecar index of an FS, mapping the path of each live record to where it is in the FS.
+ *
+ * The index file holds a header stamped with the FS' size and modification time, entries sorted by path and offset and
+ * then the paths themselves. A path recorded more than once in the FS has an entry for every occurrence. Lookups binary
+ * search the entries through a mapping of the file, changes are kept aside and merged in when the index is saved.
+ */
+class fs_index
+{
+public:
+    struct entry
+    {
+        char record_type;
+        // Offset of the record line in the FS
+        uint64_t offset;
+        // Length of the record line and any content lines that follow it
+        uint64_t length;
+    };
+
+    fs_index() = default;
+
+    // An index is uniquely owned
+    fs_index(const fs_index&) = delete;
+    fs_index& operator=(const fs_index&) = delete;
+
+    // Open the index file, false if it is missing, malformed or does not match the FS' attributes
+    bool open(const std::string& index_path, const struct stat& fs_attr)
+    {
+        clear();
+        if (!m_mapping.map(index_path))
+            return false;
+
+        std::string_view data = m_mapping.get_data();
+        if (data.size() < sizeof(header))
+        {
+            clear();
+            return false;
+        }
+
+        m_header = reinterpret_cast<const header*>(data.data());
+        bool is_valid = memcmp(m_header->magic, INDEX_MAGIC, sizeof(m_header->magic)) == 0
+            && m_header->fs_size == (uint64_t) fs_attr.st_size
+            && m_header->fs_mtime_sec == (int64_t) fs_attr.st_mtim.tv_sec
+            && m_header->fs_mtime_nsec == (int64_t) fs_attr.st_mtim.tv_nsec
+            && m_header->entry_count <= (data.size() - sizeof(header)) / sizeof(stored_entry);
+        if (!is_valid)
+        {
+            clear();
+            return false;
+        }
+
+        m_entries = reinterpret_cast<const stored_entry*>(data.data() + sizeof(header));
+        m_paths = std::string_view(data.data() + sizeof(header) + m_header->entry_count * sizeof(stored_entry),
+            data.size() - sizeof(header) - m_header->entry_count * sizeof(stored_entry));
+
+        // Paths must lie within the file
+        for (uint64_t i = 0; i < m_header->entry_count; i++)
+        {
+            if (m_entries[i].path_offset > m_paths.size()
+                || m_entries[i].path_length > m_paths.size() - m_entries[i].path_offset)
+            {
+                clear();
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Drop all entries, e.g. for the index to be rebuilt
+    void clear()
+    {
+        m_mapping.unmap();
+        m_header = nullptr;
+        m_entries = nullptr;
+        m_paths = {};
+        m_changes.clear();
+    }
+
+    // Find the first occurrence of the path in the FS
+    [[nodiscard]] std::optional<entry> find(std::string_view path) const
+    {
+        // Changes take precedence over stored entries
+        auto changed = m_changes.find(path);
+        if (changed != m_changes.end())
+        {
+            if (changed->second.empty())
+                return std::nullopt;
+
+            return changed->second.front();
+        }
+
+        const stored_entry* stored = lower_bound(path);
+        if (stored != stored_end() && get_path(*stored) == path)
+            return to_entry(*stored);
+
+        return std::nullopt;
+    }
+
+    // Call on_entry(std::string_view, const entry&) for every entry whose path starts with prefix, in order of path
+    template<typename Callback>
+    void for_each_prefix(std::string_view prefix, Callback&& on_entry) const
+    {
+        const stored_entry* stored = lower_bound(prefix);
+        auto changed = m_changes.lower_bound(prefix);
+        auto has_prefix = [&](std::string_view path)
+        { return path.substr(0, prefix.size()) == prefix; };
+
+        // Merge stored entries with changes, both sorted by path
+        while (true)
+        {
+            bool has_stored = stored != stored_end() && has_prefix(get_path(*stored));
+            bool has_changed = changed != m_changes.end() && has_prefix(changed->first);
+            if (!has_stored && !has_changed)
+                break;
+
+            if (has_changed && (!has_stored || std::string_view(changed->first) <= get_path(*stored)))
+            {
+                // Changed entries replace stored ones with the same path
+                while (stored != stored_end() && get_path(*stored) == changed->first)
+                    stored++;
+
+                for (const entry& record: changed->second)
+                    on_entry(std::string_view(changed->first), record);
+                changed++;
+            }
+            else
+            {
+                on_entry(get_path(*stored), to_entry(*stored));
+                stored++;
+            }
+        }
+    }
+
+    // Add an occurrence of the path
+    void insert(std::string_view path, const entry& record)
+    {
+        std::vector<entry>& records = get_changes(path);
+        auto position = std::upper_bound(records.begin(), records.end(), record.offset,
+            [](uint64_t offset, const entry& other) { return offset < other.offset; });
+        records.insert(position, record);
+    }
+
+    // Remove the occurrence of the path at the given offset
+    void erase(std::string_view path, uint64_t offset)
+    {
+        std::vector<entry>& records = get_changes(path);
+        records.erase(std::remove_if(records.begin(), records.end(),
+            [&](const entry& record) { return record.offset == offset; }), records.end());
+    }
+
+    // Write the index file with changes merged in, stamped with the FS' attributes after it was written
+    bool save(const std::string& index_path, const struct stat& fs_attr)
+    {
+        std::vector<std::pair<std::string_view, entry>> entries;
+        for_each_prefix("", [&](std::string_view path, const entry& record)
+        {
+            entries.emplace_back(path, record);
+        });
+
+        header index_header{};
+        memcpy(index_header.magic, INDEX_MAGIC, sizeof(index_header.magic));
+        index_header.fs_size = (uint64_t) fs_attr.st_size;
+        index_header.fs_mtime_sec = (int64_t) fs_attr.st_mtim.tv_sec;
+        index_header.fs_mtime_nsec = (int64_t) fs_attr.st_mtim.tv_nsec;
+        index_header.entry_count = entries.size();
+
+        // Write next to the index and rename over it, so readers never see a partial index, each save to a file of
+        // its own so that concurrent ones do not interleave
+        std::string tmp_path = index_path + ".XXXXXX";
+        int fd = mkstemp(tmp_path.data());
+        if (fd == -1)
+            return false;
+
+        close(fd);
+        std::ofstream index_file(tmp_path, std::ios::out | std::ios::trunc | std::ios::binary);
+        if (!index_file.is_open())
+        {
+            unlink(tmp_path.c_str());
+            return false;
+        }
+
+        index_file.write(reinterpret_cast<const char*>(&index_header), sizeof(index_header));
+
+        uint64_t path_offset = 0;
+        for (auto& [path, record]: entries)
+        {
+            stored_entry stored{
+                path_offset, record.offset, record.length, (uint32_t) path.size(), record.record_type, {}};
+            index_file.write(reinterpret_cast<const char*>(&stored), sizeof(stored));
+            path_offset += path.size();
+        }
+
+        for (auto& [path, record]: entries)
+            index_file.write(path.data(), (std::streamsize) path.size());
+
+        // The file was created owner-only, it gets the permissions of any other new file
+        mode_t mask = umask(0);
+        umask(mask);
+
+        index_file.close();
+        if (!index_file || chmod(tmp_path.c_str(), 0666 & ~mask) != 0
+            || rename(tmp_path.c_str(), index_path.c_str()) != 0)
+        {
+            unlink(tmp_path.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+    static constexpr char INDEX_MAGIC[8] = {'V', 'S', 'F', 'S', 'I', 'D', 'X', '1'};
+
+    struct header
+    {
+        char magic[8];
+        uint64_t fs_size;
+        int64_t fs_mtime_sec;
+        int64_t fs_mtime_nsec;
+        uint64_t entry_count;
+    };
+
+    struct stored_entry
+    {
+        uint64_t path_offset;
+        uint64_t offset;
+        uint64_t length;
+        uint32_t path_length;
+        char record_type;
+        char padding[3];
+    };
+
+    [[nodiscard]] std::string_view get_path(const stored_entry& stored) const
+    {
+        return m_paths.substr(stored.path_offset, stored.path_length);
+    }
+
+    [[nodiscard]] static entry to_entry(const stored_entry& stored)
+    {
+        return {stored.record_type, stored.offset, stored.length};
+    }
+
+    // Changes to the path, starting off with its stored entries
+    std::vector<entry>& get_changes(std::string_view path)
+    {
+        auto changed = m_changes.find(path);
+        if (changed != m_changes.end())
+            return changed->second;
+
+        std::vector<entry> records;
+        for (const stored_entry* stored = lower_bound(path);
+            stored != stored_end() && get_path(*stored) == path; stored++)
+        {
+            records.push_back(to_entry(*stored));
+        }
+
+        return m_changes.emplace(std::string(path), std::move(records)).first->second;
+    }
+
+    [[nodiscard]] const stored_entry* stored_end() const
+    {
+        return m_entries ? m_entries + m_header->entry_count : nullptr;
+    }
+
+    // First stored entry whose path is not less than the given path, entries of the same path are ordered by offset
+    [[nodiscard]] const stored_entry* lower_bound(std::string_view path) const
+    {
+        return std::lower_bound(m_entries, stored_end(), path, [&](const stored_entry& stored, std::string_view key)
+        {
+            return get_path(stored) < key;
+        });
+    }
+
+    fs_map m_mapping;
+    const header* m_header = nullptr;
+    const stored_entry* m_entries = nullptr;
+    std::string_view m_paths;
+
+    // Changes since the index was opened, every occurrence of a changed path ordered by offset
+    std::map<std::string, std::vector<entry>, std::less<>> m_changes;
+};
+
+#endif // FS_INDEX_H
@@ -0,0 +1,282 @@
+#ifndef FS_JOURNAL_H
+#define FS_JOURNAL_H
+
+#include "vsfs_constants.h"
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/**
+ * Class that represents the journal of an FS, an append-only log next to it that makes changes durable and atomic.
+ *
+ * Changes are made in groups. Before a group appends to the FS, the FS' size is logged and synced, so that appends of a
+ * group that never committed can be rolled back. Lines the group deletes are only kept aside. On commit, the appends
+ * are synced, then the deleted lines are logged and synced in one record and only then written to the FS. A group
+ * costs three syncs however many changes it holds.
+ *
+ * The journal is locked for as long as it is open, so only one process changes the FS at a time. Opening it recovers
+ * the FS, replaying the deletions of committed groups and truncating the appends of a group left open. Once the
+ * journal grows past a size, the FS is synced and the journal emptied.
+ */
+class fs_journal
+{
+public:
+    fs_journal() = default;
+
+    ~fs_journal()
+    {
+        close();
+    }
+
+    // A journal is uniquely owned
+    fs_journal(const fs_journal&) = delete;
+    fs_journal& operator=(const fs_journal&) = delete;
+
+    // Open and lock the journal, creating it if missing, and recover the FS from any group that did not complete
+    bool open(const std::string& journal_path, const std::string& fs_path)
+    {
+        close();
+
+        m_journal_fd = ::open(journal_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if (m_journal_fd == -1 || flock(m_journal_fd, LOCK_EX) != 0 || !reopen(fs_path) || !recover())
+        {
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    // Open the FS again once it was replaced at the given path, the journal must have been checkpointed
+    bool reopen(const std::string& fs_path)
+    {
+        if (m_fs_fd != -1)
+            ::close(m_fs_fd);
+
+        m_fs_fd = ::open(fs_path.c_str(), O_RDWR | O_CLOEXEC);
+        return m_fs_fd != -1;
+    }
+
+    // Start a group before the FS is appended to, nothing is done if one is already started
+    bool begin()
+    {
+        if (m_is_begun)
+            return true;
+
+        struct stat fs_attr{};
+        if (fstat(m_fs_fd, &fs_attr) != 0 || !log(BEGIN_RECORD, (uint64_t) fs_attr.st_size, {}))
+            return false;
+
+        m_is_begun = true;
+        return true;
+    }
+
+    // Delete the line at the given offset of the FS once the group commits
+    void delete_line(uint64_t offset)
+    {
+        if (m_deleted_offsets.insert(offset).second)
+            m_deleted_lines.push_back(offset);
+    }
+
+    // Whether the line at the given offset of the FS is deleted once the group commits
+    [[nodiscard]] bool is_deleted(uint64_t offset) const
+    {
+        return m_deleted_offsets.count(offset) > 0;
+    }
+
+    // Commit the group, anything appended to the FS must have been flushed
+    bool commit()
+    {
+        if (!m_is_begun && m_deleted_lines.empty())
+            return true;
+
+        struct stat fs_attr{};
+        if (fstat(m_fs_fd, &fs_attr) != 0
+            || (m_is_begun && fdatasync(m_fs_fd) != 0)
+            || !log(COMMIT_RECORD, (uint64_t) fs_attr.st_size, m_deleted_lines)
+            || !delete_lines(m_deleted_lines))
+        {
+            return false;
+        }
+
+        m_is_begun = false;
+        m_deleted_lines.clear();
+        m_deleted_offsets.clear();
+
+        return m_journal_size < CHECKPOINT_SIZE || checkpoint();
+    }
+
+    // Commit, then sync the FS and empty the journal
+    bool checkpoint()
+    {
+        if (!commit() || fdatasync(m_fs_fd) != 0 || ftruncate(m_journal_fd, 0) != 0 || fdatasync(m_journal_fd) != 0)
+            return false;
+
+        m_journal_size = 0;
+        return true;
+    }
+
+    void close()
+    {
+        // Unlocks the journal
+        if (m_journal_fd != -1)
+            ::close(m_journal_fd);
+        if (m_fs_fd != -1)
+            ::close(m_fs_fd);
+
+        m_journal_fd = m_fs_fd = -1;
+        m_journal_size = 0;
+        m_is_begun = false;
+        m_deleted_lines.clear();
+        m_deleted_offsets.clear();
+    }
+
+private:
+    static constexpr char JOURNAL_MAGIC[4] = {'V', 'S', 'J', '1'};
+    static constexpr uint32_t BEGIN_RECORD = 1;
+    static constexpr uint32_t COMMIT_RECORD = 2;
+
+    // The journal is emptied once it grows past this size
+    static constexpr size_t CHECKPOINT_SIZE = 1024 * 1024;
+
+    // Followed by the offsets of the deleted lines of a commit
+    struct record_header
+    {
+        char magic[4];
+        uint32_t record_type;
+        // Size of the FS as the group begun or committed
+        uint64_t fs_size;
+        uint64_t deleted_count;
+        // Checksum of the header, with the checksum zeroed, and the offsets
+        uint32_t checksum;
+        uint32_t padding;
+    };
+
+    [[nodiscard]] static uint32_t get_checksum(record_header header, const uint64_t* deleted_lines)
+    {
+        header.checksum = 0;
+        uLong checksum = crc32(0L, reinterpret_cast<const Bytef*>(&header), sizeof(header));
+
+        // zlib resets the checksum if given no data at all
+        if (header.deleted_count > 0)
+        {
+            checksum = crc32(checksum, reinterpret_cast<const Bytef*>(deleted_lines),
+                (uInt) (header.deleted_count * sizeof(uint64_t)));
+        }
+
+        return (uint32_t) checksum;
+    }
+
+    // Append a record to the journal and sync it
+    bool log(uint32_t record_type, uint64_t fs_size, const std::vector<uint64_t>& deleted_lines)
+    {
+        record_header header{};
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.record_type = record_type;
+        header.fs_size = fs_size;
+        header.deleted_count = deleted_lines.size();
+        header.checksum = get_checksum(header, deleted_lines.data());
+
+        std::string record(reinterpret_cast<const char*>(&header), sizeof(header));
+        record.append(reinterpret_cast<const char*>(deleted_lines.data()), deleted_lines.size() * sizeof(uint64_t));
+
+        for (size_t written = 0; written < record.size();)
+        {
+            ssize_t written_size = write(m_journal_fd, record.data() + written, record.size() - written);
+            if (written_size <= 0)
+                return false;
+
+            written += (size_t) written_size;
+        }
+
+        m_journal_size += record.size();
+        return fdatasync(m_journal_fd) == 0;
+    }
+
+    // Write the deleted record identifier over the first character of each line
+    bool delete_lines(const std::vector<uint64_t>& deleted_lines)
+    {
+        for (uint64_t offset: deleted_lines)
+        {
+            if (pwrite(m_fs_fd, &DELETED_RECORD_IDENTIFIER, 1, (off_t) offset) != 1)
+                return false;
+        }
+
+        return true;
+    }
+
+    // Replay the deletions of committed groups, roll back the appends of a group left open, then empty the journal
+    bool recover()
+    {
+        struct stat journal_attr{};
+        if (fstat(m_journal_fd, &journal_attr) != 0)
+            return false;
+        if (journal_attr.st_size == 0)
+            return true;
+
+        std::string journal((size_t) journal_attr.st_size, '\0');
+        if (pread(m_journal_fd, journal.data(), journal.size(), 0) != (ssize_t) journal.size())
+            return false;
+
+        // A record that is incomplete or does not match its checksum was never synced, nor is any after it
+        std::vector<uint64_t> deleted_lines;
+        bool is_open{};
+        uint64_t open_size{};
+        for (size_t offset = 0; offset + sizeof(record_header) <= journal.size();)
+        {
+            record_header header{};
+            memcpy(&header, journal.data() + offset, sizeof(header));
+
+            size_t deleted_size = header.deleted_count * sizeof(uint64_t);
+            if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0
+                || header.deleted_count > (journal.size() - offset - sizeof(header)) / sizeof(uint64_t))
+            {
+                break;
+            }
+
+            std::vector<uint64_t> record_lines(header.deleted_count);
+            memcpy(record_lines.data(), journal.data() + offset + sizeof(header), deleted_size);
+            if (header.checksum != get_checksum(header, record_lines.data()))
+                break;
+
+            is_open = header.record_type == BEGIN_RECORD;
+            if (is_open)
+                open_size = header.fs_size;
+            else
+                deleted_lines.insert(deleted_lines.end(), record_lines.begin(), record_lines.end());
+
+            offset += sizeof(header) + deleted_size;
+        }
+
+        struct stat fs_attr{};
+        if (fstat(m_fs_fd, &fs_attr) != 0)
+            return false;
+
+        if (is_open && (uint64_t) fs_attr.st_size > open_size && ftruncate(m_fs_fd, (off_t) open_size) != 0)
+            return false;
+
+        return delete_lines(deleted_lines)
+            && fdatasync(m_fs_fd) == 0
+            && ftruncate(m_journal_fd, 0) == 0
+            && fdatasync(m_journal_fd) == 0;
+    }
+
+    int m_journal_fd = -1;
+    int m_fs_fd = -1;
+    size_t m_journal_size{};
+
+    // State of the current group
+    bool m_is_begun{};
+    std::vector<uint64_t> m_deleted_lines;
+    std::unordered_set<uint64_t> m_deleted_offsets;
+};
+
+#endif // FS_JOURNAL_H
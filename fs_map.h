@@ -0,0 +1,102 @@
+#ifndef FS_MAP_H
+#define FS_MAP_H
+
+#include <string>
+#include <algorithm>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Class that represents a read-only memory mapping of an FS.
+ */
+class fs_map
+{
+public:
+    fs_map() = default;
+
+    ~fs_map()
+    {
+        unmap();
+    }
+
+    // A mapping is uniquely owned
+    fs_map(const fs_map&) = delete;
+    fs_map& operator=(const fs_map&) = delete;
+
+    bool map(const std::string& path)
+    {
+        unmap();
+
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+
+        struct stat attr{};
+        if (fstat(fd, &attr) == -1)
+        {
+            close(fd);
+            return false;
+        }
+
+        // Empty files cannot be mapped, represent them with an empty view instead
+        m_size = (size_t) attr.st_size;
+        if (m_size > 0)
+        {
+            void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                close(fd);
+                m_size = 0;
+                return false;
+            }
+
+            // Records are read front to back
+            madvise(data, m_size, MADV_SEQUENTIAL);
+            m_data = static_cast<const char*>(data);
+        }
+
+        // The mapping stays valid after the descriptor is closed
+        close(fd);
+        return true;
+    }
+
+    // Drop already read pages from memory, they are read back in from the FS if accessed again
+    void drop_before(size_t offset)
+    {
+        // Pages are dropped a window at a time to keep the number of calls low
+        size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+        size_t drop_end = std::min(offset, m_size) / page_size * page_size;
+        if (drop_end < m_dropped + DROP_WINDOW)
+            return;
+
+        madvise(const_cast<char*>(m_data) + m_dropped, drop_end - m_dropped, MADV_DONTNEED);
+        m_dropped = drop_end;
+    }
+
+    void unmap()
+    {
+        if (m_data)
+            munmap(const_cast<char*>(m_data), m_size);
+
+        m_data = nullptr;
+        m_size = 0;
+        m_dropped = 0;
+    }
+
+    [[nodiscard]] std::string_view get_data() const
+    {
+        return {m_data, m_size};
+    }
+
+private:
+    static constexpr size_t DROP_WINDOW = 32 * 1024 * 1024;
+
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_dropped = 0;
+};
+
+#endif // FS_MAP_H
@@ -0,0 +1,140 @@
+#ifndef FS_POOL_H
+#define FS_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Class that represents a pool of threads running tasks that may submit further tasks, until none are left.
+ *
+ * Each worker keeps a queue of its own and runs the task it submitted last first. Once its queue is empty, it steals
+ * the task another worker submitted first, which in a recursion is the one nearest the root and so carries the most
+ * work with it.
+ */
+class fs_pool
+{
+public:
+    using task = std::function<void()>;
+
+    explicit fs_pool(unsigned int thread_count) : m_queues(std::max(1u, thread_count))
+    {}
+
+    // A pool is uniquely owned
+    fs_pool(const fs_pool&) = delete;
+    fs_pool& operator=(const fs_pool&) = delete;
+
+    // Submit a task, to the queue of the worker running the task that submits it
+    void submit(task work)
+    {
+        m_pending++;
+
+        task_queue& queue = m_queues[s_worker < m_queues.size() ? s_worker : 0];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(work));
+        }
+
+        m_queued++;
+
+        // Wake an idle worker, which checks for queued tasks under the same lock
+        std::lock_guard<std::mutex> lock(m_idle_mutex);
+        m_idle.notify_one();
+    }
+
+    // Run the tasks submitted and every task they submit on the pool's threads, the calling one included
+    void run()
+    {
+        std::vector<std::thread> threads;
+        for (unsigned int worker = 1; worker < m_queues.size(); worker++)
+            threads.emplace_back(&fs_pool::work, this, worker);
+
+        work(0);
+
+        for (std::thread& thread: threads)
+            thread.join();
+    }
+
+private:
+    struct task_queue
+    {
+        std::mutex mutex;
+        std::deque<task> tasks;
+    };
+
+    // Take the newest task of the worker's own queue, or else the oldest of another's
+    bool take(unsigned int worker, task& next)
+    {
+        for (size_t i = 0; i < m_queues.size(); i++)
+        {
+            task_queue& queue = m_queues[(worker + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+                continue;
+
+            if (i == 0)
+            {
+                next = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else
+            {
+                next = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+
+            m_queued--;
+            return true;
+        }
+
+        return false;
+    }
+
+    void work(unsigned int worker)
+    {
+        s_worker = worker;
+
+        task next;
+        while (true)
+        {
+            if (take(worker, next))
+            {
+                next();
+                next = nullptr;
+
+                // The last task to finish releases the workers waiting for more
+                if (--m_pending == 0)
+                {
+                    std::lock_guard<std::mutex> lock(m_idle_mutex);
+                    m_idle.notify_all();
+                }
+
+                continue;
+            }
+
+            // Nothing to take, wait for a task to be submitted or every task to have run
+            std::unique_lock<std::mutex> lock(m_idle_mutex);
+            m_idle.wait(lock, [this] { return m_queued > 0 || m_pending == 0; });
+            if (m_pending == 0)
+                return;
+        }
+    }
+
+    std::vector<task_queue> m_queues;
+
+    // Tasks submitted that have not finished running, and those of them still in a queue
+    std::atomic<size_t> m_pending{0};
+    std::atomic<size_t> m_queued{0};
+
+    std::mutex m_idle_mutex;
+    std::condition_variable m_idle;
+
+    // Worker the calling thread is, 0 for any thread outside the pool
+    static inline thread_local unsigned int s_worker = 0;
+};
+
+#endif // FS_POOL_H
@@ -0,0 +1,281 @@
+#ifndef FS_V2_H
+#define FS_V2_H
+
+#include "fs_map.h"
+#include "vsfs_constants.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+
+/**
+ * Class that represents an FS in the NOTES V2.0 format, read through a mapping.
+ *
+ * After the first record, the FS holds a header with its record counts, then each record as a fixed-size header
+ * followed by its path and payload, and last a directory of where each record is. The directory is a hash table of
+ * record offsets by path with linear probing, 0 marking an empty slot, so a record is found without reading the others.
+ * A file's payload is the bytes of the EF it was copied in from, its header telling text from binary, and a dir's is
+ * empty.
+ *
+ * Every header and slot is stored little-endian whatever the host's byte order, and encoded and decoded field by field:
+ * the FS header is the file count, dir count and directory offset, each 8 bytes, and a record's header its line count
+ * and payload size, each 8 bytes, then its path size in 4 bytes, its type, its content type and 2 bytes of padding.
+ */
+class fs_v2
+{
+public:
+    struct header
+    {
+        uint64_t file_count;
+        uint64_t dir_count;
+        // Offset of the directory, which ends the FS
+        uint64_t directory_offset;
+    };
+
+    struct record_header
+    {
+        // Number of lines the content takes in NOTES V1.0, which list reports
+        uint64_t line_count;
+        uint64_t payload_size;
+        uint32_t path_size;
+        char record_type;
+        uint8_t content_type;
+    };
+
+    struct record
+    {
+        char record_type;
+        std::string_view path;
+        uint64_t line_count;
+        std::string_view payload;
+        bool is_binary;
+    };
+
+    // Content types of a file, whose payload is kept as text lines or base64 encoded in NOTES V1.0
+    static constexpr uint8_t TEXT_CONTENT = 0;
+    static constexpr uint8_t BINARY_CONTENT = 1;
+
+    // Sizes of the FS header, a record's header and a directory slot as stored
+    static constexpr size_t HEADER_SIZE = 24;
+    static constexpr size_t RECORD_HEADER_SIZE = 24;
+    static constexpr size_t SLOT_SIZE = 8;
+
+    fs_v2() = default;
+
+    // An FS is uniquely owned
+    fs_v2(const fs_v2&) = delete;
+    fs_v2& operator=(const fs_v2&) = delete;
+
+    // Map the FS at the given path, false if it cannot be mapped or its header or directory is malformed
+    bool open(const std::string& fs_path)
+    {
+        clear();
+        if (!m_mapping.map(fs_path))
+            return false;
+
+        m_data = m_mapping.get_data();
+        if (m_data.size() < get_records_offset() || !is_first_record(m_data))
+        {
+            clear();
+            return false;
+        }
+
+        m_header = decode_header(m_data.data() + get_header_offset());
+        bool is_valid = m_header.directory_offset >= get_records_offset()
+            && m_header.directory_offset <= m_data.size() - SLOT_SIZE;
+        if (is_valid)
+        {
+            m_slot_count = load_le(m_data.data() + m_header.directory_offset);
+            is_valid = m_slot_count > 0 && (m_slot_count & (m_slot_count - 1)) == 0
+                && m_slot_count == (m_data.size() - m_header.directory_offset) / SLOT_SIZE - 1
+                && (m_data.size() - m_header.directory_offset) % SLOT_SIZE == 0;
+        }
+
+        if (!is_valid)
+        {
+            clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    void clear()
+    {
+        m_mapping.unmap();
+        m_data = {};
+        m_header = {};
+        m_slot_count = 0;
+    }
+
+    [[nodiscard]] uint64_t get_file_count() const
+    {
+        return m_header.file_count;
+    }
+
+    [[nodiscard]] uint64_t get_dir_count() const
+    {
+        return m_header.dir_count;
+    }
+
+    // Find the record at the given path through the directory
+    [[nodiscard]] std::optional<record> find(std::string_view path) const
+    {
+        for (uint64_t slot = hash_path(path) & (m_slot_count - 1);; slot = (slot + 1) & (m_slot_count - 1))
+        {
+            uint64_t offset = get_slot(slot);
+            record found{};
+            if (offset == 0 || !read_record(offset, found))
+                return std::nullopt;
+
+            if (found.path == path)
+                return found;
+        }
+    }
+
+    /*
+     * Call on_record(const record&) for every record in order of the FS. Walking stops early when on_record returns
+     * false, in which case false is returned, as it is for a malformed record.
+     */
+    template<typename Callback>
+    bool for_each(Callback&& on_record) const
+    {
+        uint64_t offset = get_records_offset();
+        record next{};
+        while (offset < m_header.directory_offset)
+        {
+            if (!read_record(offset, next) || !on_record(next))
+                return false;
+        }
+
+        return offset == m_header.directory_offset;
+    }
+
+    // Whether the data starts with the first record of this format
+    static bool is_first_record(std::string_view fs_data)
+    {
+        std::string_view first_record = FS_V2_FIRST_RECORD;
+        return fs_data.size() > first_record.size() && fs_data.substr(0, first_record.size()) == first_record
+            && fs_data[first_record.size()] == '\n';
+    }
+
+    // FNV-1a hash of a path, the directory's slot for it being the hash modulo the number of slots
+    static uint64_t hash_path(std::string_view path)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (char c: path)
+        {
+            hash ^= (unsigned char) c;
+            hash *= 1099511628211ULL;
+        }
+
+        return hash;
+    }
+
+    // Number of directory slots for the given number of records, a power of 2 that keeps the table at most half full
+    static uint64_t get_slot_count(uint64_t record_count)
+    {
+        uint64_t slot_count = 1;
+        while (slot_count < record_count * 2)
+            slot_count *= 2;
+
+        return slot_count;
+    }
+
+    static uint64_t get_header_offset()
+    {
+        return strlen(FS_V2_FIRST_RECORD) + 1;
+    }
+
+    static uint64_t get_records_offset()
+    {
+        return get_header_offset() + HEADER_SIZE;
+    }
+
+    // Load a little-endian field of the given size
+    static uint64_t load_le(const char* data, size_t size = 8)
+    {
+        uint64_t value = 0;
+        for (size_t i = size; i > 0; i--)
+            value = value << 8 | (unsigned char) data[i - 1];
+
+        return value;
+    }
+
+    // Store a little-endian field of the given size
+    static void store_le(char* data, uint64_t value, size_t size = 8)
+    {
+        for (size_t i = 0; i < size; i++)
+            data[i] = (char) (value >> (8 * i) & 0xff);
+    }
+
+    static header decode_header(const char* data)
+    {
+        return {load_le(data), load_le(data + 8), load_le(data + 16)};
+    }
+
+    static void encode_header(const header& stored, char data[HEADER_SIZE])
+    {
+        store_le(data, stored.file_count);
+        store_le(data + 8, stored.dir_count);
+        store_le(data + 16, stored.directory_offset);
+    }
+
+    static record_header decode_record_header(const char* data)
+    {
+        return {load_le(data), load_le(data + 8), (uint32_t) load_le(data + 16, 4), data[20], (uint8_t) data[21]};
+    }
+
+    static void encode_record_header(const record_header& stored, char data[RECORD_HEADER_SIZE])
+    {
+        store_le(data, stored.line_count);
+        store_le(data + 8, stored.payload_size);
+        store_le(data + 16, stored.path_size, 4);
+        data[20] = stored.record_type;
+        data[21] = (char) stored.content_type;
+        data[22] = data[23] = '\0';
+    }
+
+private:
+    [[nodiscard]] uint64_t get_slot(uint64_t slot) const
+    {
+        return load_le(m_data.data() + m_header.directory_offset + (slot + 1) * SLOT_SIZE);
+    }
+
+    // Read the record at offset, advancing offset past it, false if it does not lie within the records
+    bool read_record(uint64_t& offset, record& next) const
+    {
+        if (offset < get_records_offset() || offset > m_header.directory_offset
+            || m_header.directory_offset - offset < RECORD_HEADER_SIZE)
+        {
+            return false;
+        }
+
+        record_header stored = decode_record_header(m_data.data() + offset);
+        uint64_t record_end = offset + RECORD_HEADER_SIZE;
+        if (m_header.directory_offset - record_end < stored.path_size
+            || m_header.directory_offset - record_end - stored.path_size < stored.payload_size
+            || stored.content_type > BINARY_CONTENT)
+        {
+            return false;
+        }
+
+        next.record_type = stored.record_type;
+        next.path = m_data.substr(record_end, stored.path_size);
+        next.line_count = stored.line_count;
+        next.payload = m_data.substr(record_end + stored.path_size, stored.payload_size);
+        next.is_binary = stored.content_type == BINARY_CONTENT;
+        offset = record_end + stored.path_size + stored.payload_size;
+        return true;
+    }
+
+    fs_map m_mapping;
+    std::string_view m_data;
+    header m_header{};
+    uint64_t m_slot_count = 0;
+};
+
+#endif // FS_V2_H
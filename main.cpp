@@ -7,6 +7,10 @@
 #include "vsfs_rm.h"
 #include "vsfs_rmdir.h"
 #include "vsfs_defrag.h"
+#include "vsfs_stats.h"
+#include "vsfs_batch.h"
+#include "vsfs_serve.h"
+#include "vsfs_convert.h"
 
 int main(int argc, char** argv)
 {
@@ -18,6 +22,10 @@ int main(int argc, char** argv)
             fprintf(stderr, "%s No commands provided\n", VSFS_ERROR_PREFIX);
             return EXIT_FAILURE;
         }
+        else if (argc > 2 && getenv(SOCKET_VARIABLE) && *getenv(SOCKET_VARIABLE) && is_command_served(argv[1]))
+        {
+            return forward_command(getenv(SOCKET_VARIABLE), argc, argv);
+        }
         else if (strcmp(argv[1], commands[LIST]) == 0)
         {
             return vsfs_list(argc, argv);
@@ -46,6 +54,22 @@ int main(int argc, char** argv)
         {
             return vsfs_defrag(argc, argv);
         }
+        else if (strcmp(argv[1], commands[STATS]) == 0)
+        {
+            return vsfs_stats(argc, argv);
+        }
+        else if (strcmp(argv[1], commands[CONVERT]) == 0)
+        {
+            return vsfs_convert(argc, argv);
+        }
+        else if (strcmp(argv[1], commands[BATCH]) == 0)
+        {
+            return vsfs_batch(argc, argv);
+        }
+        else if (strcmp(argv[1], commands[SERVE]) == 0)
+        {
+            return vsfs_serve(argc, argv);
+        }
         else
         {
             fprintf(stderr, "%s Unknown command \"%s\"\n", VSFS_ERROR_PREFIX, argv[1]);
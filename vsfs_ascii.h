@@ -0,0 +1,224 @@
+#ifndef VSFS_ASCII_H
+#define VSFS_ASCII_H
+
+#include "fs_map.h"
+
+#include <string>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VSFS_ASCII_X86
+#endif
+
+/*
+ * Tells ASCII text from binary data in-process, in place of the "file" command.
+ *
+ * Text is made of printable characters, BEL, BS, HT, LF, VT, FF, CR and ESC, the same bytes libmagic accepts as ASCII
+ * text. The whole file is checked, by an AVX2 or SSE2 implementation picked at runtime with a scalar fallback.
+ *
+ * Files that are not plain ASCII go through the rest of libmagic's text encodings, as "file" reported some of those
+ * as "Non-ISO extended-ASCII text". Results of libmagic's magic patterns, e.g. "JSON text data", are not reproduced.
+ */
+
+// Signature shared by the implementations of is_ascii
+using is_ascii_kernel = bool (*)(const char* data, size_t size);
+
+// Checks data given a part at a time, telling whether it is in ASCII format as is_data_ascii does the whole of it
+class ascii_check
+{
+public:
+    // Check the next part of the data
+    void add(std::string_view part);
+
+    // Whether the parts added so far, taken as a whole, are in ASCII format
+    bool is_data_ascii() const;
+
+private:
+    bool is_empty = true;
+
+    // Only ASCII text so far, the other members are only kept once it is not
+    bool is_plain = true;
+
+    // Bytes below 0x80 are all text, some of those from 0x80 to 0x9F were seen, and all is valid UTF-8 so far
+    bool is_text = true;
+    bool has_extended = false;
+    bool is_utf8 = true;
+
+    // Continuation bytes the last UTF-8 sequence is still waiting for
+    int following = 0;
+};
+
+/*
+ * Declarations
+ */
+
+// Check whether the data is only made of ASCII text characters
+bool is_ascii(std::string_view data);
+
+// Check whether the data is in ASCII format as a whole file would be, empty data is not
+bool is_data_ascii(std::string_view data);
+
+// Check whether the file is in ASCII format, empty and missing files are not
+bool is_file_ascii(const std::string& path);
+
+// Implementations of is_ascii, for when a specific one is to be used
+bool is_ascii_scalar(const char* data, size_t size);
+
+#ifdef VSFS_ASCII_X86
+bool is_ascii_sse2(const char* data, size_t size);
+
+bool is_ascii_avx2(const char* data, size_t size);
+#endif
+
+// Pick the fastest implementation of is_ascii the CPU supports
+is_ascii_kernel select_is_ascii();
+
+/*
+ * Definitions
+ */
+
+bool is_ascii(std::string_view data)
+{
+    static const is_ascii_kernel kernel = select_is_ascii();
+    return kernel(data.data(), data.size());
+}
+
+bool is_file_ascii(const std::string& path)
+{
+    fs_map file_mapping;
+    if (!file_mapping.map(path))
+        return false;
+
+    return is_data_ascii(file_mapping.get_data());
+}
+
+bool is_data_ascii(std::string_view data)
+{
+    ascii_check check;
+    check.add(data);
+    return check.is_data_ascii();
+}
+
+void ascii_check::add(std::string_view part)
+{
+    is_empty = is_empty && part.empty();
+    if (!is_text || (is_plain && is_ascii(part)))
+        return;
+
+    is_plain = false;
+    for (char c: part)
+    {
+        // Bytes outside of ASCII, those of ISO-8859 are 0xA0 and above, others are only used by extended ASCIIs
+        auto byte = (unsigned char) c;
+        if (byte < 0x80 && !is_ascii_scalar(&c, 1))
+        {
+            is_text = false;
+            return;
+        }
+
+        has_extended |= byte >= 0x80 && byte < 0xA0;
+        if (!is_utf8)
+            continue;
+
+        if (following > 0)
+        {
+            is_utf8 = (byte & 0xC0) == 0x80;
+            following--;
+            continue;
+        }
+
+        if (byte < 0x80)
+            continue;
+
+        // Continuation bytes may not start a sequence
+        following = !(byte & 0x40) ? -1 : !(byte & 0x20) ? 1 : !(byte & 0x10) ? 2 : !(byte & 0x08) ? 3
+            : !(byte & 0x04) ? 4 : !(byte & 0x02) ? 5 : -1;
+        is_utf8 = following >= 0;
+    }
+}
+
+bool ascii_check::is_data_ascii() const
+{
+    // Text of an extended ASCII is neither ISO-8859 only nor valid UTF-8, where a truncated last sequence still counts
+    return !is_empty && (is_plain || (is_text && has_extended && !is_utf8));
+}
+
+bool is_ascii_scalar(const char* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        auto c = (unsigned char) data[i];
+        bool is_text = (c >= ' ' && c < 0x7F) || (c >= '\a' && c <= '\r') || c == 0x1B;
+        if (!is_text)
+            return false;
+    }
+
+    return true;
+}
+
+#ifdef VSFS_ASCII_X86
+
+/*
+ * Both vector implementations compare bytes as signed, so bytes of 0x80 and above fall below every range of text
+ * characters without a check of their own.
+ */
+
+__attribute__((target("sse2")))
+bool is_ascii_sse2(const char* data, size_t size)
+{
+    size_t block = 0;
+    for (; block + 16 <= size; block += 16)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + block));
+        __m128i printable = _mm_andnot_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(0x7F)),
+            _mm_cmpgt_epi8(bytes, _mm_set1_epi8(' ' - 1)));
+        __m128i control = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('\a' - 1)),
+            _mm_cmplt_epi8(bytes, _mm_set1_epi8('\r' + 1)));
+        __m128i escape = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(0x1B));
+
+        __m128i text = _mm_or_si128(printable, _mm_or_si128(control, escape));
+        if (_mm_movemask_epi8(text) != 0xFFFF)
+            return false;
+    }
+
+    return is_ascii_scalar(data + block, size - block);
+}
+
+__attribute__((target("avx2")))
+bool is_ascii_avx2(const char* data, size_t size)
+{
+    size_t block = 0;
+    for (; block + 32 <= size; block += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + block));
+        __m256i printable = _mm256_andnot_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(0x7F)),
+            _mm256_cmpgt_epi8(bytes, _mm256_set1_epi8(' ' - 1)));
+        __m256i control = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('\a' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), bytes));
+        __m256i escape = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(0x1B));
+
+        __m256i text = _mm256_or_si256(printable, _mm256_or_si256(control, escape));
+        if ((uint32_t) _mm256_movemask_epi8(text) != 0xFFFFFFFF)
+            return false;
+    }
+
+    return is_ascii_scalar(data + block, size - block);
+}
+
+#endif // VSFS_ASCII_X86
+
+is_ascii_kernel select_is_ascii()
+{
+#ifdef VSFS_ASCII_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return is_ascii_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return is_ascii_sse2;
+#endif
+    return is_ascii_scalar;
+}
+
+#endif // VSFS_ASCII_H
@@ -0,0 +1,399 @@
+#ifndef VSFS_BASE64_H
+#define VSFS_BASE64_H
+
+#include "vsfs_constants.h"
+
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <streambuf>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VSFS_BASE64_X86
+#endif
+
+/*
+ * Encodes and decodes base64 in-process, streaming between files and the FS a chunk at a time.
+ *
+ * Both directions have an SSSE3 implementation that handles 16 characters per step, picked at runtime, with a scalar
+ * fallback. Encoded output is wrapped like that of "base64 -w", so records written by copyin stay byte-identical.
+ */
+
+// Signatures shared by the implementations of the codec
+using base64_encode_kernel = size_t (*)(const unsigned char* data, size_t size, char* encoded);
+using base64_decode_kernel = size_t (*)(const char* encoded, size_t size, unsigned char* data, bool& is_valid);
+
+// Read-only stream buffer over data that is already in memory
+class view_buffer : public std::streambuf
+{
+public:
+    explicit view_buffer(std::string_view data)
+    {
+        char* start = const_cast<char*>(data.data());
+        setg(start, start, start + data.size());
+    }
+};
+
+// Decodes base64 given a part at a time, as base64_decode does the whole of it
+class base64_decoder
+{
+public:
+    base64_decoder();
+
+    // Decode the next part of the encoded data into out, '\n' are skipped, false if it is not valid base64
+    bool decode(std::string_view encoded, std::ostream& out);
+
+    // Whether the encoded data decoded so far ends with a whole group
+    bool is_complete() const;
+
+private:
+    std::vector<char> groups;
+    std::vector<unsigned char> data;
+
+    // Characters of a group of 4 that was split across parts
+    size_t group_fill = 0;
+    bool is_padded = false;
+};
+
+/*
+ * Declarations
+ */
+
+/*
+ * Encode everything read from data into out, wrapped into lines of line_width characters and the last line holding
+ * the remainder, each line starting with line_prefix unless it is '\0' and ending with '\n'. Nothing is written for
+ * empty data.
+ **/
+void base64_encode(std::streambuf& data, std::ostream& out, size_t line_width, char line_prefix);
+
+// Decode everything read from encoded into out, '\n' are skipped, false if the input is not valid base64
+bool base64_decode(std::streambuf& encoded, std::ostream& out);
+
+/*
+ * Encode size bytes of data with padding into encoded, which must have room for 4 characters per 3 bytes plus 16.
+ * Returns the number of characters written.
+ **/
+size_t base64_encode_scalar(const unsigned char* data, size_t size, char* encoded);
+
+/*
+ * Decode size characters, a multiple of 4, into data, which must have room for 3 bytes per 4 characters plus 16.
+ * Padding may only end the last 4 characters. Returns the number of bytes written, is_valid is false if the
+ * characters were not valid base64, in which case only the bytes before the first invalid group are written.
+ **/
+size_t base64_decode_scalar(const char* encoded, size_t size, unsigned char* data, bool& is_valid);
+
+#ifdef VSFS_BASE64_X86
+size_t base64_encode_ssse3(const unsigned char* data, size_t size, char* encoded);
+
+size_t base64_decode_ssse3(const char* encoded, size_t size, unsigned char* data, bool& is_valid);
+#endif
+
+// Pick the fastest implementations of the codec the CPU supports
+base64_encode_kernel select_base64_encode();
+
+base64_decode_kernel select_base64_decode();
+
+/*
+ * Definitions
+ */
+
+constexpr char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+constexpr char BASE64_PADDING = '=';
+
+// Bytes read at a time, a multiple of 3 so that only the last chunk is padded
+constexpr size_t BASE64_CHUNK_SIZE = 3 * 16 * 1024;
+
+// Read until the buffer is full or there is no more data
+size_t read_chunk(std::streambuf& in, char* buffer, size_t size)
+{
+    size_t total = 0;
+    while (total < size)
+    {
+        std::streamsize count = in.sgetn(buffer + total, (std::streamsize) (size - total));
+        if (count <= 0)
+            break;
+
+        total += (size_t) count;
+    }
+
+    return total;
+}
+
+void base64_encode(std::streambuf& data, std::ostream& out, size_t line_width, char line_prefix)
+{
+    static const base64_encode_kernel kernel = select_base64_encode();
+
+    std::vector<char> chunk(BASE64_CHUNK_SIZE);
+    std::vector<char> encoded(BASE64_CHUNK_SIZE / 3 * 4 + 16);
+    std::string lines;
+
+    // Characters on the current line, lines carry over from one chunk to the next
+    size_t line_fill = 0;
+
+    size_t chunk_size;
+    while ((chunk_size = read_chunk(data, chunk.data(), chunk.size())) > 0)
+    {
+        size_t encoded_size = kernel(reinterpret_cast<const unsigned char*>(chunk.data()), chunk_size, encoded.data());
+
+        // Wrap the encoded characters into lines
+        lines.clear();
+        for (size_t encoded_start = 0; encoded_start < encoded_size;)
+        {
+            if (line_fill == 0 && line_prefix)
+                lines.push_back(line_prefix);
+
+            size_t count = std::min(line_width - line_fill, encoded_size - encoded_start);
+            lines.append(encoded.data() + encoded_start, count);
+            encoded_start += count;
+            line_fill += count;
+
+            if (line_fill == line_width)
+            {
+                lines.push_back('\n');
+                line_fill = 0;
+            }
+        }
+
+        out.write(lines.data(), (std::streamsize) lines.size());
+    }
+
+    // Terminate the last line
+    if (line_fill > 0)
+        out.put('\n');
+}
+
+bool base64_decode(std::streambuf& encoded, std::ostream& out)
+{
+    std::vector<char> chunk(BASE64_CHUNK_SIZE);
+    base64_decoder decoder;
+
+    size_t chunk_size;
+    while ((chunk_size = read_chunk(encoded, chunk.data(), chunk.size())) > 0)
+    {
+        if (!decoder.decode(std::string_view(chunk.data(), chunk_size), out))
+            return false;
+    }
+
+    // Input must end with a whole group
+    return decoder.is_complete();
+}
+
+base64_decoder::base64_decoder() : groups(BASE64_CHUNK_SIZE + 4), data(BASE64_CHUNK_SIZE / 4 * 3 + 16)
+{
+}
+
+bool base64_decoder::decode(std::string_view encoded, std::ostream& out)
+{
+    static const base64_decode_kernel kernel = select_base64_decode();
+
+    // Parts are decoded a chunk at a time, so the buffers are never outgrown
+    for (size_t chunk_start = 0; chunk_start < encoded.size(); chunk_start += BASE64_CHUNK_SIZE)
+    {
+        std::string_view chunk = encoded.substr(chunk_start, BASE64_CHUNK_SIZE);
+
+        // Line breaks may split groups, drop them to decode whole groups
+        size_t groups_size = group_fill;
+        for (char c: chunk)
+        {
+            if (c != '\n')
+                groups[groups_size++] = c;
+        }
+
+        // Nothing may follow padding
+        if (is_padded && groups_size > 0)
+            return false;
+
+        size_t whole_size = groups_size / 4 * 4;
+        bool is_valid;
+        size_t data_size = kernel(groups.data(), whole_size, data.data(), is_valid);
+        out.write(reinterpret_cast<const char*>(data.data()), (std::streamsize) data_size);
+        if (!is_valid)
+            return false;
+
+        is_padded = whole_size > 0 && groups[whole_size - 1] == BASE64_PADDING;
+
+        // Keep the characters of an incomplete group for the next chunk
+        group_fill = groups_size - whole_size;
+        memmove(groups.data(), groups.data() + whole_size, group_fill);
+    }
+
+    return true;
+}
+
+bool base64_decoder::is_complete() const
+{
+    return group_fill == 0;
+}
+
+size_t base64_encode_scalar(const unsigned char* data, size_t size, char* encoded)
+{
+    char* out = encoded;
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3)
+    {
+        uint32_t triple = (uint32_t) data[i] << 16 | (uint32_t) data[i + 1] << 8 | data[i + 2];
+        *out++ = BASE64_ALPHABET[triple >> 18 & 0x3F];
+        *out++ = BASE64_ALPHABET[triple >> 12 & 0x3F];
+        *out++ = BASE64_ALPHABET[triple >> 6 & 0x3F];
+        *out++ = BASE64_ALPHABET[triple & 0x3F];
+    }
+
+    // Pad the last group
+    if (i < size)
+    {
+        uint32_t triple = (uint32_t) data[i] << 16 | (i + 1 < size ? (uint32_t) data[i + 1] << 8 : 0);
+        *out++ = BASE64_ALPHABET[triple >> 18 & 0x3F];
+        *out++ = BASE64_ALPHABET[triple >> 12 & 0x3F];
+        *out++ = i + 1 < size ? BASE64_ALPHABET[triple >> 6 & 0x3F] : BASE64_PADDING;
+        *out++ = BASE64_PADDING;
+    }
+
+    return (size_t) (out - encoded);
+}
+
+size_t base64_decode_scalar(const char* encoded, size_t size, unsigned char* data, bool& is_valid)
+{
+    // Value of each character, -1 for those outside the alphabet
+    static const auto values = []
+    {
+        std::array<int8_t, 256> table{};
+        table.fill(-1);
+        for (int i = 0; i < 64; i++)
+            table[(unsigned char) BASE64_ALPHABET[i]] = (int8_t) i;
+
+        return table;
+    }();
+
+    unsigned char* out = data;
+    is_valid = true;
+    for (size_t i = 0; i < size; i += 4)
+    {
+        const auto* group = reinterpret_cast<const unsigned char*>(encoded + i);
+        bool is_last = i + 4 == size;
+
+        // Up to two padding characters may end the last group
+        int padding = 0;
+        if (is_last && group[3] == BASE64_PADDING)
+            padding = group[2] == BASE64_PADDING ? 2 : 1;
+
+        int8_t v0 = values[group[0]], v1 = values[group[1]];
+        int8_t v2 = padding < 2 ? values[group[2]] : 0, v3 = padding < 1 ? values[group[3]] : 0;
+        if ((v0 | v1 | v2 | v3) < 0)
+        {
+            is_valid = false;
+            break;
+        }
+
+        uint32_t triple = (uint32_t) v0 << 18 | (uint32_t) v1 << 12 | (uint32_t) v2 << 6 | (uint32_t) v3;
+        *out++ = (unsigned char) (triple >> 16);
+        if (padding < 2)
+            *out++ = (unsigned char) (triple >> 8);
+        if (padding < 1)
+            *out++ = (unsigned char) triple;
+    }
+
+    return (size_t) (out - data);
+}
+
+#ifdef VSFS_BASE64_X86
+
+__attribute__((target("ssse3")))
+size_t base64_encode_ssse3(const unsigned char* data, size_t size, char* encoded)
+{
+    // Each step reads 16 bytes but only encodes the first 12, stop while a whole load still fits
+    size_t i = 0;
+    char* out = encoded;
+    for (; i + 16 <= size; i += 12, out += 16)
+    {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+
+        // Spread each 3 bytes over 4 lanes, then move each 6-bit index to the bottom of its own byte
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        __m128i index_a = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+        __m128i index_b = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+        __m128i indices = _mm_or_si128(index_a, index_b);
+
+        // Map each index to the offset of its range of the alphabet: A-Z, a-z, 0-9, '+' and '/'
+        __m128i ranges = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        __m128i is_upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        ranges = _mm_or_si128(ranges, _mm_and_si128(is_upper, _mm_set1_epi8(13)));
+        __m128i offsets = _mm_shuffle_epi8(_mm_setr_epi8(
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0), ranges);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_add_epi8(indices, offsets));
+    }
+
+    return (size_t) (out - encoded) + base64_encode_scalar(data + i, size - i, out);
+}
+
+__attribute__((target("ssse3")))
+size_t base64_decode_ssse3(const char* encoded, size_t size, unsigned char* data, bool& is_valid)
+{
+    // Each step decodes 16 characters into 12 bytes but stores 16, data has room for the excess
+    size_t i = 0;
+    unsigned char* out = data;
+    for (; i + 16 <= size; i += 16, out += 12)
+    {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(encoded + i));
+
+        // Characters outside the alphabet, padding included, share a bit between their low and high nibble lookups
+        __m128i mask_2f = _mm_set1_epi8(0x2F);
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+        __m128i lo_nibbles = _mm_and_si128(in, mask_2f);
+        __m128i lo_lookup = _mm_setr_epi8(
+            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+        __m128i hi_lookup = _mm_setr_epi8(
+            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        __m128i lo = _mm_shuffle_epi8(lo_lookup, lo_nibbles);
+        __m128i hi = _mm_shuffle_epi8(hi_lookup, hi_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xFFFF)
+            break;
+
+        // Shift each character to its 6-bit value, '/' shares its high nibble with '+' and is told apart
+        __m128i is_slash = _mm_cmpeq_epi8(in, mask_2f);
+        __m128i shifts = _mm_shuffle_epi8(_mm_setr_epi8(
+            0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0), _mm_add_epi8(is_slash, hi_nibbles));
+        __m128i values = _mm_add_epi8(in, shifts);
+
+        // Pack each 4 values of 6 bits into 3 bytes
+        __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        __m128i triples = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+        triples = _mm_shuffle_epi8(triples, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), triples);
+    }
+
+    // Padding and invalid characters are left to the scalar implementation
+    return (size_t) (out - data) + base64_decode_scalar(encoded + i, size - i, out, is_valid);
+}
+
+#endif // VSFS_BASE64_X86
+
+base64_encode_kernel select_base64_encode()
+{
+#ifdef VSFS_BASE64_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        return base64_encode_ssse3;
+#endif
+    return base64_encode_scalar;
+}
+
+base64_decode_kernel select_base64_decode()
+{
+#ifdef VSFS_BASE64_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        return base64_decode_ssse3;
+#endif
+    return base64_decode_scalar;
+}
+
+#endif // VSFS_BASE64_H
@@ -0,0 +1,300 @@
+#ifndef VSFS_BATCH_H
+#define VSFS_BATCH_H
+
+#include "vsfs_list.h"
+#include "vsfs_copyin.h"
+#include "vsfs_copyout.h"
+#include "vsfs_mkdir.h"
+#include "vsfs_rm.h"
+#include "vsfs_rmdir.h"
+#include "vsfs_defrag.h"
+#include "vsfs_stats.h"
+#include "vsfs_helpers.h"
+#include "vsfs_constants.h"
+
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+/*
+ * Runs the commands of a script against an FS that is opened and parsed once, then written once all have run.
+ *
+ * Each line of the script is a command followed by its arguments without the FS, e.g. "copyin EF IF". Arguments are
+ * separated by whitespace, quoted with '"' to contain any and '\' escapes the character after it. Blank lines and
+ * lines starting with '#' are skipped. A command that fails is reported as it would be on its own and the rest still
+ * run.
+ */
+
+/*
+ * Declarations
+ */
+
+// Split a line of the script into its arguments, false if a quote is left open
+bool split_operation(const std::string& line, std::vector<std::string>& arguments);
+
+// Run a command of the script against the opened FS, is_changed is set once a command changed the FS
+int run_operation(
+    const std::vector<std::string>& arguments,
+    const char* fs_name,
+    std::string& fs_path,
+    std::fstream& fs_file,
+    bool is_compressed,
+    fs_index* index,
+    fs_journal* journal,
+    bool& is_changed);
+
+int vsfs_batch(int argc, char** argv);
+
+/*
+ * Definitions
+ */
+
+bool split_operation(const std::string& line, std::vector<std::string>& arguments)
+{
+    arguments.clear();
+
+    std::string argument;
+    bool is_argument{}, is_quoted{};
+    for (size_t i = 0; i < line.size(); i++)
+    {
+        char c = line[i];
+        if (c == '\\' && i + 1 < line.size())
+        {
+            argument += line[++i];
+            is_argument = true;
+        }
+        else if (c == '"')
+        {
+            // Quotes may also make an empty argument
+            is_quoted = !is_quoted;
+            is_argument = true;
+        }
+        else if (!is_quoted && isspace((unsigned char) c))
+        {
+            if (is_argument)
+                arguments.push_back(std::move(argument));
+
+            argument.clear();
+            is_argument = false;
+        }
+        else
+        {
+            argument += c;
+            is_argument = true;
+        }
+    }
+
+    if (is_argument)
+        arguments.push_back(std::move(argument));
+
+    return !is_quoted;
+}
+
+int run_operation(
+    const std::vector<std::string>& arguments,
+    const char* fs_name,
+    std::string& fs_path,
+    std::fstream& fs_file,
+    bool is_compressed,
+    fs_index* index,
+    fs_journal* journal,
+    bool& is_changed)
+{
+    // Number of arguments each command expects, the FS included
+    static constexpr int expected_arguments[]{1, 3, 3, 2, 2, 2, 1, 1};
+
+    const std::string& command = arguments[0];
+    auto found = std::find_if(std::begin(commands), std::end(commands),
+        [&](const char* name) { return command == name; });
+    auto command_id = (VSFS_commands) (found - std::begin(commands));
+
+    if (found == std::end(commands))
+    {
+        fprintf(stderr, "%s Unknown command \"%s\"\n", VSFS_ERROR_PREFIX, command.c_str());
+        return EXIT_FAILURE;
+    }
+    else if (command_id == BATCH || command_id == SERVE || command_id == CONVERT)
+    {
+        fprintf(stderr, "%s Command \"%s\" cannot be run within a batch\n", VSFS_ERROR_PREFIX, command.c_str());
+        return EXIT_FAILURE;
+    }
+
+    // Arguments are counted as they would be on the command line, where the FS comes first
+    int received = (int) arguments.size();
+    bool is_variadic = command_id == RM || command_id == RMDIR;
+    if (received != expected_arguments[command_id] && !(is_variadic && received > expected_arguments[command_id]))
+    {
+        fprintf(stderr, "%s Arguments for command \"%s\", expected %d%s, received %d\n",
+            VSFS_ERROR_PREFIX, command.c_str(), expected_arguments[command_id], is_variadic ? " or more" : "",
+            received);
+        return EXIT_FAILURE;
+    }
+
+    // Lines deleted by the commands before are only written once committed, which a full read of the FS relies on
+    if ((command_id == LIST || command_id == DEFRAG || command_id == STATS) && !commit_journal(fs_file, journal))
+        return EIO;
+
+    // Set by rm and rmdir once any of their targets was deleted, even if others were not found
+    bool is_deleted{};
+    int err_code;
+    switch (command_id)
+    {
+        case LIST:
+            return list_fs(fs_path, fs_file);
+        case COPYIN:
+            err_code = copyin_record(fs_path, fs_file, arguments[1], arguments[2], index, journal);
+            break;
+        case COPYOUT:
+            return copyout_record(fs_path, fs_file, arguments[1], arguments[2], index);
+        case MKDIR:
+            err_code = mkdir_record(fs_path, fs_file, arguments[1], index, journal);
+            break;
+        case RM:
+            err_code = rm_records(fs_path, fs_file, {arguments.begin() + 1, arguments.end()}, index, journal,
+                is_deleted);
+            break;
+        case RMDIR:
+            err_code = rmdir_records(fs_path, fs_file, {arguments.begin() + 1, arguments.end()}, index, journal,
+                is_deleted);
+            break;
+        case DEFRAG:
+        {
+            err_code = defrag_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::out, journal);
+            if (err_code != EXIT_SUCCESS)
+                break;
+
+            // Every record moved, the index is rebuilt from the defragged FS
+            fs_map fs_mapping;
+            if (!map_fs(fs_path, fs_file, fs_mapping))
+            {
+                fprintf(stderr, "%s FS could not be mapped: %s\n", VSFS_ERROR_PREFIX, fs_name);
+                err_code = EIO;
+                break;
+            }
+
+            rebuild_index(fs_mapping.get_data(), *index);
+            break;
+        }
+        case STATS:
+            return stats_fs(fs_path, fs_file);
+        default:
+            return EXIT_FAILURE;
+    }
+
+    // As on their own, commands that failed do not have the FS written back, unless they deleted some of their targets
+    is_changed |= err_code == EXIT_SUCCESS || is_deleted;
+    return err_code;
+}
+
+int vsfs_batch(int argc, char** argv)
+{
+    // Verify number of arguments
+    if (argc != 3 && argc != 4)
+    {
+        fprintf(stderr, "%s Arguments for command \"batch\", expected 1 or 2, received %d\n",
+            VSFS_ERROR_PREFIX, argc - 2);
+        return EXIT_FAILURE;
+    }
+
+    std::string fs_path = argv[2];
+    std::fstream fs_file;
+    bool is_compressed{};
+
+    // Read the script from the standard input unless a file is given
+    std::ifstream script_file;
+    bool is_stdin = argc == 3 || strcmp(argv[3], BATCH_STDIN) == 0;
+    if (!is_stdin)
+    {
+        script_file.open(argv[3]);
+        if (!script_file.is_open())
+        {
+            fprintf(stderr, "%s Script could not be opened: %s\n", VSFS_ERROR_PREFIX, argv[3]);
+            return ENOENT;
+        }
+    }
+
+    std::istream& script = is_stdin ? std::cin : script_file;
+
+    // Open the FS file in both read and write mode, once for every command
+    int err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::out);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    // Recover the FS from any change left incomplete, if journaled, the whole script is then committed at once
+    fs_journal fs_log;
+    fs_journal* journal;
+    if (!open_journal(fs_path, is_compressed, fs_log, journal))
+        return EIO;
+
+    // Records are always found through an index, kept as a sidecar if in use or else only in memory
+    fs_index fs_lookup;
+    bool is_sidecar{};
+    fs_index* index = open_lookup(fs_path, is_compressed, fs_lookup, is_sidecar);
+    if (!index)
+        return EIO;
+
+    // The exit status is that of the first command that failed
+    int batch_code = EXIT_SUCCESS;
+    bool is_changed{};
+
+    std::string line;
+    std::vector<std::string> arguments;
+    for (size_t line_number = 1; std::getline(script, line); line_number++)
+    {
+        size_t line_start = line.find_first_not_of(" \t\r");
+        if (line_start == std::string::npos || line[line_start] == BATCH_COMMENT)
+            continue;
+
+        if (!split_operation(line, arguments))
+        {
+            fprintf(stderr, "%s Unterminated quote on line %zu of the script\n", VSFS_ERROR_PREFIX, line_number);
+            err_code = EXIT_FAILURE;
+        }
+        else
+        {
+            try
+            {
+                err_code = run_operation(arguments, argv[2], fs_path, fs_file, is_compressed, index, journal,
+                    is_changed);
+            }
+            catch (const std::exception& exception)
+            {
+                // Reported as the dispatch in main would, the remaining commands still run
+                fprintf(stderr, "%s %s\n", VSFS_ERROR_PREFIX, exception.what());
+                err_code = EXIT_FAILURE;
+            }
+        }
+
+        if (err_code != EXIT_SUCCESS)
+        {
+            // A failed write must not stop the next command from using the FS
+            fs_file.clear();
+            if (batch_code == EXIT_SUCCESS)
+                batch_code = err_code;
+        }
+    }
+
+    if (!is_changed)
+        return batch_code;
+
+    if (!commit_journal(fs_file, journal))
+        return EIO;
+
+    // Defrag the FS once deleted records exceed the compaction policy, if any
+    bool is_compacted;
+    err_code = compact_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::out, index, journal, is_compacted);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    if (is_sidecar)
+        save_index(fs_path, fs_file, index);
+
+    // If FS was found zipped, re-zip it once with every change
+    if (is_compressed && (err_code = deflate_fs(fs_path, fs_file, argv[2])) != EXIT_SUCCESS)
+        return err_code;
+
+    return batch_code;
+}
+
+#endif // VSFS_BATCH_H
@@ -0,0 +1,195 @@
+#ifndef VSFS_BLOCKS_H
+#define VSFS_BLOCKS_H
+
+#include "vsfs_base64.h"
+#include "vsfs_constants.h"
+
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <zlib.h>
+
+/*
+ * Compresses a file's content lines into blocks, each a line of its own that is inflated without the others.
+ *
+ * A block line is the block identifier, the number of content lines the block holds and their size, then the lines
+ * compressed with zlib and encoded in base64, e.g. "~120 4096 eJzt...". Blocks hold whole content lines, about
+ * BLOCK_CONTENT_SIZE bytes of them, so the lines of a file are counted from its blocks without inflating any.
+ */
+
+/*
+ * Declarations
+ */
+
+// Whether copyin compresses content, from VSFS_COMPRESS
+bool is_compression_enabled();
+
+/*
+ * Compress content lines, each with its identifier and '\n', into block lines, false if the content is too small to
+ * be compressed or would not be made smaller.
+ **/
+bool compress_content(std::string_view content_lines, std::string& block_lines);
+
+// Read the header of a block line, false if it is malformed
+bool read_block_header(std::string_view block_line, size_t& line_count, size_t& content_size,
+    std::string_view& encoded);
+
+// Count the content lines a run of block lines holds, false if any is malformed
+bool count_block_lines(std::string_view block_lines, size_t& line_count);
+
+// Inflate a block line, appending the content lines it holds to content_lines, false if it is malformed
+bool inflate_block(std::string_view block_line, std::string& content_lines);
+
+/*
+ * Definitions
+ */
+
+bool is_compression_enabled()
+{
+    const char* compress = getenv(COMPRESS_VARIABLE);
+    return compress && *compress && strcmp(compress, "0") != 0;
+}
+
+bool compress_content(std::string_view content_lines, std::string& block_lines)
+{
+    block_lines.clear();
+
+    // The last line must be terminated for the block to end with it
+    if (content_lines.size() < COMPRESS_MIN_SIZE || content_lines.back() != '\n')
+        return false;
+
+    base64_encode_kernel encode = select_base64_encode();
+    std::vector<unsigned char> compressed;
+    std::vector<char> encoded;
+
+    size_t block_start = 0;
+    while (block_start < content_lines.size())
+    {
+        // Take whole lines until the block is full, at least one
+        size_t block_end = block_start;
+        size_t line_count = 0;
+        while (block_end < content_lines.size() && (block_end == block_start
+            || block_end - block_start < BLOCK_CONTENT_SIZE))
+        {
+            block_end = content_lines.find('\n', block_end) + 1;
+            line_count++;
+        }
+
+        std::string_view block = content_lines.substr(block_start, block_end - block_start);
+        uLongf compressed_size = compressBound((uLong) block.size());
+        compressed.resize(compressed_size);
+        if (compress2(compressed.data(), &compressed_size, reinterpret_cast<const Bytef*>(block.data()),
+            (uLong) block.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+            return false;
+        }
+
+        encoded.resize(compressed_size / 3 * 4 + 4 + 16);
+        size_t encoded_size = encode(compressed.data(), compressed_size, encoded.data());
+
+        block_lines += BLOCK_IDENTIFIER;
+        block_lines.append(std::to_string(line_count)).append(" ").append(std::to_string(block.size())).append(" ");
+        block_lines.append(encoded.data(), encoded_size).push_back('\n');
+
+        // Content that does not shrink is kept as it is
+        if (block_lines.size() >= content_lines.size())
+            return false;
+
+        block_start = block_end;
+    }
+
+    return true;
+}
+
+bool read_block_header(std::string_view block_line, size_t& line_count, size_t& content_size,
+    std::string_view& encoded)
+{
+    if (block_line.empty() || block_line[0] != BLOCK_IDENTIFIER)
+        return false;
+
+    // The identifier, then both sizes each followed by a ' '
+    size_t fields[2];
+    size_t field_start = 1;
+    for (size_t& field: fields)
+    {
+        size_t field_end = block_line.find(' ', field_start);
+        if (field_end == std::string_view::npos || field_end == field_start)
+            return false;
+
+        field = 0;
+        for (char c: block_line.substr(field_start, field_end - field_start))
+        {
+            if (c < '0' || c > '9' || field > (SIZE_MAX - (size_t) (c - '0')) / 10)
+                return false;
+
+            field = field * 10 + (size_t) (c - '0');
+        }
+
+        field_start = field_end + 1;
+    }
+
+    line_count = fields[0];
+    content_size = fields[1];
+    encoded = block_line.substr(field_start);
+
+    // A block holds whole lines until it is full, so never more than a line past BLOCK_CONTENT_SIZE
+    return content_size <= BLOCK_CONTENT_SIZE + MAXIMUM_RECORD_LENGTH && line_count <= content_size
+        && encoded.size() % 4 == 0;
+}
+
+bool count_block_lines(std::string_view block_lines, size_t& line_count)
+{
+    line_count = 0;
+
+    // Each line is a block of its own, the last one may not be terminated
+    size_t line_start = 0;
+    while (line_start < block_lines.size())
+    {
+        size_t line_end = std::min(block_lines.find('\n', line_start), block_lines.size());
+        size_t block_line_count, content_size;
+        std::string_view encoded;
+        if (!read_block_header(block_lines.substr(line_start, line_end - line_start), block_line_count, content_size,
+            encoded))
+        {
+            return false;
+        }
+
+        line_count += block_line_count;
+        line_start = line_end + 1;
+    }
+
+    return true;
+}
+
+bool inflate_block(std::string_view block_line, std::string& content_lines)
+{
+    size_t line_count, content_size;
+    std::string_view encoded;
+    if (!read_block_header(block_line, line_count, content_size, encoded))
+        return false;
+
+    bool is_valid;
+    std::vector<unsigned char> compressed(encoded.size() / 4 * 3 + 16);
+    size_t compressed_size = select_base64_decode()(encoded.data(), encoded.size(), compressed.data(), is_valid);
+    if (!is_valid)
+        return false;
+
+    // The block's content is inflated straight after the content already read
+    size_t content_start = content_lines.size();
+    content_lines.resize(content_start + content_size);
+    uLongf inflated_size = content_size;
+    if (uncompress(reinterpret_cast<Bytef*>(&content_lines[content_start]), &inflated_size, compressed.data(),
+        (uLong) compressed_size) != Z_OK || inflated_size != content_size)
+    {
+        content_lines.resize(content_start);
+        return false;
+    }
+
+    return true;
+}
+
+#endif // VSFS_BLOCKS_H
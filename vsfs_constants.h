@@ -1,6 +1,8 @@
 #ifndef VSFS_CONSTANTS_H
 #define VSFS_CONSTANTS_H
 
+#include <cstddef>
+
 enum VSFS_commands
 {
     LIST,
@@ -9,7 +11,11 @@ enum VSFS_commands
     MKDIR,
     RM,
     RMDIR,
-    DEFRAG
+    DEFRAG,
+    STATS,
+    BATCH,
+    SERVE,
+    CONVERT
 };
 
 const char* commands[]{
@@ -19,19 +25,94 @@ const char* commands[]{
     "mkdir",
     "rm",
     "rmdir",
-    "defrag"
+    "defrag",
+    "stats",
+    "batch",
+    "serve",
+    "convert"
 };
 
 constexpr const char* FS_EXTENSION = "notes";
 constexpr const char* GZ_EXTENSION = "gz";
 constexpr const char* FS_FIRST_RECORD = "NOTES V1.0";
+constexpr const char* FS_V2_FIRST_RECORD = "NOTES V2.0";
 constexpr unsigned int MAXIMUM_RECORD_LENGTH = 255;
 constexpr int ASCII_MAX_VALUE = 127;
 constexpr char FILE_RECORD_IDENTIFIER = '@';
 constexpr char DIR_RECORD_IDENTIFIER = '=';
 constexpr char DELETED_RECORD_IDENTIFIER = '#';
 constexpr char RECORD_CONTENT_IDENTIFIER = ' ';
+constexpr char BODY_RECORD_IDENTIFIER = '%';
+constexpr char REFERENCE_IDENTIFIER = '&';
+constexpr char BLOCK_IDENTIFIER = '~';
 constexpr char PATH_SEPARATOR = '/';
 constexpr const char* VSFS_ERROR_PREFIX = "Invalid VSFS:";
 
+// Formats of an FS, told apart by its first record
+enum VSFS_versions : unsigned int
+{
+    FS_V1 = 1,
+    FS_V2 = 2
+};
+
+// Arguments of convert naming each format
+constexpr const char* FS_V1_NAME = "V1";
+constexpr const char* FS_V2_NAME = "V2";
+
+// Environment variable for the number of threads an FS is parsed with, 1 to always parse serially
+constexpr const char* PARSE_THREADS_VARIABLE = "VSFS_PARSE_THREADS";
+
+// Smaller FS are parsed serially unless a number of threads is given
+constexpr size_t PARALLEL_PARSE_MIN_SIZE = 16 * 1024 * 1024;
+constexpr size_t PARALLEL_PARSE_MIN_CHUNK = 1024 * 1024;
+
+// Size of the buffers a compressed FS is streamed through
+constexpr size_t GZ_CHUNK_SIZE = 128 * 1024;
+
+// Most of the FS a member of a compressed FS holds, small enough for any member to fit the 64 KiB BGZF allows
+constexpr size_t GZ_MEMBER_SIZE = 0xff00;
+
+// Block index of where each member of a compressed FS is, next to it
+constexpr const char* GZ_INDEX_EXTENSION = "gzi";
+
+// Environment variable to keep a sidecar index of record offsets next to the FS, unset or 0 to not use one
+constexpr const char* INDEX_VARIABLE = "VSFS_INDEX";
+constexpr const char* INDEX_EXTENSION = "idx";
+
+// Environment variable to keep a journal of changes next to the FS, unset or 0 to write changes straight to the FS
+constexpr const char* JOURNAL_VARIABLE = "VSFS_JOURNAL";
+constexpr const char* JOURNAL_EXTENSION = "journal";
+
+// Environment variable for the deleted records past which commands that change the FS defrag it, e.g. "25%,64M"
+constexpr const char* COMPACT_VARIABLE = "VSFS_COMPACT";
+
+// Environment variable to store each distinct file content once, unset or 0 for copyin to write every file's content
+constexpr const char* DEDUP_VARIABLE = "VSFS_DEDUP";
+
+// Environment variable to store file content in compressed blocks, unset or 0 for copyin to write content lines as is
+constexpr const char* COMPRESS_VARIABLE = "VSFS_COMPRESS";
+
+// Content smaller than this is never compressed, larger content is compressed in blocks of about the block size
+constexpr size_t COMPRESS_MIN_SIZE = 1024;
+constexpr size_t BLOCK_CONTENT_SIZE = 64 * 1024;
+
+// Environment variable for the memory defrag sorts the FS' records in, e.g. "64M", unset to sort them all in memory
+constexpr const char* DEFRAG_MEMORY_VARIABLE = "VSFS_DEFRAG_MEMORY";
+
+// Number of sorted runs merged at once when defrag sorts in bounded memory
+constexpr size_t DEFRAG_MERGE_WAYS = 64;
+
+// Environment variable for the dir defrag writes its sorted runs to, unset to write them next to the FS
+constexpr const char* TMPDIR_VARIABLE = "TMPDIR";
+
+// Where a file that only lives in memory is opened through, followed by its descriptor
+constexpr const char* MEMORY_FILE_PREFIX = "/proc/self/fd/";
+
+// Script of a batch that is read from the standard input
+constexpr const char* BATCH_STDIN = "-";
+constexpr char BATCH_COMMENT = '#';
+
+// Environment variable for the socket of a running server that commands are forwarded to, unset to run them here
+constexpr const char* SOCKET_VARIABLE = "VSFS_SOCKET";
+
 #endif // VSFS_CONSTANTS_H
@@ -0,0 +1,523 @@
+#ifndef VSFS_CONVERT_H
+#define VSFS_CONVERT_H
+
+#include "vsfs_ascii.h"
+#include "vsfs_base64.h"
+#include "vsfs_helpers.h"
+#include "vsfs_constants.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <streambuf>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Converts an FS between NOTES V1.0 and NOTES V2.0, each record being written as soon as it is read. Only the paths of
+ * the records are kept in memory, to check them as build_tree does and for the directory of NOTES V2.0.
+ *
+ * A file's payload in NOTES V2.0 is the bytes of the EF it was copied in from: the text of its content lines without
+ * their identifiers, or the bytes they decode to for a binary EF that copyin encoded in base64, which are encoded back
+ * the same way, as copyout does to write the same EF from either format. Deleted records are dropped, and content
+ * lines that do not directly follow their file, which only defrag moves back to it, cannot be converted.
+ */
+
+// Where a record converted to NOTES V2.0 is, for the directory
+struct v2_entry
+{
+    std::string_view path;
+    uint64_t offset;
+};
+
+/*
+ * Declarations
+ */
+
+// Parse the format named by a convert argument, false if it names none
+bool parse_version(const char* name, unsigned int& version);
+
+/*
+ * Write the records of the mapped NOTES V1.0 FS at the given path to v2_file in NOTES V2.0, false if the FS is invalid
+ * or has content lines that do not follow their file.
+ */
+bool write_v2(std::string_view fs_data, const std::string& fs_path, std::fstream& v2_file);
+
+/*
+ * Decode the content lines of a file, each with its identifier and '\n', into the bytes of the binary EF copyin
+ * encoded them from, false if they are text. Lines are only taken for base64 when encoding the bytes gives them back.
+ **/
+bool decode_binary_content(std::string_view content_lines, std::string& data);
+
+// Write a NOTES V2.0 record up to its payload
+void write_v2_record(std::fstream& v2_file, char record_type, std::string_view path, uint64_t line_count,
+    uint64_t payload_size, uint8_t content_type);
+
+// Write the directory of the given records ending a NOTES V2.0 FS, then the header of the FS before them
+void write_v2_directory(std::fstream& v2_file, const std::vector<v2_entry>& entries, uint64_t file_count,
+    uint64_t dir_count);
+
+// Write the records of the NOTES V2.0 FS at the given path to v1_file in NOTES V1.0, false if the FS is invalid
+bool write_v1(const fs_v2& fs, const std::string& fs_path, std::fstream& v1_file);
+
+// Write a file's payload as NOTES V1.0 content lines, wrapped in base64 as copyin does for a binary payload or one
+// they cannot hold as is
+void write_v1_content(std::string_view payload, bool is_binary, std::fstream& v1_file);
+
+/*
+ * Convert the FS at the given path, read through fs_file, from fs_version to target_version, replacing it in place as
+ * defrag does. A zipped FS is converted in memory, fs_path and fs_file are then set to the converted FS.
+ */
+int convert_fs(std::string& fs_path, std::fstream& fs_file, bool is_compressed, unsigned int fs_version,
+    unsigned int target_version, fs_journal* journal);
+
+int vsfs_convert(int argc, char** argv);
+
+/*
+ * Definitions
+ */
+
+bool parse_version(const char* name, unsigned int& version)
+{
+    if (strcmp(name, FS_V1_NAME) == 0)
+        version = FS_V1;
+    else if (strcmp(name, FS_V2_NAME) == 0)
+        version = FS_V2;
+    else
+        return false;
+
+    return true;
+}
+
+bool write_v2(std::string_view fs_data, const std::string& fs_path, std::fstream& v2_file)
+{
+    v2_file << FS_V2_FIRST_RECORD << '\n';
+
+    // The header is only known once every record is written
+    char v2_header[fs_v2::HEADER_SIZE]{};
+    v2_file.write(v2_header, sizeof(v2_header));
+
+    // The records' paths are checked in a tree as they are read, that only counts each file's content lines
+    fs_arena fs_tree;
+    std::vector<file*> fs_records;
+    fs_bodies bodies;
+    dir* root = fs_tree.create<dir>(fs_path, fs_path);
+    file* curr_file = nullptr;
+
+    // Files referring to a body are written with its content, which directly follows the body
+    std::unordered_map<std::string_view, std::string_view> body_contents;
+    std::string_view pending_body;
+    bool is_body_pending = false;
+
+    std::vector<v2_entry> entries;
+    uint64_t file_count = 0, dir_count = 0;
+
+    // A file is only written once it is known whether content lines follow it, blocks being inflated first
+    std::string_view pending_file;
+    bool is_pending = false;
+    std::string inflated, text, data;
+    auto write_pending = [&](std::string_view content, size_t line_count)
+    {
+        if (!is_pending)
+            return true;
+
+        if (!content.empty() && content[0] == BLOCK_IDENTIFIER)
+        {
+            inflated.clear();
+            std::string_view block_line;
+            for (size_t offset = 0; read_line(content, offset, block_line);)
+            {
+                if (!inflate_block(block_line, inflated))
+                {
+                    fprintf(stderr, "%s FS block of file \"%.*s\" is malformed\n",
+                        VSFS_ERROR_PREFIX, (int) pending_file.size(), pending_file.data());
+                    return false;
+                }
+            }
+
+            content = inflated;
+        }
+
+        // A binary EF is stored as its bytes, text as its content lines without their identifiers, the last one
+        // gaining the '\n' it may be missing
+        bool is_binary = decode_binary_content(content, data);
+        if (!is_binary)
+        {
+            text.clear();
+            std::string_view line;
+            for (size_t offset = 0; read_line(content, offset, line);)
+                text.append(line.substr(1)).push_back('\n');
+        }
+
+        std::string_view payload = is_binary ? data : text;
+        entries.push_back({pending_file, (uint64_t) v2_file.tellp()});
+        write_v2_record(v2_file, FILE_RECORD_IDENTIFIER, pending_file, line_count, payload.size(),
+            is_binary ? fs_v2::BINARY_CONTENT : fs_v2::TEXT_CONTENT);
+        v2_file.write(payload.data(), (std::streamsize) payload.size());
+
+        file_count++;
+        is_pending = false;
+        return true;
+    };
+
+    // Skip the first record, already verified when the FS was opened
+    size_t fs_offset = 0;
+    std::string_view fs_line;
+    read_line(fs_data, fs_offset, fs_line);
+
+    bool is_written = scan_records(fs_data, fs_offset, [&](const fs_record& record)
+    {
+        if (!insert_record(record, root, curr_file, fs_tree, fs_records, bodies, false, true))
+            return false;
+
+        bool is_content = record.record_type == RECORD_CONTENT_IDENTIFIER || record.record_type == BLOCK_IDENTIFIER;
+        if (is_content && is_body_pending)
+        {
+            body_contents[pending_body] = record.text;
+            is_body_pending = false;
+            return true;
+        }
+
+        if (is_content)
+        {
+            if (!is_pending)
+            {
+                fprintf(stderr, "%s Content of file \"%s\" does not follow it, defrag the FS first\n",
+                    VSFS_ERROR_PREFIX, curr_file->get_path().c_str());
+                return false;
+            }
+
+            return write_pending(record.text, curr_file->get_line_count());
+        }
+
+        if (record.record_type == REFERENCE_IDENTIFIER)
+            return write_pending(body_contents[record.text], curr_file->get_line_count());
+
+        if (!write_pending({}, 0))
+            return false;
+
+        is_body_pending = record.record_type == BODY_RECORD_IDENTIFIER;
+        if (is_body_pending)
+        {
+            pending_body = record.text;
+            body_contents[pending_body] = {};
+        }
+        else if (record.record_type == FILE_RECORD_IDENTIFIER)
+        {
+            pending_file = record.text;
+            is_pending = true;
+        }
+        else if (record.record_type == DIR_RECORD_IDENTIFIER)
+        {
+            entries.push_back({record.text, (uint64_t) v2_file.tellp()});
+            write_v2_record(v2_file, DIR_RECORD_IDENTIFIER, record.text, 0, 0, fs_v2::TEXT_CONTENT);
+            dir_count++;
+        }
+
+        return true;
+    });
+
+    if (!is_written)
+        return false;
+
+    write_pending({}, 0);
+    write_v2_directory(v2_file, entries, file_count, dir_count);
+    return true;
+}
+
+bool decode_binary_content(std::string_view content_lines, std::string& data)
+{
+    data.clear();
+
+    // Only base64 lines without their identifiers decode, a text line fails on its first space
+    std::string encoded;
+    std::string_view line;
+    for (size_t offset = 0; read_line(content_lines, offset, line);)
+    {
+        if (line[0] != RECORD_CONTENT_IDENTIFIER)
+            return false;
+
+        encoded.append(line.substr(1));
+    }
+
+    view_buffer encoded_data(encoded);
+    std::ostringstream decoded;
+    if (encoded.empty() || !base64_decode(encoded_data, decoded))
+        return false;
+
+    // ASCII is copied in as text, and text that only happens to be base64 does not encode back to the same lines
+    data = decoded.str();
+    view_buffer raw_data(data);
+    std::ostringstream reencoded;
+    base64_encode(raw_data, reencoded, MAXIMUM_RECORD_LENGTH - 2, RECORD_CONTENT_IDENTIFIER);
+    if (is_data_ascii(data) || reencoded.str() != content_lines)
+    {
+        data.clear();
+        return false;
+    }
+
+    return true;
+}
+
+void write_v2_record(std::fstream& v2_file, char record_type, std::string_view path, uint64_t line_count,
+    uint64_t payload_size, uint8_t content_type)
+{
+    char stored[fs_v2::RECORD_HEADER_SIZE];
+    fs_v2::encode_record_header({line_count, payload_size, (uint32_t) path.size(), record_type, content_type}, stored);
+    v2_file.write(stored, sizeof(stored));
+    v2_file.write(path.data(), (std::streamsize) path.size());
+}
+
+void write_v2_directory(std::fstream& v2_file, const std::vector<v2_entry>& entries, uint64_t file_count,
+    uint64_t dir_count)
+{
+    // Slots hold the index of an entry plus 1 until written, a path recorded twice is found at its first record
+    uint64_t slot_count = fs_v2::get_slot_count(entries.size());
+    std::vector<uint64_t> slots(slot_count);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        uint64_t slot = fs_v2::hash_path(entries[i].path) & (slot_count - 1);
+        while (slots[slot] && entries[slots[slot] - 1].path != entries[i].path)
+            slot = (slot + 1) & (slot_count - 1);
+
+        if (!slots[slot])
+            slots[slot] = i + 1;
+    }
+
+    for (uint64_t& slot: slots)
+    {
+        if (slot)
+            slot = entries[slot - 1].offset;
+    }
+
+    // The slot count, then the slots
+    std::vector<char> directory((slot_count + 1) * fs_v2::SLOT_SIZE);
+    fs_v2::store_le(directory.data(), slot_count);
+    for (size_t i = 0; i < slots.size(); i++)
+        fs_v2::store_le(directory.data() + (i + 1) * fs_v2::SLOT_SIZE, slots[i]);
+
+    char v2_header[fs_v2::HEADER_SIZE];
+    fs_v2::encode_header({file_count, dir_count, (uint64_t) v2_file.tellp()}, v2_header);
+    v2_file.write(directory.data(), (std::streamsize) directory.size());
+
+    v2_file.seekp((std::streamoff) fs_v2::get_header_offset());
+    v2_file.write(v2_header, sizeof(v2_header));
+    v2_file.seekp(0, std::ios::end);
+}
+
+bool write_v1(const fs_v2& fs, const std::string& fs_path, std::fstream& v1_file)
+{
+    v1_file << FS_FIRST_RECORD << '\n';
+
+    // The records are checked as list checks them, with each file's content written as it is reached
+    fs_arena fs_tree;
+    std::vector<file*> fs_records;
+    fs_bodies bodies;
+    dir* root = fs_tree.create<dir>(fs_path, fs_path);
+    file* curr_file = nullptr;
+
+    bool is_inserted = true;
+    bool is_walked = fs.for_each([&](const fs_v2::record& record)
+    {
+        if (record.record_type != FILE_RECORD_IDENTIFIER && record.record_type != DIR_RECORD_IDENTIFIER)
+        {
+            fprintf(stderr, "%s Unknown record type %c\n", VSFS_ERROR_PREFIX, record.record_type);
+            return is_inserted = false;
+        }
+
+        is_inserted = insert_record({record.record_type, record.path, 0, 1}, root, curr_file, fs_tree, fs_records,
+            bodies, false, true);
+        if (!is_inserted)
+            return false;
+
+        v1_file << record.record_type << record.path << '\n';
+        if (record.record_type == FILE_RECORD_IDENTIFIER)
+            write_v1_content(record.payload, record.is_binary, v1_file);
+
+        return true;
+    });
+
+    if (is_inserted && !is_walked)
+        fprintf(stderr, "%s FS records are malformed: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+
+    return is_walked;
+}
+
+void write_v1_content(std::string_view payload, bool is_binary, std::fstream& v1_file)
+{
+    if (payload.empty())
+        return;
+
+    // Text whose lines fit in a record is kept as is, a text payload converted from NOTES V1.0 always is
+    bool is_text = !is_binary && is_data_ascii(payload);
+    std::string_view line;
+    for (size_t offset = 0; is_text && read_line(payload, offset, line);)
+        is_text = line.size() < MAXIMUM_RECORD_LENGTH - 1;
+
+    if (!is_text)
+    {
+        view_buffer data(payload);
+        base64_encode(data, v1_file, MAXIMUM_RECORD_LENGTH - 2, RECORD_CONTENT_IDENTIFIER);
+        return;
+    }
+
+    for (size_t offset = 0; read_line(payload, offset, line);)
+    {
+        v1_file << RECORD_CONTENT_IDENTIFIER;
+        v1_file.write(line.data(), (std::streamsize) line.size());
+        v1_file << '\n';
+    }
+}
+
+int convert_fs(std::string& fs_path, std::fstream& fs_file, bool is_compressed, unsigned int fs_version,
+    unsigned int target_version, fs_journal* journal)
+{
+    if (fs_version == target_version)
+        return EXIT_SUCCESS;
+
+    // Offsets the journal holds only refer to the FS being replaced
+    if (journal && !journal->checkpoint())
+    {
+        fprintf(stderr, "%s Journal could not be committed: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+        return EIO;
+    }
+
+    // Records are read straight from the mapped FS
+    fs_map fs_mapping;
+    fs_v2 fs;
+    bool is_mapped = fs_version == FS_V2 ? fs.open(fs_path) : fs_mapping.map(fs_path);
+    if (!is_mapped)
+    {
+        if (fs_version == FS_V2)
+        {
+            fprintf(stderr, "%s FS is not a valid \"%s\" FS: %s\n",
+                VSFS_ERROR_PREFIX, FS_V2_FIRST_RECORD, fs_path.c_str());
+        }
+        else
+        {
+            fprintf(stderr, "%s FS could not be mapped: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+        }
+
+        return fs_version == FS_V2 ? EXIT_FAILURE : EIO;
+    }
+
+    // Write the converted FS next to the one it replaces, or in memory for a zipped FS
+    std::string tmp_path;
+    std::fstream tmp_file;
+    int err_code = is_compressed
+        ? open_memory_file(fs_path, tmp_path, tmp_file)
+        : open_temp(fs_path, tmp_path, tmp_file);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    bool is_written;
+    try
+    {
+        is_written = fs_version == FS_V2
+            ? write_v1(fs, fs_path, tmp_file)
+            : write_v2(fs_mapping.get_data(), fs_path, tmp_file);
+        tmp_file.flush();
+    }
+    catch (const std::ios::failure& failure)
+    {
+        fprintf(stderr, "%s FS I/O error: %s\n", VSFS_ERROR_PREFIX, failure.code().message().c_str());
+        is_written = false;
+        err_code = failure.code().value();
+    }
+
+    // An FS that cannot be converted is left as it was
+    if (!is_written)
+    {
+        tmp_file.close();
+        if (is_compressed)
+            close_memory_file(tmp_path);
+        else
+            unlink(tmp_path.c_str());
+
+        return err_code != EXIT_SUCCESS ? err_code : EXIT_FAILURE;
+    }
+
+    fs.clear();
+    fs_mapping.unmap();
+
+    fs_file.clear();
+    fs_file.close();
+
+    // The file in memory already is the converted FS, the one it replaces is released
+    if (is_compressed)
+    {
+        close_memory_file(fs_path);
+        fs_path = tmp_path;
+        fs_file.swap(tmp_file);
+        return EXIT_SUCCESS;
+    }
+
+    tmp_file.close();
+
+    // The converted FS must be durable before it replaces the one the journal synced
+    if (journal && !sync_file(tmp_path))
+    {
+        fprintf(stderr, "%s FS could not be synced: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+        unlink(tmp_path.c_str());
+        return EIO;
+    }
+
+    return publish_temp(tmp_path, fs_path);
+}
+
+int vsfs_convert(int argc, char** argv)
+{
+    // Verify number of arguments
+    if (argc != 4)
+    {
+        fprintf(stderr, "%s Arguments for command \"convert\", expected 2, received %d\n",
+            VSFS_ERROR_PREFIX, argc - 2);
+        return EXIT_FAILURE;
+    }
+
+    unsigned int target_version{};
+    if (!parse_version(argv[3], target_version))
+    {
+        fprintf(stderr, "%s FS can only be converted to \"%s\" or \"%s\", received \"%s\"\n",
+            VSFS_ERROR_PREFIX, FS_V1_NAME, FS_V2_NAME, argv[3]);
+        return EXIT_FAILURE;
+    }
+
+    std::string fs_path = argv[2];
+    std::fstream fs_file;
+    bool is_compressed{};
+    unsigned int fs_version{};
+
+    // Open FS file in read mode
+    int err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::in, &fs_version);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    // Recover the FS from any change left incomplete, if journaled, a NOTES V2.0 FS is never changed in place
+    fs_journal fs_log;
+    fs_journal* journal = nullptr;
+    if (fs_version == FS_V1 && !open_journal(fs_path, is_compressed, fs_log, journal))
+        return EIO;
+
+    if ((err_code = convert_fs(fs_path, fs_file, is_compressed, fs_version, target_version, journal)) != EXIT_SUCCESS)
+        return err_code;
+
+    // If FS was found zipped, re-zip the converted FS over it
+    if (is_compressed)
+        return fs_version == target_version ? EXIT_SUCCESS : deflate_fs(fs_path, fs_file, argv[2]);
+
+    // Any sidecar index only refers to the FS replaced, it is rebuilt for an FS converted back to NOTES V1.0
+    if (fs_version != target_version)
+    {
+        unlink((fs_path + '.' + INDEX_EXTENSION).c_str());
+        fs_index fs_sidecar;
+        if (target_version == FS_V1)
+            open_index(fs_path, is_compressed, fs_sidecar);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+#endif // VSFS_CONVERT_H
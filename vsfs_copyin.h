@@ -1,34 +1,55 @@
 #ifndef VSFS_COPYIN_H
 #define VSFS_COPYIN_H
 
-#include "vsfs_externals.h"
+#include "vsfs_ascii.h"
+#include "vsfs_base64.h"
+#include "vsfs_stats.h"
 #include "vsfs_helpers.h"
 #include "vsfs_constants.h"
 
 #include <fstream>
 #include <sstream>
 
-int vsfs_copyin(int argc, char** argv)
+// Write the content of the EF as content lines to out, base64 encoded unless the EF is ASCII and read into ef_data
+void write_ef_content(std::fstream& ef_file, std::stringstream& ef_data, bool is_ascii, std::ostream& out)
 {
-    // Verify number of arguments
-    if (argc != 5)
+    // File is not ASCII, encode it straight into content lines wrapped at 253 (' ' + content + '\n' or 1 + 253 + 1)
+    if (!is_ascii)
+        base64_encode(*ef_file.rdbuf(), out, MAXIMUM_RECORD_LENGTH - 2, RECORD_CONTENT_IDENTIFIER);
+
+    // Write from EF to IF
+    std::string ef_line;
+    while (read_line(ef_data, ef_line))
     {
-        fprintf(stderr, "%s Arguments for command \"copyin\", expected 3, received %d\n",
-            VSFS_ERROR_PREFIX, argc - 2);
-        return EXIT_FAILURE;
-    }
+        // Truncating the line to 255 characters (' ' + content + '\n' or 1 + 253 + 1 = 255)
+        size_t size = ef_line.size();
 
-    std::string fs_path = argv[2], ef_path = argv[3], if_path = argv[4];
-    std::fstream fs_file, ef_file;
-    bool is_compressed{};
+        // For lengths 254 (255 - 1 for the record type identifier ' ') and greater
+        if (size >= MAXIMUM_RECORD_LENGTH - 1)
+        {
+            ef_line.resize(MAXIMUM_RECORD_LENGTH - 2);
+            ef_line.append("\n");
+        }
+            // For lengths smaller than 254 and greater than 0
+        else if (size > 0 && ef_line.at(size - 1) != '\n')
+        {
+            ef_line.append("\n");
+        }
 
-    // Open FS file in both read and write mode
-    int err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::out);
-    if (err_code != EXIT_SUCCESS)
-        return err_code;
+        // Write the content one line at a time
+        out << RECORD_CONTENT_IDENTIFIER << ef_line;
+    }
+}
+
+// Copy the EF into the IF of the FS at the given path, written through fs_file
+int copyin_record(const std::string& fs_path, std::fstream& fs_file, const std::string& ef_path,
+    const std::string& if_path, fs_index* index, fs_journal* journal)
+{
+    std::fstream ef_file;
 
     // Open EF file in read mode, throws error if file does not exist
-    if ((err_code = open_ef(ef_path, ef_file, std::ios::in, true)) != EXIT_SUCCESS)
+    int err_code = open_ef(ef_path, ef_file, std::ios::in, true);
+    if (err_code != EXIT_SUCCESS)
         return err_code;
 
     // Check whether the given path for IF is valid
@@ -40,76 +61,108 @@ int vsfs_copyin(int argc, char** argv)
 
     // Determine whether to base64 encode file data
     std::stringstream ef_data;
-    if (is_file_ascii(ef_path))
+    bool is_ascii = is_file_ascii(ef_path);
+    if (is_ascii)
     {
         // File is ASCII, simply read the buffer
         ef_data << ef_file.rdbuf();
     }
-    else
-    {
-        // File is not ASCII, encode
-        if (base64_encode(ef_path, ef_data))
-        {
-            fprintf(stderr, "%s Could not encode IF \"%s\"", VSFS_ERROR_PREFIX, ef_path.c_str());
-            return EXIT_FAILURE;
-        }
-    }
 
     // Seek to the end of file to append any new records
     fs_file.seekg(0, std::ios::end);
+    if (!begin_journal(fs_file, journal))
+        return EIO;
+
+    fs_map fs_mapping;
+    if (!map_fs(fs_path, fs_file, fs_mapping))
+    {
+        fprintf(stderr, "%s FS could not be mapped: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+        return EIO;
+    }
 
-    // Delete the record first, if existing
-    bool existing = delete_record(fs_file, if_path);
+    // One pass finds the record to delete first, if existing, or else which intermediate dirs are to be created
+    std::vector<std::string_view> dir_paths;
+    std::vector<bool> is_dir_found;
+    size_t existing_offset = find_file_and_dirs(fs_mapping.get_data(), if_path, index, dir_paths, is_dir_found);
 
-    if (!existing)
+    // The body the record replaced referred to, released once the new record is written
+    std::vector<std::string> released;
+    if (existing_offset != std::string_view::npos)
     {
-        // New record, ensure all subdirs are present
-        size_t curr_delim;
-        std::string curr_path = if_path;
-        std::string inner_path;
+        std::string_view released_hash = get_reference(fs_mapping.get_data(), existing_offset);
+        if (!released_hash.empty())
+            released.emplace_back(released_hash);
 
-        // Traverse from outermost intermediate directory, if any stage a dir is found, break, else create
-        while ((curr_delim = curr_path.find_first_of(PATH_SEPARATOR)) != std::string::npos && curr_delim != 0)
+        delete_record_at(fs_file, if_path, existing_offset, index, journal);
+    }
+    else
+    {
+        // New record, create the intermediate dirs not present, from the outermost
+        for (size_t i = 0; i < dir_paths.size(); i++)
         {
-            inner_path += curr_path.substr(0, curr_delim + 1);
-            if (!record_exists(inner_path, fs_file))
+            if (is_dir_found[i])
+                continue;
+
+            size_t dir_offset = fs_file.tellp();
+            fs_file << DIR_RECORD_IDENTIFIER << dir_paths[i] << '\n';
+
+            if (index)
             {
-                // Create intermediate directory
-                fs_file << DIR_RECORD_IDENTIFIER << inner_path << '\n';
+                size_t dir_length = (size_t) fs_file.tellp() - dir_offset;
+                index->insert(dir_paths[i], {DIR_RECORD_IDENTIFIER, dir_offset, dir_length});
             }
-
-            // Traverse inwards
-            curr_path = curr_path.substr(curr_delim + 1);
         }
     }
 
     try
     {
-        // Add new record entry to FS
-        fs_file << FILE_RECORD_IDENTIFIER << if_path << '\n';
+        // To be compressed or deduped, the content lines are built before anything is written
+        std::string content_lines;
+        std::string hash;
+        bool is_dedup = is_dedup_enabled();
+        bool is_buffered = is_dedup || is_compression_enabled();
+        bool is_referring{};
+        if (is_buffered)
+        {
+            std::ostringstream content_data;
+            write_ef_content(ef_file, ef_data, is_ascii, content_data);
+            content_lines = content_data.str();
+
+            // Content is stored in blocks when that makes it smaller
+            std::string block_lines;
+            if (is_compression_enabled() && compress_content(content_lines, block_lines))
+                content_lines.swap(block_lines);
+        }
 
-        // Write from EF to IF
-        std::string ef_line;
-        while (read_line(ef_data, ef_line))
+        // With dedup, the lines are hashed as they are stored, to refer to a body of the same content. Content that
+        // does not end its last line cannot be followed by a reference, and is written as it is
+        if (is_dedup && !content_lines.empty() && content_lines.back() == '\n')
         {
-            // Truncating the line to 255 characters (' ' + content + '\n' or 1 + 253 + 1 = 255)
-            size_t size = ef_line.size();
+            hash = hash_content(content_lines);
 
-            // For lengths 254 (255 - 1 for the record type identifier ' ') and greater
-            if (size >= MAXIMUM_RECORD_LENGTH - 1)
-            {
-                ef_line.resize(MAXIMUM_RECORD_LENGTH - 2);
-                ef_line.append("\n");
-            }
-                // For lengths smaller than 254 and greater than 0
-            else if (size > 0 && ef_line.at(size - 1) != '\n')
-            {
-                ef_line.append("\n");
-            }
+            // Content of the same hash as another body's is not deduped, the body already has it
+            bool is_collision;
+            bool is_found = find_body(fs_mapping.get_data(), hash, content_lines, journal, is_collision)
+                != std::string_view::npos;
+            if (!is_found && !is_collision)
+                fs_file << BODY_RECORD_IDENTIFIER << hash << '\n' << content_lines;
 
-            // Write the content one line at a time
-            fs_file << RECORD_CONTENT_IDENTIFIER << ef_line;
+            is_referring = is_found || !is_collision;
         }
+
+        // Add new record entry to FS
+        size_t record_offset = fs_file.tellp();
+        fs_file << FILE_RECORD_IDENTIFIER << if_path << '\n';
+
+        if (is_referring)
+            fs_file << REFERENCE_IDENTIFIER << hash << '\n';
+        else if (is_buffered)
+            fs_file << content_lines;
+        else
+            write_ef_content(ef_file, ef_data, is_ascii, fs_file);
+
+        if (index)
+            index->insert(if_path, {FILE_RECORD_IDENTIFIER, record_offset, (size_t) fs_file.tellp() - record_offset});
     }
     catch (const std::fstream::failure& failure)
     {
@@ -119,9 +172,59 @@ int vsfs_copyin(int argc, char** argv)
         return failure.code().value();
     }
 
+    // The body is only deleted if the new record does not refer to it too
+    fs_mapping.unmap();
+    release_bodies(fs_path, fs_file, released, journal);
+
+    return EXIT_SUCCESS;
+}
+
+int vsfs_copyin(int argc, char** argv)
+{
+    // Verify number of arguments
+    if (argc != 5)
+    {
+        fprintf(stderr, "%s Arguments for command \"copyin\", expected 3, received %d\n",
+            VSFS_ERROR_PREFIX, argc - 2);
+        return EXIT_FAILURE;
+    }
+
+    std::string fs_path = argv[2], ef_path = argv[3], if_path = argv[4];
+    std::fstream fs_file;
+    bool is_compressed{};
+
+    // Open FS file in both read and write mode
+    int err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::out);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    // Recover the FS from any change left incomplete, if journaled
+    fs_journal fs_log;
+    fs_journal* journal;
+    if (!open_journal(fs_path, is_compressed, fs_log, journal))
+        return EIO;
+
+    // Find existing records through the sidecar index, if in use
+    fs_index fs_sidecar;
+    fs_index* index = open_index(fs_path, is_compressed, fs_sidecar);
+
+    if ((err_code = copyin_record(fs_path, fs_file, ef_path, if_path, index, journal)) != EXIT_SUCCESS)
+        return err_code;
+
+    if (!commit_journal(fs_file, journal))
+        return EIO;
+
+    // Defrag the FS once deleted records exceed the compaction policy, if any
+    bool is_compacted;
+    err_code = compact_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::out, index, journal, is_compacted);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    save_index(fs_path, fs_file, index);
+
     // If FS was found zipped, re-zip it
     if (is_compressed)
-        gzip_fs(true, fs_path);
+        return deflate_fs(fs_path, fs_file, argv[2]);
 
     return EXIT_SUCCESS;
 }
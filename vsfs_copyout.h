@@ -1,99 +1,212 @@
 #ifndef VSFS_COPYOUT_H
 #define VSFS_COPYOUT_H
 
+#include "vsfs_ascii.h"
+#include "vsfs_base64.h"
 #include "vsfs_helpers.h"
 #include "vsfs_constants.h"
 
-int vsfs_copyout(int argc, char** argv)
+/*
+ * Write the content of the IF at the given offset of the mapped FS out into the EF, decoding it unless it is ASCII.
+ * The content is read through twice, to tell whether it is ASCII and then to write or decode it a line at a time.
+ **/
+int write_if_content(std::string_view fs_data, size_t record_offset, const std::string& if_path,
+    const std::string& ef_path)
 {
-    // Verify number of arguments
-    if (argc != 5)
+    // Only file records have content
+    bool is_file = fs_data[record_offset] == FILE_RECORD_IDENTIFIER;
+
+    ascii_check content_check;
+    auto check_line = [&](std::string_view line)
     {
-        fprintf(stderr, "%s Arguments for command \"copyout\", expected 3, received %d\n",
-            VSFS_ERROR_PREFIX, argc - 2);
+        content_check.add(line);
+        content_check.add("\n");
+    };
+
+    if (is_file && !read_content_lines(fs_data, record_offset, check_line))
+    {
+        fprintf(stderr, "%s Content of IF could not be read \"%s\"\n", VSFS_ERROR_PREFIX, if_path.c_str());
         return EXIT_FAILURE;
     }
 
-    std::string fs_path = argv[2], if_path = argv[3], ef_path = argv[4];
-    std::fstream fs_file, ef_file;
-    bool is_compressed{};
-
-    // Open FS file in read/write/append mode
-    int err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::out);
+    // Write the EF next to where it goes, so it is replaced at once and never left partly written
+    std::string tmp_path;
+    std::fstream ef_file;
+    int err_code = open_temp(ef_path, tmp_path, ef_file);
     if (err_code != EXIT_SUCCESS)
         return err_code;
 
-    if (!record_exists(if_path, fs_file))
+    try
+    {
+        // ASCII content is written as is, else it is decoded, line breaks being skipped either way
+        bool is_ascii = content_check.is_data_ascii();
+        base64_decoder decoder;
+        bool is_decoded = true;
+        auto write_line = [&](std::string_view line)
+        {
+            if (is_ascii)
+            {
+                ef_file.write(line.data(), (std::streamsize) line.size());
+                ef_file.put('\n');
+            }
+            else if (is_decoded)
+            {
+                is_decoded = decoder.decode(line, ef_file);
+            }
+        };
+
+        bool is_read = !is_file || read_content_lines(fs_data, record_offset, write_line);
+        if (!is_read || !is_decoded || !decoder.is_complete())
+        {
+            fprintf(stderr, "%s Failed decoding file \"%s\"\n", VSFS_ERROR_PREFIX, ef_path.c_str());
+            ef_file.close();
+            unlink(tmp_path.c_str());
+            return EXIT_FAILURE;
+        }
+
+        ef_file.close();
+    }
+    catch (const std::ios::failure& failure)
+    {
+        fprintf(stderr, "%s Failed to write EF \"%s\" %s\n",
+            VSFS_ERROR_PREFIX, ef_path.c_str(), failure.code().message().c_str());
+        unlink(tmp_path.c_str());
+        return failure.code().value();
+    }
+
+    // Moving erases the EF's content if existing, as expected
+    return publish_temp(tmp_path, ef_path);
+}
+
+// Copy the IF of the FS at the given path, read through fs_file, out into the EF
+int copyout_record(const std::string& fs_path, std::fstream& fs_file, const std::string& if_path,
+    const std::string& ef_path, fs_index* index)
+{
+    // Read the IF straight from the mapped FS
+    fs_map fs_mapping;
+    if (!map_fs(fs_path, fs_file, fs_mapping))
+    {
+        fprintf(stderr, "%s FS could not be mapped: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+        return EIO;
+    }
+
+    std::string_view fs_data = fs_mapping.get_data();
+    size_t record_offset = find_record(fs_data, if_path, FILE_LINE | DIR_LINE, index);
+    if (record_offset == std::string_view::npos)
     {
         fprintf(stderr, "%s IF could not be found \"%s\"\n", VSFS_ERROR_PREFIX, if_path.c_str());
         return ENOENT;
     }
 
-    // Create temporary EF in case file is binary and is to be decoded later
-    std::stringstream tmp_stream;
-    err_code = run_command("mktemp", &tmp_stream);
-    if (err_code != EXIT_SUCCESS)
+    return write_if_content(fs_data, record_offset, if_path, ef_path);
+}
+
+// Copy the IF of the compressed FS at the given path out into the EF, inflating only the members it lies in
+int copyout_record_gz(const std::string& gz_path, fs_gz& fs_members, const std::string& if_path,
+    const std::string& ef_path)
+{
+    std::string fs_data;
+    size_t record_offset;
+    if (!read_record_gz(gz_path, fs_members, if_path, FILE_LINE | DIR_LINE, fs_data, record_offset))
     {
-        fprintf(stderr, "%s Failed creating necessary /tmp file\n", VSFS_ERROR_PREFIX);
+        fprintf(stderr, "%s Failed unzipping FS \"%s\"\n", VSFS_ERROR_PREFIX, gz_path.c_str());
         return EXIT_FAILURE;
     }
 
-    // Create intermediate directories if needed
-    err_code = run_command(("touch " + ef_path).c_str(), nullptr);
-    if (err_code != EXIT_SUCCESS)
+    if (record_offset == std::string_view::npos)
     {
-        fprintf(stderr, "%s Failed creating intermediate directories for EF \"%s\"\n",
-            VSFS_ERROR_PREFIX, ef_path.c_str());
-        return EXIT_FAILURE;
+        fprintf(stderr, "%s IF could not be found \"%s\"\n", VSFS_ERROR_PREFIX, if_path.c_str());
+        return ENOENT;
     }
 
-    std::string tmp_ef = tmp_stream.str().substr(0, tmp_stream.str().find('\n'));
-    bool written = false;
+    return write_if_content(fs_data, record_offset, if_path, ef_path);
+}
 
-    // Write from IF out to temporary file
-    std::string fs_line;
-    while (read_line(fs_file, fs_line) && !written)
+// Copy the IF of the NOTES V2.0 FS at the given path out into the EF, found through the FS' directory
+int copyout_record_v2(const std::string& fs_path, const std::string& if_path, const std::string& ef_path)
+{
+    fs_v2 fs;
+    if (!fs.open(fs_path))
     {
-        if (fs_line.front() == FILE_RECORD_IDENTIFIER && fs_line.substr(1) == if_path)
-        {
-            // Open tmp EF file in write mode
-            err_code = open_ef(tmp_ef, ef_file, std::ios::out | std::ios::trunc, false);
-            if (err_code != EXIT_SUCCESS)
-                return err_code;
-
-            // Write the IF's content to EF one line at a time
-            while (read_line(fs_file, fs_line) && fs_line.front() == RECORD_CONTENT_IDENTIFIER)
-                ef_file << fs_line.substr(1) << "\n";
-
-            written = true;
-        }
+        fprintf(stderr, "%s FS is not a valid \"%s\" FS: %s\n", VSFS_ERROR_PREFIX, FS_V2_FIRST_RECORD, fs_path.c_str());
+        return EXIT_FAILURE;
     }
 
-    // If FS was found zipped, re-zip it
-    if (is_compressed)
-        gzip_fs(true, fs_path);
-
+    std::optional<fs_v2::record> found = fs.find(if_path);
+    if (!found)
+    {
+        fprintf(stderr, "%s IF could not be found \"%s\"\n", VSFS_ERROR_PREFIX, if_path.c_str());
+        return ENOENT;
+    }
 
-    ef_file.clear();
-    ef_file.close();
+    // Write the EF next to where it goes, so it is replaced at once and never left partly written
+    std::string tmp_path;
+    std::fstream ef_file;
+    int err_code = open_temp(ef_path, tmp_path, ef_file);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
 
-    // If the tmp file was found to be ASCII, simply move it
-    if (is_file_ascii(tmp_ef))
+    try
     {
-        // Moving erases the EF's content if existing, as expected
-        err_code = run_command(("mv \"" + tmp_ef + "\" \"" + ef_path + "\"").c_str(), nullptr);
-        if (err_code != EXIT_SUCCESS) {
-            fprintf(stderr, "%s EF could not be created \"%s\"\n", VSFS_ERROR_PREFIX, ef_path.c_str());
-            return err_code;
+        // A binary EF is written as the base64 lines copyout writes it as from NOTES V1.0, the payload being the
+        // bytes they were decoded from. Any other payload already is the EF, a dir's being empty
+        if (found->is_binary)
+        {
+            view_buffer payload(found->payload);
+            base64_encode(payload, ef_file, MAXIMUM_RECORD_LENGTH - 2, '\0');
         }
+        else
+        {
+            ef_file.write(found->payload.data(), (std::streamsize) found->payload.size());
+        }
+        ef_file.close();
+    }
+    catch (const std::ios::failure& failure)
+    {
+        fprintf(stderr, "%s Failed to write EF \"%s\" %s\n",
+            VSFS_ERROR_PREFIX, ef_path.c_str(), failure.code().message().c_str());
+        unlink(tmp_path.c_str());
+        return failure.code().value();
     }
-    else
+
+    return publish_temp(tmp_path, ef_path);
+}
+
+int vsfs_copyout(int argc, char** argv)
+{
+    // Verify number of arguments
+    if (argc != 5)
     {
-        // Else decode the file
-        return base64_decode(tmp_ef, ef_path);
+        fprintf(stderr, "%s Arguments for command \"copyout\", expected 3, received %d\n",
+            VSFS_ERROR_PREFIX, argc - 2);
+        return EXIT_FAILURE;
     }
 
-    return EXIT_SUCCESS;
+    std::string fs_path = argv[2], if_path = argv[3], ef_path = argv[4];
+    std::fstream fs_file;
+    bool is_compressed{};
+    unsigned int fs_version{};
+
+    // A compressed FS written in members has only those the IF lies in inflated
+    fs_gz fs_members;
+    if (open_fs_members(fs_path, fs_members))
+        return copyout_record_gz(fs_path, fs_members, if_path, ef_path);
+
+    // Open FS file in read mode
+    int err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::in, &fs_version);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    // A NOTES V2.0 FS is only ever written whole by convert, so has no journal to recover from
+    if (fs_version == FS_V2)
+        return copyout_record_v2(fs_path, if_path, ef_path);
+
+    // The FS is read as it is, opening its journal would lock it and could write to it to recover any incomplete change
+    // Find the IF through the sidecar index, if in use
+    fs_index fs_sidecar;
+    fs_index* index = open_index(fs_path, is_compressed, fs_sidecar);
+
+    return copyout_record(fs_path, fs_file, if_path, ef_path, index);
 }
 
 #endif // VSFS_COPYOUT_H
@@ -4,6 +4,786 @@
 #include "vsfs_helpers.h"
 #include "vsfs_constants.h"
 
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+
+/*
+ * Defrag sorts the FS' records either as a tree built in memory, or, given a budget in VSFS_DEFRAG_MEMORY, as a key
+ * per live record with an external merge sort, the records' lines then being copied from the old FS in that order.
+ * Both write the same FS.
+ *
+ * sort only orders the children of a dir once the dir itself is compared with a sibling, so a dir that is the only
+ * child of its parent, and every dir within it, keeps its children in the order they were added in. The external sort
+ * learns which dirs those are from a first pass over the FS, the dirs then being kept in memory whatever the budget.
+ */
+
+// Where a live record, or a later part of a file's content, is in the FS being defragged
+struct defrag_key
+{
+    std::string path;
+
+    // 0 for the record and the content lines that directly follow it, then one per later run of content lines
+    uint32_t part;
+
+    // Where the record itself is, for every part
+    uint64_t record_offset;
+    uint64_t content_offset;
+    uint64_t content_size;
+};
+
+// A dir of the FS being defragged, keyed by its path, the root being ""
+struct defrag_dir
+{
+    uint64_t record_offset;
+    size_t child_count;
+
+    // Whether the dir's children are ordered by sort, or kept in order of the FS
+    bool is_sorted;
+};
+
+using defrag_dirs = std::unordered_map<std::string_view, defrag_dir>;
+
+// A temporary file of sorted keys, deleted once closed
+using defrag_run = std::unique_ptr<FILE, int (*)(FILE*)>;
+
+/*
+ * Declarations
+ */
+
+/*
+ * Defrag the FS at the given path, read through fs_file.
+ *
+ * A zipped FS is defragged into a new file in memory, fs_path is then set to it. In both cases fs_file is left open
+ * in the given mode on the defragged FS. A journal, if given, is emptied first and follows the FS to its new file.
+ */
+int defrag_fs(std::string& fs_path, std::fstream& fs_file, bool is_compressed, std::_Ios_Openmode open_mode,
+    fs_journal* journal);
+
+// Memory to sort the FS' records in, from VSFS_DEFRAG_MEMORY, 0 to sort them as a tree
+size_t get_defrag_memory();
+
+// Find every dir of the mapped FS, how many children it has and whether sort orders them
+void find_defrag_dirs(std::string_view fs_data, defrag_dirs& dirs);
+
+// Order of two keys in the defragged FS, that of sort: dirs before files, then by name, within each sorted dir
+int compare_keys(const defrag_key& key1, const defrag_key& key2, const defrag_dirs& dirs);
+
+/*
+ * Write the records of the mapped FS at the given path to defrag_file in defragged order, as write_fs does for its
+ * sorted tree, keeping no more than about memory_budget bytes of keys in memory. Where the content of each body is
+ * is kept in memory besides.
+ *
+ * False if the FS is invalid, as build_tree finds it but for a dir recorded before the dir it is within, and reported
+ * as it does though not always for the same record first, records only being checked once sorted.
+ */
+bool write_defragged(fs_map& fs_mapping, const std::string& fs_path, std::fstream& defrag_file, size_t memory_budget);
+
+/*
+ * Create a run for the FS at the given path, in TMPDIR if set, else next to the FS so that it is on disk with it
+ * rather than in a /tmp that is often held in memory, or in /tmp for a zipped FS that is in memory anyway. The run is
+ * deleted as soon as it is created, so is gone once closed even if defrag is interrupted. nullptr if it could not be.
+ **/
+FILE* open_run(const std::string& fs_path);
+
+// Sort the keys into a new run for the FS at the given path and clear them, false on an I/O error
+bool write_run(std::vector<defrag_key>& keys, const defrag_dirs& dirs, const std::string& fs_path,
+    std::vector<defrag_run>& runs);
+
+// Merge sorted runs, passing each key in order to on_key, false as soon as it returns false or on an I/O error
+template<typename Callback>
+bool merge_runs(std::vector<defrag_run>& runs, const defrag_dirs& dirs, Callback&& on_key);
+
+bool write_key(FILE* run, const defrag_key& key);
+
+// Read the next key of a run, false at its end or on an I/O error
+bool read_key(FILE* run, defrag_key& key);
+
+int vsfs_defrag(int argc, char** argv);
+
+/*
+ * Definitions
+ */
+
+int defrag_fs(std::string& fs_path, std::fstream& fs_file, bool is_compressed, std::_Ios_Openmode open_mode,
+    fs_journal* journal)
+{
+    // Offsets the journal holds only refer to the FS being replaced, which what was written through the stream must
+    // reach before the journal is emptied
+    fs_file.flush();
+    if (journal && !journal->checkpoint())
+    {
+        fprintf(stderr, "%s Journal could not be committed: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+        return EIO;
+    }
+
+    // Build a file tree to easily sort the records, unless only their keys are to be sorted in bounded memory
+    size_t memory_budget = get_defrag_memory();
+    fs_map fs_mapping;
+    fs_arena fs_tree;
+    std::vector<file*> fs_records;
+    fs_bodies bodies;
+    dir* fs_root = nullptr;
+    if (!memory_budget)
+    {
+        fs_root = build_tree(fs_path, fs_file, fs_mapping, fs_tree, fs_records, bodies, false, false);
+        if (!fs_root)
+            return EXIT_FAILURE;
+
+        sort(fs_root, get_parse_threads(fs_mapping.get_data().size()));
+    }
+    else if (!map_fs(fs_path, fs_file, fs_mapping))
+    {
+        fprintf(stderr, "%s FS could not be mapped: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+        return EIO;
+    }
+
+    // The tree's content still points into the FS, so write the new FS next to it instead of truncating it
+    // A zipped FS is instead written in memory, to then be compressed over the original
+    std::string tmp_path;
+    std::fstream tmp_file;
+    int err_code = is_compressed
+        ? open_memory_file(fs_path, tmp_path, tmp_file)
+        : open_temp(fs_path, tmp_path, tmp_file);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    // Write the new FS file
+    tmp_file << FS_FIRST_RECORD << '\n';
+    if (fs_root)
+    {
+        // Bodies are written before the first file referring to them, those no file refers to any more are dropped
+        std::unordered_set<const file*> written_bodies;
+        write_fs(fs_root, tmp_file, written_bodies);
+    }
+    else if (!write_defragged(fs_mapping, fs_path, tmp_file, memory_budget))
+    {
+        // An invalid FS is only found while its records are written, the FS is then left as it was
+        tmp_file.close();
+        if (is_compressed)
+            close_memory_file(tmp_path);
+        else
+            unlink(tmp_path.c_str());
+
+        return EXIT_FAILURE;
+    }
+
+    // Free memory, the whole tree at once
+    fs_tree.release();
+    fs_mapping.unmap();
+
+    fs_file.clear();
+    fs_file.close();
+
+    // The file in memory already is the defragged FS, the one it replaces is released
+    if (is_compressed)
+    {
+        close_memory_file(fs_path);
+        fs_path = tmp_path;
+        fs_file.swap(tmp_file);
+        return EXIT_SUCCESS;
+    }
+
+    tmp_file.close();
+
+    // The defragged FS must be durable before it replaces the one the journal synced
+    if (journal && !sync_file(tmp_path))
+    {
+        fprintf(stderr, "%s FS could not be synced: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+        unlink(tmp_path.c_str());
+        return EIO;
+    }
+
+    // Replace the FS with the defragged one
+    if ((err_code = publish_temp(tmp_path, fs_path)) != EXIT_SUCCESS)
+        return err_code;
+
+    if (journal && !journal->reopen(fs_path))
+    {
+        fprintf(stderr, "%s Journal could not be opened: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+        return EIO;
+    }
+
+    try
+    {
+        if (!open_file(fs_path, fs_file, open_mode))
+        {
+            fprintf(stderr, "%s FS could not be opened: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+            return EIO;
+        }
+    }
+    catch (const std::ios::failure& failure)
+    {
+        fprintf(stderr, "%s FS I/O error: %s\n", VSFS_ERROR_PREFIX, failure.code().message().c_str());
+        return failure.code().value();
+    }
+
+    return EXIT_SUCCESS;
+}
+
+size_t get_defrag_memory()
+{
+    const char* memory_variable = getenv(DEFRAG_MEMORY_VARIABLE);
+    if (!memory_variable || !*memory_variable)
+        return 0;
+
+    size_t memory_budget;
+    if (!parse_size(memory_variable, memory_budget))
+    {
+        fprintf(stderr, "%s Ignoring invalid %s \"%s\"\n", VSFS_ERROR_PREFIX, DEFRAG_MEMORY_VARIABLE, memory_variable);
+        return 0;
+    }
+
+    return memory_budget;
+}
+
+void find_defrag_dirs(std::string_view fs_data, defrag_dirs& dirs)
+{
+    dirs.clear();
+    dirs[""] = {0, 0, true};
+
+    std::vector<std::string_view> dir_paths;
+    auto get_parent = [](std::string_view path)
+    {
+        size_t name_start = path.find_last_of(PATH_SEPARATOR, path.size() - 2);
+        return name_start == std::string_view::npos ? std::string_view() : path.substr(0, name_start + 1);
+    };
+
+    // Jump from record to record, each being a child of the dir it is within
+    size_t line_start = 0;
+    while ((line_start = find_line(fs_data, line_start, FILE_LINE | DIR_LINE)) < fs_data.size())
+    {
+        size_t line_end = std::min(fs_data.find('\n', line_start), fs_data.size());
+        std::string_view path = fs_data.substr(line_start + 1, line_end - line_start - 1);
+        if (path.empty())
+            continue;
+
+        auto parent = dirs.find(get_parent(path));
+        if (parent != dirs.end())
+            parent->second.child_count++;
+
+        if (fs_data[line_start] == DIR_RECORD_IDENTIFIER && dirs.emplace(path, defrag_dir{line_start, 0, false}).second)
+            dir_paths.push_back(path);
+    }
+
+    // A dir is sorted once compared with a sibling, which only happens within a sorted dir, parents coming first
+    for (std::string_view path: dir_paths)
+    {
+        auto parent = dirs.find(get_parent(path));
+        dirs[path].is_sorted = parent != dirs.end() && parent->second.is_sorted && parent->second.child_count > 1;
+    }
+}
+
+int compare_keys(const defrag_key& key1, const defrag_key& key2, const defrag_dirs& dirs)
+{
+    std::string_view path1 = key1.path;
+    std::string_view path2 = key2.path;
+
+    // Paths are compared a name at a time, the names before the first that differs being the same dirs
+    size_t name_start = 0;
+    while (name_start < path1.size() && name_start < path2.size())
+    {
+        size_t name1_end = std::min(path1.find(PATH_SEPARATOR, name_start), path1.size() - 1) + 1;
+        size_t name2_end = std::min(path2.find(PATH_SEPARATOR, name_start), path2.size() - 1) + 1;
+        std::string_view name1 = path1.substr(name_start, name1_end - name_start);
+        std::string_view name2 = path2.substr(name_start, name2_end - name_start);
+
+        if (name1 != name2)
+        {
+            bool is_dir1 = name1.back() == PATH_SEPARATOR;
+            bool is_dir2 = name2.back() == PATH_SEPARATOR;
+
+            // Children of a dir sort never ordered keep the order they were added to it in, that of their records
+            auto parent = dirs.find(path1.substr(0, name_start));
+            if (parent != dirs.end() && !parent->second.is_sorted)
+            {
+                auto dir1 = is_dir1 ? dirs.find(path1.substr(0, name1_end)) : dirs.end();
+                auto dir2 = is_dir2 ? dirs.find(path2.substr(0, name2_end)) : dirs.end();
+                uint64_t offset1 = dir1 != dirs.end() ? dir1->second.record_offset : key1.record_offset;
+                uint64_t offset2 = dir2 != dirs.end() ? dir2->second.record_offset : key2.record_offset;
+                if (offset1 != offset2)
+                    return offset1 < offset2 ? -1 : 1;
+            }
+
+            // Dirs get higher privilege, as in sort
+            if (is_dir1 != is_dir2)
+                return is_dir1 ? -1 : 1;
+
+            return name1.compare(name2) < 0 ? -1 : 1;
+        }
+
+        name_start = name1_end;
+    }
+
+    // A dir comes before the records within it
+    if (path1.size() != path2.size())
+        return path1.size() < path2.size() ? -1 : 1;
+
+    // Parts of the same file in order of the FS, as are duplicate records so that the later one is reported
+    if (key1.part != key2.part)
+        return key1.part < key2.part ? -1 : 1;
+
+    return key1.record_offset < key2.record_offset ? -1 : key1.record_offset > key2.record_offset;
+}
+
+bool write_defragged(fs_map& fs_mapping, const std::string& fs_path, std::fstream& defrag_file, size_t memory_budget)
+{
+    std::string_view fs_data = fs_mapping.get_data();
+    size_t fs_offset = 0;
+    std::string_view fs_line;
+
+    // Skip the first record, already verified when the FS was opened
+    read_line(fs_data, fs_offset, fs_line);
+
+    defrag_dirs dirs;
+    find_defrag_dirs(fs_data, dirs);
+
+    std::vector<defrag_key> keys;
+    std::vector<defrag_run> runs;
+    size_t keys_size = 0;
+
+    // Where the content of each body is, bodies being written with the first file that refers to them
+    struct defrag_body
+    {
+        std::vector<std::string_view> content;
+        bool is_written;
+    };
+
+    std::unordered_map<std::string_view, defrag_body> bodies;
+
+    // The file content lines belong to, as in insert_record, and whether they would directly follow its last key
+    std::string curr_file;
+    uint64_t curr_file_offset = 0;
+    uint32_t curr_part = 0;
+    bool is_file_found = false;
+    bool is_adjacent = false;
+
+    // The body content lines belong to instead, and whether the current file refers to one
+    defrag_body* curr_body = nullptr;
+    std::string_view curr_hash;
+    bool is_referring = false;
+
+    bool is_scanned = scan_records(fs_data, fs_offset, [&](const fs_record& record)
+    {
+        // Only the keys are kept, so pages already walked need not stay resident
+        fs_mapping.drop_before(record.offset);
+
+        char record_type = record.record_type;
+        bool is_dir = record_type == DIR_RECORD_IDENTIFIER;
+
+        // Blocks are copied as content lines are, without being inflated
+        bool is_content = record_type == RECORD_CONTENT_IDENTIFIER || record_type == BLOCK_IDENTIFIER;
+
+        // Keys past the budget are sorted into a run of their own, a key and the line directly after it never split
+        bool is_new_key = record_type == FILE_RECORD_IDENTIFIER || is_dir
+            || (is_content && !curr_body && !is_adjacent);
+        if (is_new_key && keys_size >= memory_budget)
+        {
+            if (!write_run(keys, dirs, fs_path, runs))
+                return false;
+
+            keys_size = 0;
+        }
+
+        if (record_type == FILE_RECORD_IDENTIFIER || is_dir)
+        {
+            if (!is_internal_path_valid(record.text, is_dir))
+            {
+                fprintf(stderr, "%s Invalid record path \"%.*s\"\n",
+                    VSFS_ERROR_PREFIX, (int) record.text.size(), record.text.data());
+                return false;
+            }
+
+            keys.push_back({std::string(record.text), 0, record.offset, record.offset, 0});
+            keys_size += sizeof(defrag_key) + record.text.size();
+
+            if (!is_dir)
+            {
+                curr_file = record.text;
+                curr_file_offset = record.offset;
+                curr_part = 0;
+                is_file_found = true;
+                curr_body = nullptr;
+                is_referring = false;
+            }
+
+            is_adjacent = !is_dir;
+        }
+        else if (is_content && curr_body)
+        {
+            size_t line_count;
+            if (record_type == BLOCK_IDENTIFIER && !count_block_lines(record.text, line_count))
+            {
+                fprintf(stderr, "%s FS block of file \"%.*s\" is malformed\n",
+                    VSFS_ERROR_PREFIX, (int) curr_hash.size(), curr_hash.data());
+                return false;
+            }
+
+            curr_body->content.push_back(record.text);
+        }
+        else if (is_content)
+        {
+            if (!is_file_found)
+            {
+                std::string_view line_content = record.text.substr(1, record.text.find('\n') - 1);
+                fprintf(stderr, "%s No file for content to belong to \"%.*s...\"\n", VSFS_ERROR_PREFIX,
+                    (int) std::min(line_content.size(), (size_t) 10), line_content.data());
+                return false;
+            }
+
+            if (is_referring)
+            {
+                fprintf(stderr, "%s FS file \"%s\" has both content and a body\n", VSFS_ERROR_PREFIX,
+                    curr_file.c_str());
+                return false;
+            }
+
+            size_t line_count;
+            if (record_type == BLOCK_IDENTIFIER && !count_block_lines(record.text, line_count))
+            {
+                fprintf(stderr, "%s FS block of file \"%s\" is malformed\n", VSFS_ERROR_PREFIX, curr_file.c_str());
+                return false;
+            }
+
+            // Content after a dir record still belongs to the last file, as a later part of it
+            if (is_adjacent)
+            {
+                keys.back().content_offset = record.offset;
+                keys.back().content_size = record.text.size();
+            }
+            else
+            {
+                keys.push_back({curr_file, ++curr_part, curr_file_offset, record.offset, record.text.size()});
+                keys_size += sizeof(defrag_key) + curr_file.size();
+            }
+
+            is_adjacent = false;
+        }
+        else if (record_type == BODY_RECORD_IDENTIFIER)
+        {
+            if (record.text.empty())
+            {
+                fprintf(stderr, "%s FS body has no hash\n", VSFS_ERROR_PREFIX);
+                return false;
+            }
+
+            // A body recorded again under the same hash replaces the first for the files after it
+            curr_body = &(bodies[record.text] = {{}, false});
+            curr_hash = record.text;
+            is_adjacent = false;
+        }
+        else if (record_type == REFERENCE_IDENTIFIER)
+        {
+            // The reference is the file's content, for the body to be found when the file is written
+            if (!is_file_found || curr_body || !is_adjacent || keys.back().content_size)
+            {
+                fprintf(stderr, "%s No file for reference to belong to \"%.*s\"\n",
+                    VSFS_ERROR_PREFIX, (int) record.text.size(), record.text.data());
+                return false;
+            }
+
+            if (!bodies.count(record.text))
+            {
+                fprintf(stderr, "%s FS body \"%.*s\" could not be found for file \"%s\"\n",
+                    VSFS_ERROR_PREFIX, (int) record.text.size(), record.text.data(), curr_file.c_str());
+                return false;
+            }
+
+            size_t line_end = std::min(record.offset + 1 + record.text.size() + 1, fs_data.size());
+            keys.back().content_offset = record.offset;
+            keys.back().content_size = line_end - record.offset;
+            is_adjacent = false;
+            is_referring = true;
+        }
+        else if (record_type == DELETED_RECORD_IDENTIFIER)
+        {
+            is_adjacent = false;
+        }
+        else
+        {
+            fprintf(stderr, "%s Unknown record type %c\n", VSFS_ERROR_PREFIX, record_type);
+            return false;
+        }
+
+        return true;
+    });
+
+    if (!is_scanned)
+        return false;
+
+    // Dirs the last record written is within, from the outermost
+    struct open_dir
+    {
+        std::string path;
+        uint64_t record_offset;
+
+        // Names of the files written in a dir sort never ordered, where duplicates are not adjacent
+        std::unordered_set<std::string> file_names;
+    };
+
+    std::vector<open_dir> open_dirs;
+    std::string last_path;
+
+    auto get_name = [](std::string_view path)
+    {
+        size_t name_start = path.find_last_of(PATH_SEPARATOR, path.size() - 2);
+        return name_start == std::string_view::npos ? path : path.substr(name_start + 1);
+    };
+
+    // Report a duplicate record as insert_record does, its parent being the innermost dir open
+    auto report_duplicate = [&](const std::string& path, size_t parent_count)
+    {
+        std::string_view name = get_name(path);
+        std::string_view parent_name = parent_count ? get_name(open_dirs[parent_count - 1].path) : fs_path;
+
+        if (path.back() == PATH_SEPARATOR)
+            fprintf(stderr, "%s FS dir \"%s\" already exists in %s\n", VSFS_ERROR_PREFIX, path.c_str(),
+                parent_count ? ("dir \"" + std::string(parent_name) + '"').c_str() : "FS");
+        else
+            fprintf(stderr, "%s FS file \"%.*s\" already exists in dir \"%.*s\"\n", VSFS_ERROR_PREFIX,
+                (int) name.size(), name.data(), (int) parent_name.size(), parent_name.data());
+
+        return false;
+    };
+
+    // Copy lines straight from the old FS, they are already in record format
+    auto write_lines = [&](std::string_view lines)
+    {
+        defrag_file.write(lines.data(), (std::streamsize) lines.size());
+
+        // The FS' last line may not have been terminated
+        if (lines.back() != '\n')
+            defrag_file << '\n';
+    };
+
+    auto write_record = [&](const defrag_key& key)
+    {
+        bool is_dir = key.path.back() == PATH_SEPARATOR;
+        std::string_view content = fs_data.substr(key.content_offset, key.content_size);
+
+        if (key.part == 0)
+        {
+            // Duplicates are otherwise adjacent once sorted, a dir's being its own last open dir
+            if (key.path == last_path)
+                return report_duplicate(key.path, open_dirs.size() - (is_dir ? 1 : 0));
+
+            // Leave the dirs the record is not within
+            while (!open_dirs.empty() && key.path.compare(0, open_dirs.back().path.size(), open_dirs.back().path))
+                open_dirs.pop_back();
+
+            // Every dir the record is within must have been recorded before it
+            size_t dir_count = (size_t) std::count(key.path.begin(), key.path.end() - 1, PATH_SEPARATOR);
+            if (open_dirs.size() < dir_count || (dir_count && open_dirs.back().record_offset > key.record_offset))
+            {
+                size_t missing_dir = std::min(open_dirs.size(), dir_count - 1);
+                size_t name_start = 0;
+                for (size_t i = 0; i < missing_dir; i++)
+                    name_start = key.path.find(PATH_SEPARATOR, name_start) + 1;
+
+                std::string_view name = std::string_view(key.path).substr(name_start,
+                    key.path.find(PATH_SEPARATOR, name_start) + 1 - name_start);
+                fprintf(stderr, "%s FS dir \"%.*s\" could not be found for %s \"%s\"\n",
+                    VSFS_ERROR_PREFIX, (int) name.size(), name.data(), is_dir ? "dir" : "file", key.path.c_str());
+                return false;
+            }
+
+            if (!is_dir && dir_count && !dirs.at(open_dirs.back().path).is_sorted
+                && !open_dirs.back().file_names.emplace(get_name(key.path)).second)
+                return report_duplicate(key.path, open_dirs.size());
+
+            // A body is written before the first file that refers to it
+            if (!content.empty() && content[0] == REFERENCE_IDENTIFIER)
+            {
+                std::string_view hash = content.substr(1, content.find('\n') - 1);
+                defrag_body& body = bodies.at(hash);
+                if (!body.is_written)
+                {
+                    defrag_file << BODY_RECORD_IDENTIFIER << hash << '\n';
+                    std::for_each(body.content.begin(), body.content.end(), write_lines);
+                    body.is_written = true;
+                }
+            }
+
+            defrag_file << (is_dir ? DIR_RECORD_IDENTIFIER : FILE_RECORD_IDENTIFIER) << key.path << '\n';
+            if (is_dir)
+                open_dirs.push_back({key.path, key.record_offset, {}});
+
+            last_path = key.path;
+        }
+
+        // Copy the record's content, or its reference, straight from the old FS
+        if (!content.empty())
+            write_lines(content);
+
+        return true;
+    };
+
+    // Keys that all fit in memory are written without a run
+    if (runs.empty())
+    {
+        std::sort(keys.begin(), keys.end(),
+            [&dirs](const defrag_key& key1, const defrag_key& key2) { return compare_keys(key1, key2, dirs) < 0; });
+
+        return std::all_of(keys.begin(), keys.end(), write_record);
+    }
+
+    if (!keys.empty() && !write_run(keys, dirs, fs_path, runs))
+        return false;
+
+    // Merge the runs a group at a time until they are few enough to be merged at once
+    while (runs.size() > DEFRAG_MERGE_WAYS)
+    {
+        std::vector<defrag_run> merged_runs;
+        for (size_t group_start = 0; group_start < runs.size(); group_start += DEFRAG_MERGE_WAYS)
+        {
+            size_t group_end = std::min(group_start + DEFRAG_MERGE_WAYS, runs.size());
+            std::vector<defrag_run> group(
+                std::make_move_iterator(runs.begin() + (long) group_start),
+                std::make_move_iterator(runs.begin() + (long) group_end));
+
+            FILE* merged_run = open_run(fs_path);
+            if (!merged_run)
+            {
+                fprintf(stderr, "%s Temporary file could not be created: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+                return false;
+            }
+
+            merged_runs.emplace_back(merged_run, fclose);
+            bool is_merged = merge_runs(group, dirs, [merged_run](const defrag_key& key)
+            {
+                if (write_key(merged_run, key))
+                    return true;
+
+                fprintf(stderr, "%s Temporary file I/O error: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+                return false;
+            });
+
+            if (!is_merged)
+                return false;
+        }
+
+        runs = std::move(merged_runs);
+    }
+
+    return merge_runs(runs, dirs, write_record);
+}
+
+FILE* open_run(const std::string& fs_path)
+{
+    const char* tmp_dir = getenv(TMPDIR_VARIABLE);
+    std::string run_path = tmp_dir && *tmp_dir ? std::string(tmp_dir) + "/vsfs.XXXXXX"
+        : is_memory_file(fs_path) ? std::string("/tmp/vsfs.XXXXXX")
+        : fs_path + ".XXXXXX";
+
+    int fd = mkstemp(run_path.data());
+    if (fd == -1)
+        return nullptr;
+
+    unlink(run_path.c_str());
+    FILE* run = fdopen(fd, "w+b");
+    if (!run)
+        close(fd);
+
+    return run;
+}
+
+bool write_run(std::vector<defrag_key>& keys, const defrag_dirs& dirs, const std::string& fs_path,
+    std::vector<defrag_run>& runs)
+{
+    std::sort(keys.begin(), keys.end(),
+        [&dirs](const defrag_key& key1, const defrag_key& key2) { return compare_keys(key1, key2, dirs) < 0; });
+
+    FILE* run = open_run(fs_path);
+    if (!run)
+    {
+        fprintf(stderr, "%s Temporary file could not be created: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+        return false;
+    }
+
+    runs.emplace_back(run, fclose);
+    for (const defrag_key& key: keys)
+    {
+        if (!write_key(run, key))
+        {
+            fprintf(stderr, "%s Temporary file I/O error: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+            return false;
+        }
+    }
+
+    keys.clear();
+    return true;
+}
+
+template<typename Callback>
+bool merge_runs(std::vector<defrag_run>& runs, const defrag_dirs& dirs, Callback&& on_key)
+{
+    // The next key of each run, the runs being taken from the one whose next key comes first
+    std::vector<defrag_key> next_keys(runs.size());
+    auto is_after = [&next_keys, &dirs](size_t run1, size_t run2)
+    {
+        return compare_keys(next_keys[run1], next_keys[run2], dirs) > 0;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(is_after)> next_runs(is_after);
+
+    for (size_t run = 0; run < runs.size(); run++)
+    {
+        rewind(runs[run].get());
+        if (read_key(runs[run].get(), next_keys[run]))
+            next_runs.push(run);
+    }
+
+    while (!next_runs.empty())
+    {
+        size_t run = next_runs.top();
+        next_runs.pop();
+
+        if (!on_key(next_keys[run]))
+            return false;
+
+        if (read_key(runs[run].get(), next_keys[run]))
+            next_runs.push(run);
+    }
+
+    for (const defrag_run& run: runs)
+    {
+        if (ferror(run.get()))
+        {
+            fprintf(stderr, "%s Temporary file I/O error: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool write_key(FILE* run, const defrag_key& key)
+{
+    auto path_size = (uint32_t) key.path.size();
+    return fwrite(&path_size, sizeof(path_size), 1, run) == 1
+        && fwrite(&key.part, sizeof(key.part), 1, run) == 1
+        && fwrite(&key.record_offset, sizeof(key.record_offset), 1, run) == 1
+        && fwrite(&key.content_offset, sizeof(key.content_offset), 1, run) == 1
+        && fwrite(&key.content_size, sizeof(key.content_size), 1, run) == 1
+        && fwrite(key.path.data(), 1, key.path.size(), run) == key.path.size();
+}
+
+bool read_key(FILE* run, defrag_key& key)
+{
+    uint32_t path_size;
+    if (fread(&path_size, sizeof(path_size), 1, run) != 1
+        || fread(&key.part, sizeof(key.part), 1, run) != 1
+        || fread(&key.record_offset, sizeof(key.record_offset), 1, run) != 1
+        || fread(&key.content_offset, sizeof(key.content_offset), 1, run) != 1
+        || fread(&key.content_size, sizeof(key.content_size), 1, run) != 1)
+        return false;
+
+    key.path.resize(path_size);
+    return fread(key.path.data(), 1, path_size, run) == path_size;
+}
+
 int vsfs_defrag(int argc, char** argv)
 {
     // Verify number of arguments
@@ -23,28 +803,23 @@ int vsfs_defrag(int argc, char** argv)
     if (err_code != EXIT_SUCCESS)
         return err_code;
 
-    // Build a file tree to easily sort the records
-    std::vector<file*> fs_records;
-    dir* fs_root = build_tree(fs_path, fs_file, fs_records, false);
-    sort(fs_root);
+    // Recover the FS from any change left incomplete, if journaled
+    fs_journal fs_log;
+    fs_journal* journal;
+    if (!open_journal(fs_path, is_compressed, fs_log, journal))
+        return EIO;
 
-    // Close and reopen FS file in write mode with contents cleared
-    fs_file.clear();
-    fs_file.close();
-    err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::out | std::ios::trunc);
-    if (err_code != EXIT_SUCCESS)
+    if ((err_code = defrag_fs(fs_path, fs_file, is_compressed, std::ios::in, journal)) != EXIT_SUCCESS)
         return err_code;
 
-    // Rewrite the new FS file
-    fs_file << FS_FIRST_RECORD << '\n';
-    write_fs(fs_root, fs_file);
-
-    // Free memory
-    delete fs_root;
-
-    // If FS was found zipped, re-zip it
+    // If FS was found zipped, re-zip the defragged FS over it
     if (is_compressed)
-        gzip_fs(true, fs_path);
+        return deflate_fs(fs_path, fs_file, argv[2]);
+
+    // Every record moved, so any sidecar index is rebuilt from the defragged FS
+    unlink((fs_path + '.' + INDEX_EXTENSION).c_str());
+    fs_index fs_sidecar;
+    open_index(fs_path, is_compressed, fs_sidecar);
 
     return EXIT_SUCCESS;
 }
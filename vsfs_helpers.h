@@ -2,18 +2,42 @@
 #define VSFS_HELPERS_H
 
 #include "dir.h"
-#include "vsfs_externals.h"
-
+#include "fs_map.h"
+#include "fs_arena.h"
+#include "fs_index.h"
+#include "fs_journal.h"
+#include "fs_pool.h"
+#include "fs_v2.h"
+#include "fs_gz.h"
+#include "vsfs_scan.h"
+#include "vsfs_blocks.h"
+
+#include <thread>
+#include <cctype>
 #include <cstring>
 #include <fstream>
 #include <sstream>
+#include <vector>
 #include <algorithm>
+#include <cerrno>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <zlib.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 /*
  * Contains most of the utility helper functions that are shared across different VSFS commands.
  */
 
+// Bodies read so far by the hash they are recorded under, the latest body recorded under a hash replacing any other
+using fs_bodies = std::unordered_map<std::string_view, file*>;
+
 /*
  * Declarations
  */
@@ -21,52 +45,243 @@
 // Verify whether the file exists
 bool file_exists(const char* path);
 
-// Verify whether a record exists
-bool record_exists(const std::string& record, std::fstream& fs_file);
+// Verify whether a file or dir record exists in the FS at the given path, fs_file is flushed first
+bool record_exists(const std::string& record, const std::string& fs_path, std::fstream& fs_file,
+    fs_index* index = nullptr);
 
 // Open a file in the given path with the provided read/write/append modes
 bool open_file(const std::string& path, std::fstream& file, std::_Ios_Openmode open_mode);
 
-// Open FS file in the given path with the specified mode
-int open_fs(std::string& fs_path, std::fstream& fs_file, bool& is_compressed, std::_Ios_Openmode open_mode);
+// Open FS file in the given path with the specified mode. A NOTES V2.0 FS is only opened for commands that read it,
+// which pass fs_version to be set to the FS' format
+int open_fs(std::string& fs_path, std::fstream& fs_file, bool& is_compressed, std::_Ios_Openmode open_mode,
+    unsigned int* fs_version = nullptr);
 
 // Open EF file in the given path with the specified mode
 int open_ef(const std::string& ef_path, std::fstream& ef_file, std::_Ios_Openmode open_mode, bool must_exist);
 
+// Create and open a temporary file next to the given path, to later replace it with publish_temp
+int open_temp(const std::string& path, std::string& tmp_path, std::fstream& tmp_file);
+
+// Atomically replace the file at the given path with the temporary file, keeping the original's permissions
+int publish_temp(const std::string& tmp_path, const std::string& path);
+
+// Flush the file at the given path to its storage, false if it could not be
+bool sync_file(const std::string& path);
+
+/*
+ * Map the FS at the given path once everything written to it through fs_file has reached it, so that the mapping
+ * never reads it stale. Every FS that is open through a stream is mapped through here. False if it could not be.
+ **/
+bool map_fs(const std::string& fs_path, std::fstream& fs_file, fs_map& fs_mapping);
+
+// Create and open an empty file that only lives in memory, path is set to where it can be opened again
+int open_memory_file(const std::string& name, std::string& path, std::fstream& file);
+
+// Release a file created by open_memory_file, once nothing reads it through its path any more
+void close_memory_file(const std::string& path);
+
+// Whether the path is that of a file created by open_memory_file
+bool is_memory_file(const std::string& path);
+
+// Decompress the FS at gz_path into a file in memory, fs_path is set to where it can be opened
+int inflate_fs(const std::string& gz_path, std::string& fs_path);
+
+/*
+ * Compress the FS at fs_path, written through fs_file, over the FS at gz_path in members of GZ_MEMBER_SIZE, fs_file is
+ * flushed first. The block index of the members is saved next to it, as is the sidecar index of its records if in use.
+ */
+int deflate_fs(const std::string& fs_path, std::fstream& fs_file, const std::string& gz_path);
+
+// Open the compressed FS at gz_path to be read a member at a time, false if it was not written in members or is not a
+// NOTES V1.0 FS, for open_fs to inflate it whole instead
+bool open_fs_members(const std::string& gz_path, fs_gz& fs_members);
+
+/*
+ * Read the record of the given classes at the given path of the compressed FS into fs_data, inflating only the members
+ * needed, false if one of them is malformed. record_offset is set to where the record is in fs_data, npos if not found.
+ *
+ * The record is found through the sidecar index stamped with the compressed FS if in use, fs_data then holding only
+ * the record. Otherwise, or for a file referring to a body, members are inflated in order until the record has been
+ * read up to the line that ends it, fs_data then holding every line before it too, the body among them.
+ **/
+bool read_record_gz(const std::string& gz_path, fs_gz& fs_members, std::string_view path, unsigned int classes,
+    std::string& fs_data, size_t& record_offset);
+
+/*
+ * Call on_line(std::string_view) for each content line of the file record at the given offset of the mapped FS, in
+ * order and without its identifier or '\n', straight from the mapping or from its block, blocks being inflated one at
+ * a time. false if its body cannot be found or a block is malformed.
+ **/
+template<typename Callback>
+bool read_content_lines(std::string_view fs_data, size_t record_offset, Callback&& on_line);
+
 // Read a line with EOF checks
 bool read_line(std::iostream& file, std::string& line);
 
-// Write the FS records recursively starting at root
-void write_fs(dir* root, std::fstream& fs_file);
+// Read a line from mapped data starting at offset, advancing offset past the line
+bool read_line(std::string_view data, size_t& offset, std::string_view& line);
+
+// Write the FS records recursively starting at root, each body before the first file that refers to it, which adds
+// it to written_bodies
+void write_fs(dir* root, std::fstream& fs_file, std::unordered_set<const file*>& written_bodies);
+
+// Delete the line starting at the given offset from the file, or once the journal commits if given. Deleting the
+// first line of a file record deletes its content lines too
+void delete_line(std::fstream& fs_file, size_t line_offset, fs_journal* journal = nullptr);
+
+/*
+ * Delete the specified record from the FS at the given path, written through fs_file. The hash of the body the file
+ * referred to, if any, is added to released for the caller to release, or else released right away.
+ */
+bool delete_record(const std::string& fs_path, std::fstream& fs_file, const std::string& record_name,
+    fs_index* index = nullptr, fs_journal* journal = nullptr, std::vector<std::string>* released = nullptr);
+
+// Delete the record already found at the given offset, written through fs_file
+void delete_record_at(std::fstream& fs_file, std::string_view record_name, size_t record_offset,
+    fs_index* index = nullptr, fs_journal* journal = nullptr);
+
+// Delete the specified directory and all its children from the FS at the given path, written through fs_file, the
+// bodies its files referred to being released as delete_record does
+bool delete_dir(const std::string& fs_path, std::fstream& fs_file, const std::string& dir_name,
+    fs_index* index = nullptr, fs_journal* journal = nullptr, std::vector<std::string>* released = nullptr);
+
+// Hash of the body the file record at the given offset of the mapped FS refers to, empty if it has content of its own
+std::string_view get_reference(std::string_view fs_data, size_t record_offset);
+
+// Whether the reference line at the given offset of the mapped FS belongs to a live file
+bool is_reference_live(std::string_view fs_data, size_t reference_offset, fs_journal* journal);
 
-// Delete the specified line from the file
-void delete_line(std::fstream& fs_file, const std::string& fs_line);
+/*
+ * Delete the bodies recorded under the given hashes that no live file of the FS at the given path refers to any more,
+ * written through fs_file. Every reference is counted in a single pass over the FS.
+ */
+void release_bodies(const std::string& fs_path, std::fstream& fs_file, const std::vector<std::string>& hashes,
+    fs_journal* journal);
+
+// Whether commands keep a sidecar index of the FS, from VSFS_INDEX
+bool is_index_enabled();
+
+// Whether copyin stores each distinct content once, from VSFS_DEDUP
+bool is_dedup_enabled();
+
+// Hash content lines are recorded under as a body, in hexadecimal
+std::string hash_content(std::string_view content_lines);
+
+/*
+ * Find the live body of the mapped FS recorded under the hash of the given content lines, npos if there is none.
+ * is_collision is set when a body has that hash but other content.
+ */
+size_t find_body(std::string_view fs_data, std::string_view hash, std::string_view content_lines, fs_journal* journal,
+    bool& is_collision);
+
+// Whether the path is a shell-style glob rather than a path
+bool is_glob(std::string_view path);
+
+/*
+ * Delete the records of the given class, FILE_LINE or DIR_LINE, that match any of the targets, each a path or a glob,
+ * and the records within a deleted dir. Globs are matched against dirs without their trailing '/'. Without the index,
+ * the FS is read in a single pass for all targets. is_found is set to whether any record matched each target.
+ **/
+bool delete_matching(const std::string& fs_path, std::fstream& fs_file, const std::vector<std::string>& targets,
+    unsigned int line_class, fs_index* index, fs_journal* journal, std::vector<bool>& is_found);
+
+// Open the sidecar index of the FS if enabled, rebuilding it when missing or stale, nullptr if not in use
+fs_index* open_index(const std::string& fs_path, bool is_compressed, fs_index& index);
+
+// Open the sidecar index of the FS if in use, else index the FS only in memory, nullptr if the FS could not be read
+fs_index* open_lookup(const std::string& fs_path, bool is_compressed, fs_index& index, bool& is_sidecar);
+
+// Save the sidecar index after the FS has been written through fs_file, nothing is done if index is nullptr
+void save_index(const std::string& fs_path, std::fstream& fs_file, fs_index* index);
+
+// Open the journal of the FS if enabled, recovering the FS from any change left incomplete, in_use is nullptr if not
+bool open_journal(const std::string& fs_path, bool is_compressed, fs_journal& journal, fs_journal*& in_use);
 
-// Delete the specified record from the file
-bool delete_record(std::fstream& fs_file, const std::string& record_name);
+// Start a group of changes before appending to the FS through fs_file, nothing is done if journal is nullptr
+bool begin_journal(std::fstream& fs_file, fs_journal* journal);
 
-// Delete the specified directory and all its children from the file
-bool delete_dir(std::fstream& fs_file, const std::string& dir_name);
+// Commit the group of changes made through fs_file, nothing is done if journal is nullptr
+bool commit_journal(std::fstream& fs_file, fs_journal* journal);
+
+// Rebuild the index from every live file and dir record of the mapped FS
+void rebuild_index(std::string_view fs_data, fs_index& index);
+
+// Find a record in the mapped FS through the index if given, else by scanning, npos if not found
+size_t find_record(std::string_view fs_data, std::string_view path, unsigned int classes, fs_index* index);
+
+/*
+ * Find the file record at the given path in the mapped FS, npos if not found, along with which of the dirs it is
+ * within exist. Without the index, both are found in a single pass over the FS.
+ *
+ * dir_paths - Set to the paths of the dirs the file is within, from the outermost.
+ * is_dir_found - Set to whether a record exists at each of dir_paths, only when the file was not found.
+ **/
+size_t find_file_and_dirs(
+    std::string_view fs_data,
+    std::string_view path,
+    fs_index* index,
+    std::vector<std::string_view>& dir_paths,
+    std::vector<bool>& is_dir_found);
 
 /*
  * Build the filesystem tree data structure from the FS.
  *
- * fs_path - The location for the FS.
- * fs_file - The fstream reference to be opened.
+ * fs_path - The location for the FS, the first record of which is verified by open_fs.
+ * fs_file - The stream the FS is open through, anything written through it is read too.
+ * fs_mapping - The mapping the FS is read through, must outlive the returned tree.
+ * fs_tree - The arena the tree's nodes are created in, releasing it frees the whole tree.
  * fs_records - A vector reference to store pointers to records in order of read.
+ * bodies - The bodies read, which the files referring to them point to.
  * create_intermediate_dirs - Whether the algorithm should create intermediate dirs.
+ * is_metadata_only - Whether files only count their content lines, for trees that never have their content read.
  **/
 dir* build_tree(
     const std::string& fs_path,
     std::fstream& fs_file,
+    fs_map& fs_mapping,
+    fs_arena& fs_tree,
     std::vector<file*>& fs_records,
-    bool create_intermediate_dirs);
+    fs_bodies& bodies,
+    bool create_intermediate_dirs,
+    bool is_metadata_only);
+
+// Insert a record in the tree being built, false if the record makes the FS invalid
+bool insert_record(
+    const fs_record& record,
+    dir* root,
+    file*& curr_file,
+    fs_arena& fs_tree,
+    std::vector<file*>& fs_records,
+    fs_bodies& bodies,
+    bool create_intermediate_dirs,
+    bool is_metadata_only);
+
+// Build the tree of a NOTES V2.0 FS as build_tree does when only files' content lines are counted, nullptr if invalid
+dir* build_tree_v2(const std::string& fs_path, const fs_v2& fs, fs_arena& fs_tree, std::vector<file*>& fs_records);
+
+// Number of threads to parse an FS of the given size with
+unsigned int get_parse_threads(size_t fs_size);
+
+// Parse a positive size in bytes, optionally followed by K, M or G, false if the text is not one
+bool parse_size(const std::string& text, size_t& size);
+
+/*
+ * Sort the children of a dir, dirs first and each by name, then those of its subdirs on the given number of threads.
+ *
+ * Each dir is sorted once. The children of a dir that is the only child of its parent are kept in the order they were
+ * added in, as are those of every dir within it, for defrag to keep writing the same FS.
+ */
+void sort(dir* root, unsigned int thread_count);
+
+// Sort the children of a dir, then those of its subdirs, each as a task of the pool if given
+void sort_children(dir* parent, fs_pool* pool);
 
 // Used to calculate number of subdirs in a given dir
 int calculate_subdir(dir* rootdir);
 
 // Check whether the given internal path is valid
-bool is_internal_path_valid(const std::string& path, bool is_dir);
+bool is_internal_path_valid(std::string_view path, bool is_dir);
 
 /*
  * Definitions
@@ -79,30 +294,13 @@ bool file_exists(const char* path)
     return stat(path, &attr) == EXIT_SUCCESS;
 }
 
-bool record_exists(const std::string& record, std::fstream& fs_file)
+bool record_exists(const std::string& record, const std::string& fs_path, std::fstream& fs_file, fs_index* index)
 {
-    // Save current read position
-    auto curr_g = fs_file.tellg();
-
-    // Seek to the beginning of the file
-    fs_file.seekg(0, std::ios::beg);
+    fs_map fs_mapping;
+    if (!map_fs(fs_path, fs_file, fs_mapping))
+        return false;
 
-    bool exists{};
-    std::string fs_line;
-    while (read_line(fs_file, fs_line) && !exists)
-    {
-        // Record is found
-        if ((fs_line.front() == FILE_RECORD_IDENTIFIER || fs_line.front() == DIR_RECORD_IDENTIFIER)
-            && fs_line.substr(1) == record)
-        {
-            exists = true;
-        }
-    }
-
-    // Restore read position
-    fs_file.seekg(curr_g);
-
-    return exists;
+    return find_record(fs_mapping.get_data(), record, FILE_LINE | DIR_LINE, index) != std::string_view::npos;
 }
 
 bool open_file(const std::string& path, std::fstream& file, std::_Ios_Openmode open_mode)
@@ -116,7 +314,8 @@ bool open_file(const std::string& path, std::fstream& file, std::_Ios_Openmode o
     return file.is_open();
 }
 
-int open_fs(std::string& fs_path, std::fstream& fs_file, bool& is_compressed, std::_Ios_Openmode open_mode)
+int open_fs(std::string& fs_path, std::fstream& fs_file, bool& is_compressed, std::_Ios_Openmode open_mode,
+    unsigned int* fs_version)
 {
     // Verify the FS exists
     if (!file_exists(fs_path.c_str()))
@@ -141,11 +340,13 @@ int open_fs(std::string& fs_path, std::fstream& fs_file, bool& is_compressed, st
         return EXIT_FAILURE;
     }
 
-    // If file is zipped, unzip using gzip
+    // If file is zipped, decompress it in memory, the commands that change it compress it back with deflate_fs
     is_compressed = fs_extension == GZ_EXTENSION;
     if (is_compressed)
     {
-        gzip_fs(false, fs_path);
+        int err_code = inflate_fs(fs_path, fs_path);
+        if (err_code != EXIT_SUCCESS)
+            return err_code;
     }
 
     try
@@ -171,12 +372,27 @@ int open_fs(std::string& fs_path, std::fstream& fs_file, bool& is_compressed, st
         // Verify first record
         std::string fs_line;
         read_line(fs_file, fs_line);
-        if (fs_line != FS_FIRST_RECORD)
+        if (fs_line == FS_V2_FIRST_RECORD)
+        {
+            if (!fs_version)
+            {
+                fprintf(stderr, "%s FS is \"%s\", convert it to \"%s\" first\n",
+                    VSFS_ERROR_PREFIX, FS_V2_FIRST_RECORD, FS_FIRST_RECORD);
+                return EXIT_FAILURE;
+            }
+
+            *fs_version = FS_V2;
+        }
+        else if (fs_line != FS_FIRST_RECORD)
         {
             fprintf(stderr, "%s First record of FS must be \"%s\"\n",
                 VSFS_ERROR_PREFIX, FS_FIRST_RECORD);
             return EXIT_FAILURE;
         }
+        else if (fs_version)
+        {
+            *fs_version = FS_V1;
+        }
     }
 
     return EXIT_SUCCESS;
@@ -209,297 +425,1414 @@ int open_ef(const std::string& ef_path, std::fstream& ef_file, std::_Ios_Openmod
     return EXIT_SUCCESS;
 }
 
-bool read_line(std::iostream& file, std::string& line)
-{
-    return !file.eof() && file.peek() != EOF && std::getline(file, line);
-}
-
-void write_fs(dir* root, std::fstream& fs_file)
+int open_temp(const std::string& path, std::string& tmp_path, std::fstream& tmp_file)
 {
-    for (file* f: root->get_children())
+    // Create the file in the same dir so it can be renamed over the original
+    std::string tmp_template = path + ".XXXXXX";
+    int fd = mkstemp(tmp_template.data());
+    if (fd == -1)
     {
-        dir* d = dynamic_cast<dir*>(f);
-        if (!d)
-        {
-            // If record is a file
-            fs_file << FILE_RECORD_IDENTIFIER << f->get_path() << '\n';
-            std::stringstream content_stream(f->get_content());
-            std::string to_be_written;
+        fprintf(stderr, "%s Temporary file could not be created for \"%s\": %s\n",
+            VSFS_ERROR_PREFIX, path.c_str(), strerror(errno));
+        return EIO;
+    }
 
-            // Write record's content
-            while (std::getline(content_stream, to_be_written, '\n'))
-                fs_file << RECORD_CONTENT_IDENTIFIER << to_be_written << '\n';
-        }
-        else
+    close(fd);
+    tmp_path = tmp_template;
+
+    try
+    {
+        if (!open_file(tmp_path, tmp_file, std::ios::out | std::ios::trunc))
         {
-            // If record is a dir, recursively write all children
-            fs_file << DIR_RECORD_IDENTIFIER << d->get_path() << '\n';
-            write_fs(d, fs_file);
+            fprintf(stderr, "%s Temporary file could not be opened: %s\n", VSFS_ERROR_PREFIX, tmp_path.c_str());
+            unlink(tmp_path.c_str());
+            return EIO;
         }
     }
+    catch (const std::ios::failure& failure)
+    {
+        fprintf(stderr, "%s Temporary file I/O error: %s\n",
+            VSFS_ERROR_PREFIX, failure.code().message().c_str());
+        unlink(tmp_path.c_str());
+        return failure.code().value();
+    }
+
+    return EXIT_SUCCESS;
 }
 
-void delete_line(std::fstream& fs_file, const std::string& fs_line)
+int publish_temp(const std::string& tmp_path, const std::string& path)
 {
-    // Save current write position
-    auto curr_p = fs_file.tellp();
+    // Temporary files are created owner-only, carry over the original's owner, where allowed, and permissions. The
+    // owner goes first, as changing it may clear the set-user-ID and set-group-ID bits
+    struct stat attr{};
+    if (stat(path.c_str(), &attr) == EXIT_SUCCESS)
+    {
+        if (chown(tmp_path.c_str(), attr.st_uid, attr.st_gid) != EXIT_SUCCESS)
+            chown(tmp_path.c_str(), (uid_t) -1, attr.st_gid);
 
-    // Seek to the beginning of the line and replace with '#'
-    fs_file.seekp(std::ios::off_type(fs_file.tellp()) - (int) fs_line.size() - 1, std::ios_base::beg);
-    fs_file.put(DELETED_RECORD_IDENTIFIER);
+        chmod(tmp_path.c_str(), attr.st_mode & 07777);
+    }
+    else
+    {
+        // Or those a new file would have been created with
+        mode_t mask = umask(0);
+        umask(mask);
+        chmod(tmp_path.c_str(), 0666 & ~mask);
+    }
 
-    // Restore write position
-    fs_file.seekp(curr_p);
+    if (rename(tmp_path.c_str(), path.c_str()) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "%s \"%s\" could not be replaced: %s\n", VSFS_ERROR_PREFIX, path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return EIO;
+    }
+
+    return EXIT_SUCCESS;
 }
 
-bool delete_record(std::fstream& fs_file, const std::string& record_name)
+bool sync_file(const std::string& path)
 {
-    bool deleted{};
-    std::string fs_line;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
 
-    // Save current read position
-    auto curr_g = fs_file.tellg();
+    bool is_synced = fdatasync(fd) == 0;
+    close(fd);
+    return is_synced;
+}
 
-    // Move read position to the beginning
-    fs_file.seekg(0, std::ios::beg);
+bool map_fs(const std::string& fs_path, std::fstream& fs_file, fs_map& fs_mapping)
+{
+    fs_file.flush();
+    return fs_mapping.map(fs_path);
+}
 
-    while (read_line(fs_file, fs_line) && !deleted)
+int open_memory_file(const std::string& name, std::string& path, std::fstream& file)
+{
+    // The file is only released when the process exits, as it is reopened through its path
+    int fd = memfd_create(name.c_str(), 0);
+    if (fd == -1)
     {
-        // Record is found
-        if (fs_line.front() == FILE_RECORD_IDENTIFIER && fs_line.substr(1) == record_name)
-        {
-            // Delete the record identifier
-            delete_line(fs_file, fs_line);
+        fprintf(stderr, "%s File could not be created in memory for \"%s\": %s\n",
+            VSFS_ERROR_PREFIX, name.c_str(), strerror(errno));
+        return EIO;
+    }
 
-            // Delete any additional content lines for file records
-            while (read_line(fs_file, fs_line) && fs_line.front() == RECORD_CONTENT_IDENTIFIER)
-                delete_line(fs_file, fs_line);
+    path = MEMORY_FILE_PREFIX + std::to_string(fd);
 
-            deleted = true;
+    try
+    {
+        if (!open_file(path, file, std::ios::in | std::ios::out | std::ios::binary))
+        {
+            fprintf(stderr, "%s File in memory could not be opened for \"%s\"\n", VSFS_ERROR_PREFIX, name.c_str());
+            return EIO;
         }
     }
+    catch (const std::ios::failure& failure)
+    {
+        fprintf(stderr, "%s File in memory I/O error: %s\n", VSFS_ERROR_PREFIX, failure.code().message().c_str());
+        return failure.code().value();
+    }
 
-    // Restore read position
-    fs_file.seekg(curr_g);
+    return EXIT_SUCCESS;
+}
 
-    return deleted;
+void close_memory_file(const std::string& path)
+{
+    // The file is held open by the descriptor named in its path
+    if (is_memory_file(path))
+        close(atoi(path.c_str() + strlen(MEMORY_FILE_PREFIX)));
 }
 
-bool delete_dir(std::fstream& fs_file, const std::string& dir_name)
+bool is_memory_file(const std::string& path)
 {
-    bool deleted{};
-    std::string fs_line;
+    return path.compare(0, strlen(MEMORY_FILE_PREFIX), MEMORY_FILE_PREFIX) == 0;
+}
 
-    // Save current read position
-    auto curr_g = fs_file.tellg();
+int inflate_fs(const std::string& gz_path, std::string& fs_path)
+{
+    std::string memory_path;
+    std::fstream memory_file;
+    int err_code = open_memory_file(gz_path, memory_path, memory_file);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    gzFile gz_file = gzopen(gz_path.c_str(), "rb");
+    if (!gz_file)
+    {
+        fprintf(stderr, "%s Failed unzipping FS \"%s\"\n", VSFS_ERROR_PREFIX, gz_path.c_str());
+        return EXIT_FAILURE;
+    }
 
-    // Move read position to the beginning
-    fs_file.seekg(0, std::ios::beg);
+    gzbuffer(gz_file, GZ_CHUNK_SIZE);
 
-    while (read_line(fs_file, fs_line) && !deleted)
+    // Stream the decompressed FS into memory a chunk at a time
+    std::vector<char> chunk(GZ_CHUNK_SIZE);
+    int chunk_size;
+    try
     {
-        // Record is found
-        if (fs_line.front() == DIR_RECORD_IDENTIFIER && fs_line.substr(1) == dir_name)
-        {
-            // Delete the record identifier
-            delete_line(fs_file, fs_line);
-
-            // Delete any additional records that were within the dir
-            while (read_line(fs_file, fs_line))
-            {
-                char record_type = fs_line.front();
-                std::string record_name = fs_line.substr(1);
-                size_t found_index = record_name.find(dir_name);
+        while ((chunk_size = gzread(gz_file, chunk.data(), (unsigned int) chunk.size())) > 0)
+            memory_file.write(chunk.data(), chunk_size);
 
-                // If a record name contains the dir
-                if (found_index == 0 && record_type != DELETED_RECORD_IDENTIFIER)
-                {
-                    if (record_type == FILE_RECORD_IDENTIFIER)
-                    {
-                        // Delete the record identifier
-                        delete_line(fs_file, fs_line);
-
-                        // Delete any additional content lines for file records
-                        while (read_line(fs_file, fs_line) && fs_line.front() == RECORD_CONTENT_IDENTIFIER)
-                            delete_line(fs_file, fs_line);
-                    }
-                    else if (record_type == DIR_RECORD_IDENTIFIER)
-                    {
-                        delete_line(fs_file, fs_line);
-                    }
-                }
-            }
+        memory_file.close();
+    }
+    catch (const std::ios::failure& failure)
+    {
+        chunk_size = -1;
+    }
 
-            deleted = true;
-        }
+    if (gzclose_r(gz_file) != Z_OK || chunk_size < 0)
+    {
+        fprintf(stderr, "%s Failed unzipping FS \"%s\"\n", VSFS_ERROR_PREFIX, gz_path.c_str());
+        return EXIT_FAILURE;
     }
 
-    // Restore read position
-    fs_file.seekg(curr_g);
+    // The FS is listed with the permissions and modification time of the compressed FS, as gzip would restore
+    struct stat gz_attr{};
+    if (stat(gz_path.c_str(), &gz_attr) == EXIT_SUCCESS)
+    {
+        struct timespec times[2]{gz_attr.st_atim, gz_attr.st_mtim};
+        chmod(memory_path.c_str(), gz_attr.st_mode & 07777);
+        utimensat(AT_FDCWD, memory_path.c_str(), times, 0);
+    }
 
-    return deleted;
+    fs_path = memory_path;
+    return EXIT_SUCCESS;
 }
 
-dir* build_tree(
-    const std::string& fs_path,
-    std::fstream& fs_file,
-    std::vector<file*>& fs_records,
-    bool create_intermediate_dirs)
+int deflate_fs(const std::string& fs_path, std::fstream& fs_file, const std::string& gz_path)
 {
-    // Root dir is the FS file itself
-    dir* root = new dir(fs_path, fs_path);
+    fs_map fs_mapping;
+    if (!map_fs(fs_path, fs_file, fs_mapping))
+    {
+        fprintf(stderr, "%s FS could not be mapped: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+        return EIO;
+    }
 
-    // The file being assessed currently
-    file* curr_file = nullptr;
+    // Compress next to the FS and rename over it, so it is never left partly written
+    std::string tmp_path = gz_path + ".XXXXXX";
+    int fd = mkstemp(tmp_path.data());
+    if (fd == -1)
+    {
+        fprintf(stderr, "%s Failed zipping FS \"%s\": %s\n", VSFS_ERROR_PREFIX, gz_path.c_str(), strerror(errno));
+        return EIO;
+    }
 
-    // Read the contents of the given FS stream one line at a time
-    std::string fs_line;
-    while (read_line(fs_file, fs_line))
+    // Written in members, so that lookups inflate only those they need
+    std::string_view fs_data = fs_mapping.get_data();
+    fs_gz fs_members;
+    bool is_written = fs_members.write(fd, fs_data);
+    if (close(fd) != EXIT_SUCCESS || !is_written)
     {
-        char record_type = fs_line.front();
-        bool is_dir = record_type == DIR_RECORD_IDENTIFIER;
-        std::string line_content = fs_line.substr(1);
+        fprintf(stderr, "%s Failed zipping FS \"%s\"\n", VSFS_ERROR_PREFIX, gz_path.c_str());
+        unlink(tmp_path.c_str());
+        return EIO;
+    }
 
-        // If the record is a file ('@')/dir ('=')
-        if (record_type == FILE_RECORD_IDENTIFIER || is_dir)
-        {
-            if (!is_internal_path_valid(line_content, is_dir))
-            {
-                fprintf(stderr, "%s Invalid record path \"%s\"\n",
-                    VSFS_ERROR_PREFIX, line_content.c_str());
-                return nullptr;
-            }
+    int err_code = publish_temp(tmp_path, gz_path);
+    struct stat gz_attr{};
+    if (err_code != EXIT_SUCCESS || stat(gz_path.c_str(), &gz_attr) != EXIT_SUCCESS)
+        return err_code;
 
-            // The directory being assessed currently
-            dir* curr_dir = root;
-            std::string curr_path = line_content;
+    // Both indexes are stamped with the compressed FS, a later change made without them leaves them stale
+    std::string members_path = gz_path + '.' + GZ_INDEX_EXTENSION;
+    if (!fs_members.save(members_path, gz_attr))
+        fprintf(stderr, "%s Index could not be saved: %s\n", VSFS_ERROR_PREFIX, members_path.c_str());
 
-            // Index of the current '/' delimiter to keep track of path's depth level
-            size_t curr_delim;
+    if (is_index_enabled())
+    {
+        fs_index index;
+        std::string index_path = gz_path + '.' + INDEX_EXTENSION;
+        rebuild_index(fs_data, index);
+        if (!index.save(index_path, gz_attr))
+            fprintf(stderr, "%s Index could not be saved: %s\n", VSFS_ERROR_PREFIX, index_path.c_str());
+    }
 
-            // While additional intermediate subdirs exist, traverse down to the correct dir
-            while ((curr_delim = curr_path.find_first_of(PATH_SEPARATOR)) != std::string::npos && curr_delim != 0)
-            {
-                // Extract subdir name and search for it in the current dir
-                std::string subdir_name = curr_path.substr(0, curr_delim + 1);
-                size_t found_index = curr_dir->find_by_name(subdir_name);
-                dir* subdir;
+    return EXIT_SUCCESS;
+}
 
-                // If subdir does not exist
-                if (found_index == curr_dir->get_children().size())
-                {
-                    // If an intermediate dir is not to be created, throw error
-                    if (!is_dir && !create_intermediate_dirs)
-                    {
-                        fprintf(stderr, "%s FS dir \"%s\" could not be found for file \"%s\"\n",
-                            VSFS_ERROR_PREFIX, subdir_name.c_str(), line_content.c_str());
-                        return nullptr;
-                    }
-                    else
-                    {
-                        // Create intermediate subdir
-                        curr_dir->add_child((subdir = new dir(subdir_name, line_content)));
-                    }
-                }
-                else
-                {
-                    // If subdir does exist, reuse
-                    subdir = dynamic_cast<dir*>(curr_dir->get_children().at(found_index));
-
-                    // Check if record is a duplicate
-                    if (subdir->get_path() == line_content)
-                    {
-                        fprintf(stderr, "%s FS dir \"%s\" already exists in %s\n",
-                            VSFS_ERROR_PREFIX, line_content.c_str(),
-                            (curr_dir == root ? "FS" : ("dir \"" + curr_dir->get_name() + "\"").c_str()));
-                        return nullptr;
-                    }
-                }
+bool open_fs_members(const std::string& gz_path, fs_gz& fs_members)
+{
+    size_t extension_start = gz_path.find_last_of('.');
+    if (extension_start == std::string::npos || gz_path.substr(extension_start + 1) != GZ_EXTENSION
+        || !fs_members.open(gz_path))
+    {
+        return false;
+    }
 
-                // Traverse down a level
-                curr_dir = subdir;
-                curr_path = curr_path.substr(curr_delim + 1);
-            }
+    // Only the member the first record is in is inflated to tell the format
+    std::string first_line;
+    std::string first_record = std::string(FS_FIRST_RECORD) + '\n';
+    return fs_members.read(0, first_record.size(), first_line) && first_line == first_record;
+}
 
-            // Loop exits, the algorithm is in the right dir level
+bool read_record_gz(const std::string& gz_path, fs_gz& fs_members, std::string_view path, unsigned int classes,
+    std::string& fs_data, size_t& record_offset)
+{
+    fs_data.clear();
+    record_offset = std::string_view::npos;
 
-            // Insert the file in the current dir
-            if (!is_dir)
-            {
-                // If file is a duplicate
-                if (curr_dir->find_by_name(curr_path) != curr_dir->get_children().size())
-                {
-                    fprintf(stderr, "%s FS file \"%s\" already exists in dir \"%s\"\n",
-                        VSFS_ERROR_PREFIX, curr_path.c_str(), curr_dir->get_name().c_str());
-                    return nullptr;
-                }
-                else
-                {
-                    // If the record read is a file, establish parent-child relationship
-                    file* f = new file(curr_path, line_content);
-                    curr_file = f;
-                    curr_dir->add_child(f);
-                    fs_records.push_back(curr_file);
-                }
-            }
-            else
-            {
-                // If instead the record is a dir, it is already added
-                fs_records.push_back(curr_dir);
-            }
+    auto is_record_at = [&](size_t line_start)
+    {
+        size_t path_end = line_start + 1 + path.size();
+        return path_end <= fs_data.size() && fs_data.compare(line_start + 1, path.size(), path) == 0
+            && (path_end == fs_data.size() || fs_data[path_end] == '\n');
+    };
+
+    struct stat gz_attr{};
+    fs_index index;
+    if (is_index_enabled() && stat(gz_path.c_str(), &gz_attr) == EXIT_SUCCESS
+        && index.open(gz_path + '.' + INDEX_EXTENSION, gz_attr))
+    {
+        // A record the index does not have is not in the compressed FS, found without inflating any member
+        std::optional<fs_index::entry> found = index.find(path);
+        if (!found || !(classify_line(found->record_type) & classes))
+            return true;
+
+        if (!fs_members.read(found->offset, found->length, fs_data))
+            return false;
+
+        bool is_found = !fs_data.empty() && fs_data[0] == found->record_type && is_record_at(0);
+        if (is_found && get_reference(fs_data, 0).empty())
+        {
+            record_offset = 0;
+            return true;
         }
-        else if (record_type == RECORD_CONTENT_IDENTIFIER)
+
+        fs_data.clear();
+    }
+
+    // Inflate members in order, searching the whole lines of each as soon as it is read
+    uint64_t fs_size = fs_members.get_fs_size();
+    size_t search_offset = 0;
+    fs_data.reserve(fs_size);
+    while (fs_data.size() < fs_size && record_offset == std::string_view::npos)
+    {
+        if (!fs_members.read(fs_data.size(), GZ_MEMBER_SIZE, fs_data))
+            return false;
+
+        size_t lines_end = fs_data.size() == fs_size ? fs_data.size() : fs_data.rfind('\n') + 1;
+        std::string_view lines = std::string_view(fs_data).substr(0, lines_end);
+        for (size_t line_start = search_offset; (line_start = find_line(lines, line_start, classes)) < lines.size();)
         {
-            // If no file is currently being assessed, i.e., content is placed in incorrect location
-            if (!curr_file)
+            if (is_record_at(line_start))
             {
-                // Record content is detached from any file
-                fprintf(stderr, "%s No file for content to belong to \"%s...\"\n", VSFS_ERROR_PREFIX,
-                    line_content.size() < 10 ? line_content.c_str() : line_content.substr(0, 10).c_str());
-                return nullptr;
+                record_offset = line_start;
+                break;
             }
-
-            // Append the content records to the last assessed file
-            curr_file->append_content(line_content + "\n");
         }
-        else if (record_type != DELETED_RECORD_IDENTIFIER)
+
+        // The line the next search starts after, as find_line only finds lines after the offset
+        search_offset = lines_end > 0 ? lines_end - 1 : 0;
+    }
+
+    // Then read on until the line that ends the record, its content, blocks and reference belonging to it
+    constexpr unsigned int end_classes = ANY_LINE & ~(CONTENT_LINE | BLOCK_LINE | REFERENCE_LINE);
+    while (record_offset != std::string_view::npos && fs_data.size() < fs_size
+        && find_line(fs_data, record_offset, end_classes) == fs_data.size())
+    {
+        if (!fs_members.read(fs_data.size(), GZ_MEMBER_SIZE, fs_data))
+            return false;
+    }
+
+    return true;
+}
+
+template<typename Callback>
+bool read_content_lines(std::string_view fs_data, size_t record_offset, Callback&& on_line)
+{
+    // A file referring to a body has the body's content lines
+    std::string_view hash = get_reference(fs_data, record_offset);
+    if (!hash.empty())
+    {
+        record_offset = find_record(fs_data, hash, BODY_LINE);
+        if (record_offset == std::string_view::npos)
+            return false;
+    }
+
+    // Content and block lines directly follow the record and end at the next line of any other kind
+    size_t content_start = find_line(fs_data, record_offset, ANY_LINE);
+    size_t content_end = find_line(fs_data, record_offset, ANY_LINE & ~(CONTENT_LINE | BLOCK_LINE));
+
+    // Only the blocks of this record are inflated, each on its own
+    std::string block_lines;
+    std::string_view line, block_line;
+    for (size_t offset = content_start; offset < content_end && read_line(fs_data, offset, line);)
+    {
+        if (line[0] != BLOCK_IDENTIFIER)
         {
-            // If the record type is not one of the known ones
-            fprintf(stderr, "%s Unknown record type %c\n", VSFS_ERROR_PREFIX, record_type);
-            return nullptr;
+            on_line(line.substr(1));
+            continue;
         }
+
+        block_lines.clear();
+        if (!inflate_block(line, block_lines))
+            return false;
+
+        for (size_t block_offset = 0; read_line(block_lines, block_offset, block_line);)
+            on_line(block_line.substr(1));
     }
 
-    return root;
+    return true;
 }
 
-void sort(dir* root)
+bool read_line(std::iostream& file, std::string& line)
 {
-    std::sort(root->get_children().begin(), root->get_children().end(),
-        [](file* file1, file* file2)
-        {
-            dir* file1_dir = dynamic_cast<dir*>(file1);
-            dir* file2_dir = dynamic_cast<dir*>(file2);
+    return !file.eof() && file.peek() != EOF && std::getline(file, line);
+}
+
+bool read_line(std::string_view data, size_t& offset, std::string_view& line)
+{
+    if (offset >= data.size())
+        return false;
+
+    // The last line may not be terminated by a '\n'
+    size_t line_end = data.find('\n', offset);
+    if (line_end == std::string_view::npos)
+        line_end = data.size();
 
-            // As the notes file requires dir records to be present before any children records
-            // Dirs get higher privilege
-            int file1_rank = file1_dir ? 1 : 0;
-            int file2_rank = file2_dir ? 1 : 0;
+    line = data.substr(offset, line_end - offset);
+    offset = line_end + 1;
+    return true;
+}
+
+void write_fs(dir* root, std::fstream& fs_file, std::unordered_set<const file*>& written_bodies)
+{
+    // Write record's content straight from the backing FS, it is already in record format
+    auto write_content = [&](const file* f)
+    {
+        for (std::string_view span: f->get_content_spans())
+            fs_file.write(span.data(), (std::streamsize) span.size());
 
-            // Recursively sort subdirs
-            if (file1_dir) sort(file1_dir);
-            if (file2_dir) sort(file2_dir);
+        // The FS' last line may not have been terminated
+        if (!f->get_content_spans().empty() && f->get_content_spans().back().back() != '\n')
+            fs_file << '\n';
+    };
 
-            // If both are dir/file compare lexicographically
-            if (file1_rank == file2_rank)
-                file1_rank += file2->get_name().compare(file1->get_name());
+    for (file* f: root->get_children())
+    {
+        dir* d = dynamic_cast<dir*>(f);
+        if (!d)
+        {
+            // A body only referred to by deleted files is never written
+            file* body = f->get_body();
+            if (body && written_bodies.insert(body).second)
+            {
+                fs_file << BODY_RECORD_IDENTIFIER << body->get_name() << '\n';
+                write_content(body);
+            }
 
-            return file1_rank > file2_rank;
+            // If record is a file
+            fs_file << FILE_RECORD_IDENTIFIER << f->get_path() << '\n';
+            if (body)
+                fs_file << REFERENCE_IDENTIFIER << body->get_name() << '\n';
+            else
+                write_content(f);
+        }
+        else
+        {
+            // If record is a dir, recursively write all children
+            fs_file << DIR_RECORD_IDENTIFIER << d->get_path() << '\n';
+            write_fs(d, fs_file, written_bodies);
         }
-    );
+    }
+}
+
+void delete_line(std::fstream& fs_file, size_t line_offset, fs_journal* journal)
+{
+    // The line is only deleted once the deletion is logged
+    if (journal)
+    {
+        journal->delete_line(line_offset);
+        return;
+    }
+
+    // Replace the line's identifier with '#'
+    fs_file.seekp((std::streamoff) line_offset, std::ios::beg);
+    fs_file.put(DELETED_RECORD_IDENTIFIER);
+}
+
+bool delete_record(const std::string& fs_path, std::fstream& fs_file, const std::string& record_name, fs_index* index,
+    fs_journal* journal, std::vector<std::string>* released)
+{
+    fs_map fs_mapping;
+    if (!map_fs(fs_path, fs_file, fs_mapping))
+        return false;
+
+    std::string_view fs_data = fs_mapping.get_data();
+    size_t record_offset = find_record(fs_data, record_name, FILE_LINE, index);
+    if (record_offset == std::string_view::npos)
+        return false;
+
+    delete_record_at(fs_file, record_name, record_offset, index, journal);
+
+    std::vector<std::string> hashes;
+    std::string_view hash = get_reference(fs_data, record_offset);
+    if (!hash.empty())
+        (released ? *released : hashes).emplace_back(hash);
+
+    release_bodies(fs_path, fs_file, hashes, journal);
+    return true;
+}
+
+void delete_record_at(std::fstream& fs_file, std::string_view record_name, size_t record_offset, fs_index* index,
+    fs_journal* journal)
+{
+    // Save current write position
+    auto curr_p = fs_file.tellp();
+
+    // Delete the record identifier, its content lines are deleted along with it
+    delete_line(fs_file, record_offset, journal);
+
+    if (index)
+        index->erase(record_name, record_offset);
+
+    // Restore write position
+    fs_file.seekp(curr_p);
+}
+
+bool delete_dir(const std::string& fs_path, std::fstream& fs_file, const std::string& dir_name, fs_index* index,
+    fs_journal* journal, std::vector<std::string>* released)
+{
+    fs_map fs_mapping;
+    if (!map_fs(fs_path, fs_file, fs_mapping))
+        return false;
+
+    std::string_view fs_data = fs_mapping.get_data();
+    size_t dir_offset = find_record(fs_data, dir_name, DIR_LINE, index);
+    if (dir_offset == std::string_view::npos)
+        return false;
+
+    // Save current write position
+    auto curr_p = fs_file.tellp();
+
+    // Delete the record identifier
+    delete_line(fs_file, dir_offset, journal);
+
+    // Hashes of the bodies the deleted files referred to
+    std::vector<std::string> hashes;
+    std::vector<std::string>& dir_released = released ? *released : hashes;
+    auto release = [&](size_t record_offset)
+    {
+        std::string_view hash = get_reference(fs_data, record_offset);
+        if (!hash.empty())
+            dir_released.emplace_back(hash);
+    };
+
+    if (index)
+    {
+        // Records within the dir share its path as a prefix, only those after the dir record are deleted
+        std::vector<std::pair<std::string, size_t>> deleted_records{{dir_name, dir_offset}};
+        index->for_each_prefix(dir_name, [&](std::string_view path, const fs_index::entry& record)
+        {
+            if (record.offset > dir_offset)
+            {
+                delete_line(fs_file, record.offset, journal);
+                deleted_records.emplace_back(path, record.offset);
+                if (record.record_type == FILE_RECORD_IDENTIFIER)
+                    release(record.offset);
+            }
+        });
+
+        for (auto& [path, offset]: deleted_records)
+            index->erase(path, offset);
+    }
+    else
+    {
+        // Delete any additional records that were within the dir, along with their content lines
+        scan_records(fs_data, find_line(fs_data, dir_offset, ANY_LINE), [&](const fs_record& record)
+        {
+            if ((record.record_type == FILE_RECORD_IDENTIFIER || record.record_type == DIR_RECORD_IDENTIFIER)
+                && record.text.substr(0, dir_name.size()) == dir_name)
+            {
+                delete_line(fs_file, record.offset, journal);
+                if (record.record_type == FILE_RECORD_IDENTIFIER)
+                    release(record.offset);
+            }
+
+            return true;
+        });
+    }
+
+    // Restore write position
+    fs_file.seekp(curr_p);
+
+    release_bodies(fs_path, fs_file, hashes, journal);
+    return true;
+}
+
+bool is_glob(std::string_view path)
+{
+    return path.find_first_of("*?[") != std::string_view::npos;
+}
+
+bool delete_matching(const std::string& fs_path, std::fstream& fs_file, const std::vector<std::string>& targets,
+    unsigned int line_class, fs_index* index, fs_journal* journal, std::vector<bool>& is_found)
+{
+    is_found.assign(targets.size(), false);
+    bool is_dir = line_class == DIR_LINE;
+    char record_type = is_dir ? DIR_RECORD_IDENTIFIER : FILE_RECORD_IDENTIFIER;
+
+    // Paths are looked up in a hash table, only globs are matched one by one
+    std::unordered_multimap<std::string_view, size_t> paths;
+    std::vector<size_t> globs;
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        if (is_glob(targets[i]))
+            globs.push_back(i);
+        else
+            paths.emplace(targets[i], i);
+    }
+
+    // A single path is found as it would be on its own, without reading the rest of the FS
+    if (!index && globs.empty() && targets.size() == 1)
+    {
+        is_found[0] = is_dir
+            ? delete_dir(fs_path, fs_file, targets[0], index, journal)
+            : delete_record(fs_path, fs_file, targets[0], index, journal);
+        return is_found[0];
+    }
+
+    // Set is_found for every target the path of a record of the given class matches
+    std::string glob_path;
+    auto match = [&](std::string_view path)
+    {
+        bool is_matched{};
+        auto [first, last] = paths.equal_range(path);
+        for (; first != last; ++first)
+            is_found[first->second] = is_matched = true;
+
+        glob_path.assign(is_dir ? path.substr(0, path.size() - 1) : path);
+        for (size_t i: globs)
+        {
+            if (fnmatch(targets[i].c_str(), glob_path.c_str(), FNM_PATHNAME) == 0)
+                is_found[i] = is_matched = true;
+        }
+
+        return is_matched;
+    };
+
+    if (index)
+    {
+        // Records are found through the index, globs only among the paths sharing their literal prefix
+        std::set<std::string> matched;
+        auto on_entry = [&](std::string_view path, const fs_index::entry& record)
+        {
+            if (record.record_type == record_type && match(path))
+                matched.emplace(path);
+        };
+
+        for (auto& [path, target]: paths)
+        {
+            if (std::optional<fs_index::entry> record = index->find(path))
+                on_entry(path, *record);
+        }
+
+        for (size_t i: globs)
+        {
+            std::string_view literal_prefix = std::string_view(targets[i]).substr(0, targets[i].find_first_of("*?[\\"));
+            index->for_each_prefix(literal_prefix, on_entry);
+        }
+
+        // Dirs are deleted before the dirs within them, which are then already gone, and bodies once all are
+        std::vector<std::string> released;
+        for (const std::string& path: matched)
+        {
+            if (is_dir)
+                delete_dir(fs_path, fs_file, path, index, journal, &released);
+            else
+                delete_record(fs_path, fs_file, path, index, journal, &released);
+        }
+
+        release_bodies(fs_path, fs_file, released, journal);
+        return !matched.empty();
+    }
+
+    fs_map fs_mapping;
+    if (!map_fs(fs_path, fs_file, fs_mapping))
+        return false;
+
+    std::string_view fs_data = fs_mapping.get_data();
+
+    // Save current write position
+    auto curr_p = fs_file.tellp();
+
+    // Every record is matched as the FS is read once, deleting those within a dir deleted before them
+    std::unordered_set<std::string_view> deleted_dirs;
+    std::vector<std::string> released;
+    bool is_deleted{};
+    scan_records(fs_data, find_line(fs_data, 0, ANY_LINE), [&](const fs_record& record)
+    {
+        if (record.record_type != FILE_RECORD_IDENTIFIER && record.record_type != DIR_RECORD_IDENTIFIER)
+            return true;
+
+        // Records within a deleted dir share its path as a prefix, up to any of their '/'
+        std::string_view path = record.text;
+        bool is_within_dir{};
+        size_t delim = path.find(PATH_SEPARATOR);
+        while (!is_within_dir && delim != std::string_view::npos && delim + 1 < path.size())
+        {
+            is_within_dir = deleted_dirs.count(path.substr(0, delim + 1)) > 0;
+            delim = path.find(PATH_SEPARATOR, delim + 1);
+        }
+
+        // Targets are still matched within a deleted dir, as they are found
+        bool is_matched = record.record_type == record_type && match(path);
+        if (is_within_dir || is_matched)
+        {
+            delete_line(fs_file, record.offset, journal);
+            if (record.record_type == DIR_RECORD_IDENTIFIER)
+                deleted_dirs.insert(path);
+            else if (std::string_view hash = get_reference(fs_data, record.offset); !hash.empty())
+                released.emplace_back(hash);
+
+            is_deleted = true;
+        }
+
+        return true;
+    });
+
+    // Restore write position
+    fs_file.seekp(curr_p);
+
+    release_bodies(fs_path, fs_file, released, journal);
+    return is_deleted;
+}
+
+std::string_view get_reference(std::string_view fs_data, size_t record_offset)
+{
+    // The reference is the line directly after the file record
+    size_t line_offset = std::min(fs_data.find('\n', record_offset), fs_data.size()) + 1;
+    std::string_view line;
+    if (line_offset >= fs_data.size() || fs_data[line_offset] != REFERENCE_IDENTIFIER
+        || !read_line(fs_data, line_offset, line))
+    {
+        return {};
+    }
+
+    return line.substr(1);
+}
+
+bool is_reference_live(std::string_view fs_data, size_t reference_offset, fs_journal* journal)
+{
+    // The file referring to the body is the line before, deleted or only about to be
+    if (reference_offset < 2)
+        return false;
+
+    size_t record_offset = fs_data.rfind('\n', reference_offset - 2);
+    record_offset = record_offset == std::string_view::npos ? 0 : record_offset + 1;
+    return fs_data[record_offset] == FILE_RECORD_IDENTIFIER && !(journal && journal->is_deleted(record_offset));
+}
+
+void release_bodies(const std::string& fs_path, std::fstream& fs_file, const std::vector<std::string>& hashes,
+    fs_journal* journal)
+{
+    if (hashes.empty())
+        return;
+
+    // Deleted records written through the stream are read too
+    fs_map fs_mapping;
+    if (!map_fs(fs_path, fs_file, fs_mapping))
+        return;
+
+    // Each released body's live references, counted in a single pass over the bodies and references of the FS
+    std::string_view fs_data = fs_mapping.get_data();
+    std::unordered_map<std::string_view, size_t> ref_counts;
+    std::unordered_map<std::string_view, size_t> body_offsets;
+    for (const std::string& hash: hashes)
+        ref_counts.emplace(hash, 0);
+
+    size_t line_start = 0;
+    while ((line_start = find_line(fs_data, line_start, BODY_LINE | REFERENCE_LINE)) < fs_data.size())
+    {
+        size_t line_end = std::min(fs_data.find('\n', line_start), fs_data.size());
+        auto found = ref_counts.find(fs_data.substr(line_start + 1, line_end - line_start - 1));
+        if (found == ref_counts.end())
+            continue;
+
+        if (fs_data[line_start] == REFERENCE_IDENTIFIER)
+        {
+            if (is_reference_live(fs_data, line_start, journal))
+                found->second++;
+        }
+        else if (!journal || !journal->is_deleted(line_start))
+        {
+            body_offsets[found->first] = line_start;
+        }
+    }
+
+    // Save current write position
+    auto curr_p = fs_file.tellp();
+
+    for (auto& [hash, body_offset]: body_offsets)
+    {
+        if (ref_counts[hash] == 0)
+            delete_line(fs_file, body_offset, journal);
+    }
+
+    // Restore write position
+    fs_file.seekp(curr_p);
+}
+
+bool is_index_enabled()
+{
+    const char* index_variable = getenv(INDEX_VARIABLE);
+    return index_variable && *index_variable && strcmp(index_variable, "0") != 0;
+}
+
+bool is_dedup_enabled()
+{
+    const char* dedup = getenv(DEDUP_VARIABLE);
+    return dedup && *dedup && strcmp(dedup, "0") != 0;
+}
+
+std::string hash_content(std::string_view content_lines)
+{
+    // FNV-1a, content is only stored once per hash if it is identical, so a collision costs a copy and nothing more
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c: content_lines)
+    {
+        hash ^= (unsigned char) c;
+        hash *= 1099511628211ULL;
+    }
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) hash);
+    return hex;
+}
+
+size_t find_body(std::string_view fs_data, std::string_view hash, std::string_view content_lines, fs_journal* journal,
+    bool& is_collision)
+{
+    is_collision = false;
+
+    // Bodies pending deletion in the journal are as good as deleted
+    size_t line_start = 0;
+    while ((line_start = find_line(fs_data, line_start, BODY_LINE)) < fs_data.size())
+    {
+        size_t line_end = std::min(fs_data.find('\n', line_start), fs_data.size());
+        if (fs_data.substr(line_start + 1, line_end - line_start - 1) != hash
+            || (journal && journal->is_deleted(line_start)))
+        {
+            continue;
+        }
+
+        // Content and block lines directly follow the body, up to the next line of any other kind
+        size_t content_start = std::min(line_end + 1, fs_data.size());
+        size_t content_end = find_line(fs_data, line_start, ANY_LINE & ~(CONTENT_LINE | BLOCK_LINE));
+        if (fs_data.substr(content_start, content_end - content_start) == content_lines)
+            return line_start;
+
+        is_collision = true;
+    }
+
+    return std::string_view::npos;
+}
+
+fs_index* open_index(const std::string& fs_path, bool is_compressed, fs_index& index)
+{
+    // A compressed FS is decompressed afresh by every command, its index is only written whole by deflate_fs
+    if (!is_index_enabled() || is_compressed)
+        return nullptr;
+
+    struct stat fs_attr{};
+    if (stat(fs_path.c_str(), &fs_attr) != EXIT_SUCCESS)
+        return nullptr;
+
+    std::string index_path = fs_path + '.' + INDEX_EXTENSION;
+    if (index.open(index_path, fs_attr))
+        return &index;
+
+    // The index is missing or the FS was changed without it, rebuild it from the FS. It is only kept in memory when
+    // it cannot be saved, e.g. for a reader that cannot write the FS' dir, and rebuilt again by the next command
+    fs_map fs_mapping;
+    if (!fs_mapping.map(fs_path))
+        return nullptr;
+
+    rebuild_index(fs_mapping.get_data(), index);
+    index.save(index_path, fs_attr);
+
+    return &index;
+}
+
+fs_index* open_lookup(const std::string& fs_path, bool is_compressed, fs_index& index, bool& is_sidecar)
+{
+    fs_index* sidecar = open_index(fs_path, is_compressed, index);
+    is_sidecar = sidecar != nullptr;
+    if (is_sidecar)
+        return sidecar;
+
+    fs_map fs_mapping;
+    if (!fs_mapping.map(fs_path))
+    {
+        fprintf(stderr, "%s FS could not be mapped: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+        return nullptr;
+    }
+
+    rebuild_index(fs_mapping.get_data(), index);
+    return &index;
+}
+
+bool open_journal(const std::string& fs_path, bool is_compressed, fs_journal& journal, fs_journal*& in_use)
+{
+    in_use = nullptr;
+
+    // A compressed FS is replaced whole by every command that changes it
+    const char* journal_variable = getenv(JOURNAL_VARIABLE);
+    if (!journal_variable || !*journal_variable || strcmp(journal_variable, "0") == 0 || is_compressed)
+        return true;
+
+    std::string journal_path = fs_path + '.' + JOURNAL_EXTENSION;
+    if (!journal.open(journal_path, fs_path))
+    {
+        fprintf(stderr, "%s Journal could not be opened: %s %s\n",
+            VSFS_ERROR_PREFIX, journal_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    in_use = &journal;
+    return true;
+}
+
+bool begin_journal(std::fstream& fs_file, fs_journal* journal)
+{
+    if (!journal)
+        return true;
+
+    // The FS' size is logged as it is before anything is appended
+    fs_file.flush();
+    if (!journal->begin())
+    {
+        fprintf(stderr, "%s Journal could not be written: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool commit_journal(std::fstream& fs_file, fs_journal* journal)
+{
+    if (!journal)
+        return true;
+
+    // Everything appended must reach the FS before it is synced
+    fs_file.flush();
+    if (!journal->commit())
+    {
+        fprintf(stderr, "%s Journal could not be committed: %s\n", VSFS_ERROR_PREFIX, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void save_index(const std::string& fs_path, std::fstream& fs_file, fs_index* index)
+{
+    if (!index)
+        return;
+
+    // The index is stamped with the FS' attributes once everything is written
+    fs_file.flush();
+
+    struct stat fs_attr{};
+    std::string index_path = fs_path + '.' + INDEX_EXTENSION;
+    if (stat(fs_path.c_str(), &fs_attr) != EXIT_SUCCESS || !index->save(index_path, fs_attr))
+        fprintf(stderr, "%s Index could not be saved: %s\n", VSFS_ERROR_PREFIX, index_path.c_str());
+}
+
+void rebuild_index(std::string_view fs_data, fs_index& index)
+{
+    index.clear();
+
+    // Skip the first record
+    size_t fs_offset = find_line(fs_data, 0, ANY_LINE);
+
+    // The record being indexed, it is inserted once any content lines directly following it are added
+    std::string_view curr_path;
+    fs_index::entry curr_entry{};
+    bool is_file{};
+
+    scan_records(fs_data, fs_offset, [&](const fs_record& record)
+    {
+        if (record.record_type == FILE_RECORD_IDENTIFIER || record.record_type == DIR_RECORD_IDENTIFIER)
+        {
+            if (curr_entry.record_type)
+                index.insert(curr_path, curr_entry);
+
+            // The identifier, path and '\n', unless it is the FS' unterminated last line
+            size_t line_end = std::min(record.offset + 1 + record.text.size() + 1, fs_data.size());
+            curr_path = record.text;
+            curr_entry = {record.record_type, record.offset, line_end - record.offset};
+            is_file = record.record_type == FILE_RECORD_IDENTIFIER;
+            return true;
+        }
+
+        if ((record.record_type == RECORD_CONTENT_IDENTIFIER || record.record_type == BLOCK_IDENTIFIER) && is_file)
+        {
+            curr_entry.length += record.text.size();
+            return true;
+        }
+
+        // A reference is a single line record, counted with its identifier and '\n'
+        if (record.record_type == REFERENCE_IDENTIFIER && is_file)
+            curr_entry.length += std::min(record.offset + 1 + record.text.size() + 1, fs_data.size()) - record.offset;
+
+        is_file = false;
+        return true;
+    });
+
+    if (curr_entry.record_type)
+        index.insert(curr_path, curr_entry);
+}
+
+size_t find_record(std::string_view fs_data, std::string_view path, unsigned int classes, fs_index* index)
+{
+    if (!index)
+        return find_record(fs_data, path, classes);
+
+    // The entry must still point at the record, else the index is rebuilt from the FS
+    auto is_record_at = [&](const fs_index::entry& record)
+    {
+        size_t line_end = record.offset + 1 + path.size();
+        return line_end <= fs_data.size()
+            && fs_data[record.offset] == record.record_type
+            && fs_data.substr(record.offset + 1, path.size()) == path
+            && (line_end == fs_data.size() || fs_data[line_end] == '\n');
+    };
+
+    std::optional<fs_index::entry> found = index->find(path);
+    if (found && !is_record_at(*found))
+    {
+        rebuild_index(fs_data, *index);
+        found = index->find(path);
+    }
+
+    if (!found || !(classify_line(found->record_type) & classes))
+        return std::string_view::npos;
+
+    return found->offset;
+}
+
+size_t find_file_and_dirs(
+    std::string_view fs_data,
+    std::string_view path,
+    fs_index* index,
+    std::vector<std::string_view>& dir_paths,
+    std::vector<bool>& is_dir_found)
+{
+    // Each dir is the path up to one of its '/', up to the first empty name as copyin has always stopped there
+    dir_paths.clear();
+    size_t delim;
+    for (size_t name_start = 0; (delim = path.find(PATH_SEPARATOR, name_start)) != std::string_view::npos
+        && delim != name_start; name_start = delim + 1)
+    {
+        dir_paths.push_back(path.substr(0, delim + 1));
+    }
+
+    is_dir_found.assign(dir_paths.size(), false);
+
+    // Every record is looked up on its own through the index
+    if (index)
+    {
+        size_t record_offset = find_record(fs_data, path, FILE_LINE, index);
+        for (size_t i = 0; i < dir_paths.size() && record_offset == std::string_view::npos; i++)
+        {
+            is_dir_found[i] = find_record(fs_data, dir_paths[i], FILE_LINE | DIR_LINE, index)
+                != std::string_view::npos;
+        }
+
+        return record_offset;
+    }
+
+    // Jump from record to record, stopping as soon as the file is found as its dirs are then not needed
+    size_t line_start = 0;
+    while ((line_start = find_line(fs_data, line_start, FILE_LINE | DIR_LINE)) < fs_data.size())
+    {
+        size_t line_end = std::min(fs_data.find('\n', line_start), fs_data.size());
+        std::string_view record_path = fs_data.substr(line_start + 1, line_end - line_start - 1);
+
+        if (record_path == path)
+        {
+            if (fs_data[line_start] == FILE_RECORD_IDENTIFIER)
+                return line_start;
+        }
+        else if (!record_path.empty() && record_path.size() < path.size() && record_path.back() == PATH_SEPARATOR
+            && path.substr(0, record_path.size()) == record_path)
+        {
+            // The dirs of the file all prefix its path, so are told apart by their length
+            for (size_t i = 0; i < dir_paths.size(); i++)
+            {
+                if (dir_paths[i].size() == record_path.size())
+                    is_dir_found[i] = true;
+            }
+        }
+    }
+
+    return std::string_view::npos;
+}
+
+dir* build_tree(
+    const std::string& fs_path,
+    std::fstream& fs_file,
+    fs_map& fs_mapping,
+    fs_arena& fs_tree,
+    std::vector<file*>& fs_records,
+    fs_bodies& bodies,
+    bool create_intermediate_dirs,
+    bool is_metadata_only)
+{
+    // Map the FS to walk its records in place
+    if (!map_fs(fs_path, fs_file, fs_mapping))
+    {
+        fprintf(stderr, "%s FS could not be mapped: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+        return nullptr;
+    }
+
+    std::string_view fs_data = fs_mapping.get_data();
+    size_t fs_offset = 0;
+    std::string_view fs_line;
+
+    // Skip the first record, already verified when the FS was opened
+    read_line(fs_data, fs_offset, fs_line);
+
+    // Root dir is the FS file itself
+    dir* root = fs_tree.create<dir>(fs_path, fs_path);
+
+    // The file being assessed currently
+    file* curr_file = nullptr;
+
+    auto on_record = [&](const fs_record& record)
+    {
+        return insert_record(
+            record, root, curr_file, fs_tree, fs_records, bodies, create_intermediate_dirs, is_metadata_only);
+    };
+
+    // Large FS are split into chunks that are scanned in parallel, then inserted in order of the FS
+    unsigned int thread_count = get_parse_threads(fs_data.size());
+    bool is_inserted = thread_count > 1
+        ? scan_records_parallel(fs_data, fs_offset, fs_mapping, thread_count, on_record)
+        : scan_records(fs_data, fs_offset, [&](const fs_record& record)
+        {
+            // Content is only referenced, so pages already walked need not stay resident
+            fs_mapping.drop_before(record.offset);
+            return on_record(record);
+        });
+
+    return is_inserted ? root : nullptr;
+}
+
+bool insert_record(
+    const fs_record& record,
+    dir* root,
+    file*& curr_file,
+    fs_arena& fs_tree,
+    std::vector<file*>& fs_records,
+    fs_bodies& bodies,
+    bool create_intermediate_dirs,
+    bool is_metadata_only)
+{
+    char record_type = record.record_type;
+    bool is_dir = record_type == DIR_RECORD_IDENTIFIER;
+
+    // If the record is a file ('@')/dir ('=')
+    if (record_type == FILE_RECORD_IDENTIFIER || is_dir)
+    {
+        std::string_view line_content = record.text;
+        if (!is_internal_path_valid(line_content, is_dir))
+        {
+            fprintf(stderr, "%s Invalid record path \"%.*s\"\n",
+                VSFS_ERROR_PREFIX, (int) line_content.size(), line_content.data());
+            return false;
+        }
+
+        // The directory being assessed currently
+        dir* curr_dir = root;
+        std::string_view curr_path = line_content;
+
+        // Index of the current '/' delimiter to keep track of path's depth level
+        size_t curr_delim;
+
+        // While additional intermediate subdirs exist, traverse down to the correct dir
+        while ((curr_delim = curr_path.find(PATH_SEPARATOR)) != std::string_view::npos && curr_delim != 0)
+        {
+            // Extract subdir name and search for it in the current dir
+            std::string_view subdir_name = curr_path.substr(0, curr_delim + 1);
+            file* found = curr_dir->find_by_name(subdir_name);
+            dir* subdir;
+
+            // If subdir does not exist
+            if (!found)
+            {
+                // If an intermediate dir is not to be created, throw error
+                if (!is_dir && !create_intermediate_dirs)
+                {
+                    fprintf(stderr, "%s FS dir \"%.*s\" could not be found for file \"%.*s\"\n",
+                        VSFS_ERROR_PREFIX, (int) subdir_name.size(), subdir_name.data(),
+                        (int) line_content.size(), line_content.data());
+                    return false;
+                }
+                else
+                {
+                    // Create intermediate subdir
+                    curr_dir->add_child((subdir = fs_tree.create<dir>(subdir_name, line_content)));
+                }
+            }
+            else
+            {
+                // If subdir does exist, reuse
+                subdir = dynamic_cast<dir*>(found);
+
+                // Check if record is a duplicate
+                if (subdir->get_path() == line_content)
+                {
+                    fprintf(stderr, "%s FS dir \"%.*s\" already exists in %s\n",
+                        VSFS_ERROR_PREFIX, (int) line_content.size(), line_content.data(),
+                        (curr_dir == root ? "FS" : ("dir \"" + curr_dir->get_name() + "\"").c_str()));
+                    return false;
+                }
+            }
+
+            // Traverse down a level
+            curr_dir = subdir;
+            curr_path = curr_path.substr(curr_delim + 1);
+        }
+
+        // Loop exits, the algorithm is in the right dir level
+
+        // Insert the file in the current dir
+        if (!is_dir)
+        {
+            // If file is a duplicate
+            if (curr_dir->find_by_name(curr_path))
+            {
+                fprintf(stderr, "%s FS file \"%.*s\" already exists in dir \"%s\"\n",
+                    VSFS_ERROR_PREFIX, (int) curr_path.size(), curr_path.data(), curr_dir->get_name().c_str());
+                return false;
+            }
+            else
+            {
+                // If the record read is a file, establish parent-child relationship
+                file* f = fs_tree.create<file>(curr_path, line_content);
+                curr_file = f;
+                curr_dir->add_child(f);
+                fs_records.push_back(curr_file);
+            }
+        }
+        else
+        {
+            // If instead the record is a dir, it is already added
+            fs_records.push_back(curr_dir);
+        }
+    }
+    else if (record_type == RECORD_CONTENT_IDENTIFIER || record_type == BLOCK_IDENTIFIER)
+    {
+        // If no file is currently being assessed, i.e., content is placed in incorrect location
+        if (!curr_file)
+        {
+            // Record content is detached from any file, show the start of its first line
+            std::string_view line_content = record.text.substr(1, record.text.find('\n') - 1);
+            fprintf(stderr, "%s No file for content to belong to \"%.*s...\"\n", VSFS_ERROR_PREFIX,
+                (int) std::min(line_content.size(), (size_t) 10), line_content.data());
+            return false;
+        }
+
+        // A file referring to a body has no content of its own
+        if (curr_file->get_body())
+        {
+            fprintf(stderr, "%s FS file \"%s\" has both content and a body\n",
+                VSFS_ERROR_PREFIX, curr_file->get_path().c_str());
+            return false;
+        }
+
+        // Blocks count the content lines they hold, read from their headers without inflating them
+        size_t line_count = record.line_count;
+        if (record_type == BLOCK_IDENTIFIER && !count_block_lines(record.text, line_count))
+        {
+            fprintf(stderr, "%s FS block of file \"%s\" is malformed\n",
+                VSFS_ERROR_PREFIX, curr_file->get_path().c_str());
+            return false;
+        }
+
+        // Record the span of the content lines for the last assessed file, or only how many there are
+        if (is_metadata_only)
+            curr_file->add_line_count(line_count);
+        else
+            curr_file->append_content(record.text, line_count);
+    }
+    else if (record_type == BODY_RECORD_IDENTIFIER)
+    {
+        std::string_view hash = record.text;
+        if (hash.empty())
+        {
+            fprintf(stderr, "%s FS body has no hash\n", VSFS_ERROR_PREFIX);
+            return false;
+        }
+
+        // A body is outside the tree, its content lines follow it as a file's do. A body recorded again under the same
+        // hash, only ever after the first was deleted, replaces it for the files after it
+        file* body = fs_tree.create<file>(hash, hash);
+        bodies[body->get_name()] = body;
+        curr_file = body;
+    }
+    else if (record_type == REFERENCE_IDENTIFIER)
+    {
+        std::string_view hash = record.text;
+
+        // The reference must directly follow a file with no content, and the body must come before it
+        if (!curr_file || !curr_file->get_parent() || curr_file->get_body() || curr_file->get_line_count())
+        {
+            fprintf(stderr, "%s No file for reference to belong to \"%.*s\"\n",
+                VSFS_ERROR_PREFIX, (int) hash.size(), hash.data());
+            return false;
+        }
+
+        auto found = bodies.find(hash);
+        if (found == bodies.end())
+        {
+            fprintf(stderr, "%s FS body \"%.*s\" could not be found for file \"%s\"\n",
+                VSFS_ERROR_PREFIX, (int) hash.size(), hash.data(), curr_file->get_path().c_str());
+            return false;
+        }
+
+        curr_file->set_body(found->second);
+    }
+    else if (record_type != DELETED_RECORD_IDENTIFIER)
+    {
+        // If the record type is not one of the known ones
+        fprintf(stderr, "%s Unknown record type %c\n", VSFS_ERROR_PREFIX, record_type);
+        return false;
+    }
+
+    return true;
+}
+
+dir* build_tree_v2(const std::string& fs_path, const fs_v2& fs, fs_arena& fs_tree, std::vector<file*>& fs_records)
+{
+    // Root dir is the FS file itself
+    dir* root = fs_tree.create<dir>(fs_path, fs_path);
+    file* curr_file = nullptr;
+
+    // Bodies are only kept in NOTES V1.0, files of this format have their content inline
+    fs_bodies bodies;
+
+    // Each record is checked as it would be in NOTES V1.0, its content lines are already counted
+    bool is_inserted = true;
+    bool is_walked = fs.for_each([&](const fs_v2::record& record)
+    {
+        // Only files and dirs are kept in this format
+        if (record.record_type != FILE_RECORD_IDENTIFIER && record.record_type != DIR_RECORD_IDENTIFIER)
+        {
+            fprintf(stderr, "%s Unknown record type %c\n", VSFS_ERROR_PREFIX, record.record_type);
+            return is_inserted = false;
+        }
+
+        is_inserted = insert_record({record.record_type, record.path, 0, 1}, root, curr_file, fs_tree, fs_records,
+            bodies, false, true);
+        if (is_inserted && record.record_type == FILE_RECORD_IDENTIFIER)
+            curr_file->add_line_count(record.line_count);
+
+        return is_inserted;
+    });
+
+    if (is_inserted && !is_walked)
+        fprintf(stderr, "%s FS records are malformed: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+
+    return is_walked ? root : nullptr;
+}
+
+unsigned int get_parse_threads(size_t fs_size)
+{
+    // A number of threads given explicitly always applies
+    const char* thread_variable = getenv(PARSE_THREADS_VARIABLE);
+    if (thread_variable && *thread_variable)
+    {
+        char* end;
+        unsigned long thread_count = strtoul(thread_variable, &end, 10);
+        if (*end == '\0' && thread_count > 0)
+            return (unsigned int) thread_count;
+
+        fprintf(stderr, "%s Ignoring invalid %s \"%s\"\n",
+            VSFS_ERROR_PREFIX, PARSE_THREADS_VARIABLE, thread_variable);
+    }
+
+    // Starting threads costs more than scanning a small FS
+    if (fs_size < PARALLEL_PARSE_MIN_SIZE)
+        return 1;
+
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+bool parse_size(const std::string& text, size_t& size)
+{
+    char* end;
+    unsigned long long value = strtoull(text.c_str(), &end, 10);
+    int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+    if (shift)
+        end++;
+
+    size = (size_t) value << shift;
+    return !text.empty() && isdigit((unsigned char) text.front()) && *end == '\0' && value > 0;
+}
+
+void sort(dir* root, unsigned int thread_count)
+{
+    if (thread_count <= 1)
+    {
+        sort_children(root, nullptr);
+        return;
+    }
+
+    fs_pool pool(thread_count);
+    pool.submit([root, &pool] { sort_children(root, &pool); });
+    pool.run();
+}
+
+void sort_children(dir* parent, fs_pool* pool)
+{
+    // A dir was only ever sorted once compared with a sibling, so an only child and the dirs within it are not
+    std::pmr::list<file*>& children = parent->get_children();
+    if (children.size() < 2)
+        return;
+
+    // Whether each child is a dir and its name are found once, rather than on every comparison
+    struct child_key
+    {
+        bool is_dir;
+        std::string_view name;
+        std::pmr::list<file*>::iterator child;
+    };
+
+    std::vector<child_key> keys;
+    keys.reserve(children.size());
+    for (auto child = children.begin(); child != children.end(); ++child)
+        keys.push_back({dynamic_cast<dir*>(*child) != nullptr, (*child)->get_name(), child});
+
+    // As the notes file requires dir records to be present before any children records
+    // Dirs get higher privilege, names are unique within a dir
+    std::sort(keys.begin(), keys.end(), [](const child_key& key1, const child_key& key2)
+    {
+        return key1.is_dir != key2.is_dir ? key1.is_dir : key1.name < key2.name;
+    });
+
+    // Move the children into sorted order, the dir's index still refers to the same nodes
+    for (const child_key& key: keys)
+        children.splice(children.end(), children, key.child);
+
+    // Subdirs are sorted independently of each other
+    for (const child_key& key: keys)
+    {
+        if (!key.is_dir)
+            continue;
+
+        dir* subdir = static_cast<dir*>(*key.child);
+        if (pool)
+            pool->submit([subdir, pool] { sort_children(subdir, pool); });
+        else
+            sort_children(subdir, nullptr);
+    }
 }
 
-bool is_internal_path_valid(const std::string& path, bool is_dir)
+bool is_internal_path_valid(std::string_view path, bool is_dir)
 {
     /*
      *  Not beginning/containing '..'
@@ -507,8 +1840,9 @@ bool is_internal_path_valid(const std::string& path, bool is_dir)
      *  Not beginning with a '/'
      *  Not ending with a '/' for files, must end with a '/' for dirs
      */
-    return (path.find("..") == std::string::npos
-        && path.find('.') == std::string::npos
+    return (!path.empty()
+        && path.find("..") == std::string_view::npos
+        && path.find('.') == std::string_view::npos
         && path.front() != PATH_SEPARATOR
         && (is_dir
         ? path.at(path.size() - 1) == PATH_SEPARATOR
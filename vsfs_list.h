@@ -15,31 +15,9 @@
 #include <iomanip>
 #include <vector>
 
-int vsfs_list(int argc, char** argv)
+// List the records of a tree in the given order, with the attributes of the FS at the given path
+void list_records(const std::string& fs_path, const std::vector<file*>& fs_records)
 {
-    // Verify number of arguments
-    if (argc != 3)
-    {
-        fprintf(stderr, "%s Arguments for command \"list\", expected 1, received %d\n",
-            VSFS_ERROR_PREFIX, argc - 2);
-        return EXIT_FAILURE;
-    }
-
-    std::string fs_path = argv[2];
-    std::fstream fs_file;
-    bool is_compressed{};
-
-    // Open the FS file in read mode
-    int err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::in);
-    if (err_code != EXIT_SUCCESS)
-        return err_code;
-
-    // Build the filesystem tree
-    std::vector<file*> fs_records;
-    dir* fs_root = build_tree(fs_path, fs_file, fs_records, false);
-    if (!fs_root)
-        return EXIT_FAILURE;
-
     // Retrieve and store FS file's attributes
     std::stringstream attr_stream;
     std::string fs_permissions, fs_owner_group, fs_datetime;
@@ -98,8 +76,7 @@ int vsfs_list(int argc, char** argv)
         record_attr << fs_owner_group << ' ';
 
         // Size calculated as number of lines in the record's content
-        record_attr << std::count(record->get_content().begin(),
-            record->get_content().end(), '\n') << ' ';
+        record_attr << record->get_line_count() << ' ';
 
         record_attr << fs_datetime << ' ';
         record_attr << record->get_path();
@@ -108,15 +85,77 @@ int vsfs_list(int argc, char** argv)
         printf("%s\n", record_attr.str().c_str());
         record_attr.str(std::string());
     }
+}
 
-    // Free memory
-    delete fs_root;
+// List the records of the FS at the given path, read through fs_file
+int list_fs(const std::string& fs_path, std::fstream& fs_file)
+{
+    // Build the filesystem tree, listing only needs the number of lines of each file
+    fs_map fs_mapping;
+    fs_arena fs_tree;
+    std::vector<file*> fs_records;
+    fs_bodies bodies;
+    dir* fs_root = build_tree(fs_path, fs_file, fs_mapping, fs_tree, fs_records, bodies, false, true);
+    if (!fs_root)
+        return EXIT_FAILURE;
 
-    // If FS was found zipped, re-zip it
-    if (is_compressed)
-        gzip_fs(true, fs_path);
+    list_records(fs_path, fs_records);
+
+    // Free memory, the whole tree at once
+    fs_tree.release();
 
     return EXIT_SUCCESS;
 }
 
+// List the records of the NOTES V2.0 FS at the given path
+int list_fs_v2(const std::string& fs_path)
+{
+    fs_v2 fs;
+    if (!fs.open(fs_path))
+    {
+        fprintf(stderr, "%s FS is not a valid \"%s\" FS: %s\n", VSFS_ERROR_PREFIX, FS_V2_FIRST_RECORD, fs_path.c_str());
+        return EXIT_FAILURE;
+    }
+
+    fs_arena fs_tree;
+    std::vector<file*> fs_records;
+    if (!build_tree_v2(fs_path, fs, fs_tree, fs_records))
+        return EXIT_FAILURE;
+
+    list_records(fs_path, fs_records);
+
+    // Free memory, the whole tree at once
+    fs_tree.release();
+
+    return EXIT_SUCCESS;
+}
+
+int vsfs_list(int argc, char** argv)
+{
+    // Verify number of arguments
+    if (argc != 3)
+    {
+        fprintf(stderr, "%s Arguments for command \"list\", expected 1, received %d\n",
+            VSFS_ERROR_PREFIX, argc - 2);
+        return EXIT_FAILURE;
+    }
+
+    std::string fs_path = argv[2];
+    std::fstream fs_file;
+    bool is_compressed{};
+    unsigned int fs_version{};
+
+    // Open the FS file in read mode
+    int err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::in, &fs_version);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    // A NOTES V2.0 FS is only ever written whole by convert, so has no journal to recover from
+    if (fs_version == FS_V2)
+        return list_fs_v2(fs_path);
+
+    // The FS is read as it is, opening its journal would lock it and could write to it to recover any incomplete change
+    return list_fs(fs_path, fs_file);
+}
+
 #endif // VSFS_LIST_H
@@ -1,27 +1,13 @@
 #ifndef VSFS_MKDIR_H
 #define VSFS_MKDIR_H
 
+#include "vsfs_stats.h"
 #include "vsfs_helpers.h"
 
-int vsfs_mkdir(int argc, char** argv)
+// Add the ID to the FS at the given path, written through fs_file
+int mkdir_record(const std::string& fs_path, std::fstream& fs_file, std::string id_path, fs_index* index,
+    fs_journal* journal)
 {
-    // Verify number of arguments
-    if (argc != 4)
-    {
-        fprintf(stderr, "%s Arguments for command \"mkdir\", expected 2, received %d\n",
-            VSFS_ERROR_PREFIX, argc - 2);
-        return EXIT_FAILURE;
-    }
-
-    std::string fs_path = argv[2], id_path = argv[3];
-    std::fstream fs_file;
-    bool is_compressed{};
-
-    // Open the FS file in read and append mode
-    int err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::app);
-    if (err_code != EXIT_SUCCESS)
-        return err_code;
-
     // Given ID name may not end with a '/' but the FS always has dirs ending with '/'
     size_t delim_position = id_path.find_first_of(PATH_SEPARATOR);
     if (delim_position == std::string::npos || id_path.at(id_path.size() - 1) != PATH_SEPARATOR)
@@ -31,21 +17,24 @@ int vsfs_mkdir(int argc, char** argv)
     }
 
     // Verify whether the ID already exists
-    std::string fs_line;
-    while (read_line(fs_file, fs_line))
+    if (record_exists(id_path, fs_path, fs_file, index))
     {
-        if (fs_line.front() == DIR_RECORD_IDENTIFIER && fs_line.substr(1) == id_path)
-        {
-            fprintf(stderr, "%s ID already exists \"%s\"\n", VSFS_ERROR_PREFIX, id_path.c_str());
-            return EXIT_FAILURE;
-        }
+        fprintf(stderr, "%s ID already exists \"%s\"\n", VSFS_ERROR_PREFIX, id_path.c_str());
+        return EXIT_FAILURE;
     }
 
+    if (!begin_journal(fs_file, journal))
+        return EIO;
+
     try
     {
         // Seek to the end of file to append the new dir record
         fs_file.seekg(0, std::ios::end);
+        size_t record_offset = fs_file.tellp();
         fs_file << DIR_RECORD_IDENTIFIER << id_path << '\n';
+
+        if (index)
+            index->insert(id_path, {DIR_RECORD_IDENTIFIER, record_offset, (size_t) fs_file.tellp() - record_offset});
     }
     catch (std::ios::failure& failure)
     {
@@ -58,4 +47,54 @@ int vsfs_mkdir(int argc, char** argv)
     return EXIT_SUCCESS;
 }
 
+int vsfs_mkdir(int argc, char** argv)
+{
+    // Verify number of arguments
+    if (argc != 4)
+    {
+        fprintf(stderr, "%s Arguments for command \"mkdir\", expected 2, received %d\n",
+            VSFS_ERROR_PREFIX, argc - 2);
+        return EXIT_FAILURE;
+    }
+
+    std::string fs_path = argv[2], id_path = argv[3];
+    std::fstream fs_file;
+    bool is_compressed{};
+
+    // Open the FS file in read and append mode
+    int err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::app);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    // Recover the FS from any change left incomplete, if journaled
+    fs_journal fs_log;
+    fs_journal* journal;
+    if (!open_journal(fs_path, is_compressed, fs_log, journal))
+        return EIO;
+
+    // Find existing records through the sidecar index, if in use
+    fs_index fs_sidecar;
+    fs_index* index = open_index(fs_path, is_compressed, fs_sidecar);
+
+    if ((err_code = mkdir_record(fs_path, fs_file, id_path, index, journal)) != EXIT_SUCCESS)
+        return err_code;
+
+    if (!commit_journal(fs_file, journal))
+        return EIO;
+
+    // Defrag the FS once deleted records exceed the compaction policy, if any
+    bool is_compacted;
+    err_code = compact_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::out, index, journal, is_compacted);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    save_index(fs_path, fs_file, index);
+
+    // If FS was found zipped, re-zip it
+    if (is_compressed)
+        return deflate_fs(fs_path, fs_file, argv[2]);
+
+    return EXIT_SUCCESS;
+}
+
 #endif // VSFS_MKDIR_H
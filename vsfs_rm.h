@@ -1,19 +1,45 @@
 #ifndef VSFS_RM_H
 #define VSFS_RM_H
 
+#include "vsfs_stats.h"
 #include "vsfs_helpers.h"
 
+/*
+ * Delete the IFs, each a path or a glob, from the FS at the given path, written through fs_file. Every IF not found is
+ * reported and fails the command, is_deleted is set once any IF was deleted.
+ */
+int rm_records(const std::string& fs_path, std::fstream& fs_file, const std::vector<std::string>& if_paths,
+    fs_index* index, fs_journal* journal, bool& is_deleted)
+{
+    std::vector<bool> is_found;
+    is_deleted = delete_matching(fs_path, fs_file, if_paths, FILE_LINE, index, journal, is_found);
+
+    int err_code = EXIT_SUCCESS;
+    for (size_t i = 0; i < if_paths.size(); i++)
+    {
+        if (is_found[i])
+            continue;
+
+        fprintf(stderr, is_glob(if_paths[i]) ? "%s No IF matches \"%s\"\n" : "%s IF could not be found \"%s\"\n",
+            VSFS_ERROR_PREFIX, if_paths[i].c_str());
+        err_code = EXIT_FAILURE;
+    }
+
+    return err_code;
+}
+
 int vsfs_rm(int argc, char** argv)
 {
     // Verify number of arguments
-    if (argc != 4)
+    if (argc < 4)
     {
-        fprintf(stderr, "%s Arguments for command \"rm\", expected 2, received %d\n",
+        fprintf(stderr, "%s Arguments for command \"rm\", expected 2 or more, received %d\n",
             VSFS_ERROR_PREFIX, argc - 2);
         return EXIT_FAILURE;
     }
 
-    std::string fs_path = argv[2], if_path = argv[3];
+    std::string fs_path = argv[2];
+    std::vector<std::string> if_paths(argv + 3, argv + argc);
     std::fstream fs_file;
     bool is_compressed{};
 
@@ -22,15 +48,43 @@ int vsfs_rm(int argc, char** argv)
     if (err_code != EXIT_SUCCESS)
         return err_code;
 
-    // Delete the IF
-    if (!delete_record(fs_file, if_path))
+    // Recover the FS from any change left incomplete, if journaled
+    fs_journal fs_log;
+    fs_journal* journal;
+    if (!open_journal(fs_path, is_compressed, fs_log, journal))
+        return EIO;
+
+    // Find the IF through the sidecar index, if in use
+    fs_index fs_sidecar;
+    fs_index* index = open_index(fs_path, is_compressed, fs_sidecar);
+
+    // Delete the IFs, those found are still written when others are not
+    bool is_deleted;
+    err_code = rm_records(fs_path, fs_file, if_paths, index, journal, is_deleted);
+    if (!is_deleted)
+        return err_code;
+
+    if (!commit_journal(fs_file, journal))
+        return EIO;
+
+    // Defrag the FS once deleted records exceed the compaction policy, if any
+    bool is_compacted;
+    int compact_code = compact_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::out, index, journal,
+        is_compacted);
+    if (compact_code != EXIT_SUCCESS)
+        return compact_code;
+
+    save_index(fs_path, fs_file, index);
+
+    // If FS was found zipped, re-zip it
+    if (is_compressed)
     {
-        fprintf(stderr, "%s IF could not be found \"%s\"\n",
-            VSFS_ERROR_PREFIX, if_path.c_str());
-        return EXIT_FAILURE;
+        int deflate_code = deflate_fs(fs_path, fs_file, argv[2]);
+        if (deflate_code != EXIT_SUCCESS)
+            return deflate_code;
     }
 
-    return EXIT_SUCCESS;
+    return err_code;
 }
 
 #endif // VSFS_RM_H
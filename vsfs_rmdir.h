@@ -1,19 +1,60 @@
 #ifndef VSFS_RMDIR_H
 #define VSFS_RMDIR_H
 
+#include "vsfs_stats.h"
 #include "vsfs_helpers.h"
 
+/*
+ * Delete the IDs, each a path or a glob, and all their children from the FS at the given path, written through
+ * fs_file. Every ID not found is reported and fails the command, is_deleted is set once any ID was deleted.
+ */
+int rmdir_records(const std::string& fs_path, std::fstream& fs_file, std::vector<std::string> id_paths,
+    fs_index* index, fs_journal* journal, bool& is_deleted)
+{
+    for (std::string& id_path: id_paths)
+    {
+        // Globs are matched against dirs without their trailing '/'
+        if (is_glob(id_path))
+        {
+            while (id_path.size() > 1 && id_path.back() == PATH_SEPARATOR)
+                id_path.pop_back();
+        }
+        // Given ID name may not end with a '/' but the FS always has dirs ending with '/'
+        else if (id_path.empty() || id_path.back() != PATH_SEPARATOR)
+        {
+            id_path += PATH_SEPARATOR;
+        }
+    }
+
+    std::vector<bool> is_found;
+    is_deleted = delete_matching(fs_path, fs_file, id_paths, DIR_LINE, index, journal, is_found);
+
+    int err_code = EXIT_SUCCESS;
+    for (size_t i = 0; i < id_paths.size(); i++)
+    {
+        if (is_found[i])
+            continue;
+
+        fprintf(stderr, is_glob(id_paths[i]) ? "%s No ID matches \"%s\"\n" : "%s ID could not be found \"%s\"\n",
+            VSFS_ERROR_PREFIX, id_paths[i].c_str());
+        err_code = EXIT_FAILURE;
+    }
+
+    return err_code;
+}
+
 int vsfs_rmdir(int argc, char** argv)
 {
     // Verify number of arguments
-    if (argc != 4)
+    if (argc < 4)
     {
-        fprintf(stderr, "%s Arguments for command \"rmdir\", expected 2, received %d\n",
+        fprintf(stderr, "%s Arguments for command \"rmdir\", expected 2 or more, received %d\n",
             VSFS_ERROR_PREFIX, argc - 2);
         return EXIT_FAILURE;
     }
 
-    std::string fs_path = argv[2], id_path = argv[3];
+    std::string fs_path = argv[2];
+    std::vector<std::string> id_paths(argv + 3, argv + argc);
     std::fstream fs_file;
     bool is_compressed{};
 
@@ -22,23 +63,43 @@ int vsfs_rmdir(int argc, char** argv)
     if (err_code != EXIT_SUCCESS)
         return err_code;
 
-    // Given ID name may not end with a '/' but the FS always has dirs ending with '/'
-    size_t delim_position = id_path.find_first_of(PATH_SEPARATOR);
-    if (delim_position == std::string::npos || id_path.at(id_path.size() - 1) != PATH_SEPARATOR)
-    {
-        // Append '/' if not present in the dir name
-        id_path += PATH_SEPARATOR;
-    }
+    // Recover the FS from any change left incomplete, if journaled
+    fs_journal fs_log;
+    fs_journal* journal;
+    if (!open_journal(fs_path, is_compressed, fs_log, journal))
+        return EIO;
+
+    // Find the ID and its children through the sidecar index, if in use
+    fs_index fs_sidecar;
+    fs_index* index = open_index(fs_path, is_compressed, fs_sidecar);
+
+    // Delete the IDs, those found are still written when others are not
+    bool is_deleted;
+    err_code = rmdir_records(fs_path, fs_file, id_paths, index, journal, is_deleted);
+    if (!is_deleted)
+        return err_code;
+
+    if (!commit_journal(fs_file, journal))
+        return EIO;
+
+    // Defrag the FS once deleted records exceed the compaction policy, if any
+    bool is_compacted;
+    int compact_code = compact_fs(fs_path, fs_file, is_compressed, std::ios::in | std::ios::out, index, journal,
+        is_compacted);
+    if (compact_code != EXIT_SUCCESS)
+        return compact_code;
 
-    // Delete the ID
-    if (!delete_dir(fs_file, id_path))
+    save_index(fs_path, fs_file, index);
+
+    // If FS was found zipped, re-zip it
+    if (is_compressed)
     {
-        fprintf(stderr, "%s ID could not be found \"%s\"\n",
-            VSFS_ERROR_PREFIX, id_path.c_str());
-        return EXIT_FAILURE;
+        int deflate_code = deflate_fs(fs_path, fs_file, argv[2]);
+        if (deflate_code != EXIT_SUCCESS)
+            return deflate_code;
     }
 
-    return EXIT_SUCCESS;
+    return err_code;
 }
 
 #endif // VSFS_RMDIR_H
@@ -0,0 +1,557 @@
+#ifndef VSFS_SCAN_H
+#define VSFS_SCAN_H
+
+#include "fs_map.h"
+#include "vsfs_constants.h"
+
+#include <atomic>
+#include <future>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VSFS_SCAN_X86
+#endif
+
+/*
+ * Splits a mapped FS into records without copying, serially or in parallel chunks.
+ *
+ * Lines are found by a kernel that looks for newlines and classifies the byte after each in blocks of 64 bytes, with
+ * an AVX2 or SSE2 implementation picked at runtime and a scalar fallback.
+ */
+
+// Classes of lines by their first byte, combined into masks to search for
+enum line_class : unsigned int
+{
+    FILE_LINE = 1 << 0,
+    DIR_LINE = 1 << 1,
+    DELETED_LINE = 1 << 2,
+    CONTENT_LINE = 1 << 3,
+    // Unknown identifiers and empty lines
+    OTHER_LINE = 1 << 4,
+    // Content shared by files and the lines of files referring to it
+    BODY_LINE = 1 << 5,
+    REFERENCE_LINE = 1 << 6,
+    // Content lines compressed together
+    BLOCK_LINE = 1 << 7,
+    ANY_LINE = FILE_LINE | DIR_LINE | DELETED_LINE | CONTENT_LINE | OTHER_LINE | BODY_LINE | REFERENCE_LINE | BLOCK_LINE
+};
+
+// Signature shared by the implementations of find_line
+using find_line_kernel = size_t (*)(const char* data, size_t size, size_t offset, unsigned int classes,
+    size_t& newline_count);
+
+/**
+ * A record read from the FS.
+ *
+ * File, dir, body, reference and unknown records are a single line, their text excludes the identifier and '\n'.
+ * Consecutive content, block or deleted lines are grouped into a single run instead, their text is the raw lines
+ * including identifiers and the '\n' of each line, unless the FS' last line was not terminated. A deleted run also
+ * takes in the content, block and reference lines after a deleted file record, as deleting a file only marks its first
+ * line. Those after a deleted dir record, which ends with '/', belong to the file before it as they always have.
+ */
+struct fs_record
+{
+    // Identifier of the record, '\0' for empty lines
+    char record_type;
+    std::string_view text;
+    size_t offset;
+    size_t line_count;
+};
+
+/*
+ * Declarations
+ */
+
+// Class of a line starting with the given byte
+unsigned int classify_line(char identifier);
+
+
+/*
+ * Find the start of the first line after offset whose class is one of the given classes, the size of the data if
+ * there is none. newline_count is set to the number of newlines between offset and the line found.
+ **/
+size_t find_line(std::string_view data, size_t offset, unsigned int classes, size_t& newline_count);
+
+// Find the start of the first line after offset whose class is one of the given classes
+size_t find_line(std::string_view data, size_t offset, unsigned int classes);
+
+// Implementations of find_line, for when a specific one is to be used
+size_t find_line_scalar(const char* data, size_t size, size_t offset, unsigned int classes, size_t& newline_count);
+
+#ifdef VSFS_SCAN_X86
+size_t find_line_sse2(const char* data, size_t size, size_t offset, unsigned int classes, size_t& newline_count);
+
+size_t find_line_avx2(const char* data, size_t size, size_t offset, unsigned int classes, size_t& newline_count);
+#endif
+
+// Pick the fastest implementation of find_line the CPU supports
+find_line_kernel select_find_line();
+
+/*
+ * Find the end of the deleted run starting with the deleted line at offset, with the given implementation of
+ * find_line if any. newline_count is set to the number of newlines in the run.
+ **/
+size_t find_deleted_run_end(std::string_view data, size_t offset, size_t& newline_count);
+size_t find_deleted_run_end(std::string_view data, size_t offset, find_line_kernel kernel, size_t& newline_count);
+
+// Find the offset of the first file or dir record of the given classes at the given path, npos if there is none
+size_t find_record(std::string_view fs_data, std::string_view path, unsigned int classes);
+
+/*
+ * Scan the FS from offset, calling on_record(const fs_record&) for every record in order of the FS.
+ * Scanning stops early when on_record returns false, in which case false is returned.
+ **/
+template<typename Callback>
+bool scan_records(std::string_view fs_data, size_t offset, Callback&& on_record);
+
+/*
+ * Scan the FS from offset in chunks on the given number of threads, calling on_record(const fs_record&) on the calling
+ * thread for every record in order of the FS, as with scan_records.
+ **/
+template<typename Callback>
+bool scan_records_parallel(
+    std::string_view fs_data,
+    size_t offset,
+    fs_map& fs_mapping,
+    unsigned int thread_count,
+    Callback&& on_record);
+
+// Find the start of the first file, dir or deleted record at or after offset, the size of the data if there is none
+size_t find_record_boundary(std::string_view fs_data, size_t offset);
+
+/*
+ * Definitions
+ */
+
+unsigned int classify_line(char identifier)
+{
+    switch (identifier)
+    {
+        case FILE_RECORD_IDENTIFIER:
+            return FILE_LINE;
+        case DIR_RECORD_IDENTIFIER:
+            return DIR_LINE;
+        case DELETED_RECORD_IDENTIFIER:
+            return DELETED_LINE;
+        case RECORD_CONTENT_IDENTIFIER:
+            return CONTENT_LINE;
+        case BODY_RECORD_IDENTIFIER:
+            return BODY_LINE;
+        case REFERENCE_IDENTIFIER:
+            return REFERENCE_LINE;
+        case BLOCK_IDENTIFIER:
+            return BLOCK_LINE;
+        default:
+            return OTHER_LINE;
+    }
+}
+
+size_t find_line(std::string_view data, size_t offset, unsigned int classes, size_t& newline_count)
+{
+    static const find_line_kernel kernel = select_find_line();
+    return kernel(data.data(), data.size(), offset, classes, newline_count);
+}
+
+size_t find_line(std::string_view data, size_t offset, unsigned int classes)
+{
+    size_t newline_count;
+    return find_line(data, offset, classes, newline_count);
+}
+
+size_t find_line_scalar(const char* data, size_t size, size_t offset, unsigned int classes, size_t& newline_count)
+{
+    newline_count = 0;
+
+    const void* newline;
+    while (offset < size && (newline = memchr(data + offset, '\n', size - offset)))
+    {
+        size_t line_start = static_cast<const char*>(newline) - data + 1;
+        newline_count++;
+
+        if (line_start < size && (classify_line(data[line_start]) & classes))
+            return line_start;
+
+        offset = line_start;
+    }
+
+    return size;
+}
+
+#ifdef VSFS_SCAN_X86
+
+/*
+ * Both vector implementations build a 64-bit mask of newlines and a mask of bytes whose next byte is of one of the
+ * given classes for each block, the first bit set in both is the end of the line before the one found.
+ */
+
+__attribute__((target("sse2")))
+uint64_t class_mask_sse2(const char* next, unsigned int classes)
+{
+    uint64_t mask = 0;
+    for (int lane = 0; lane < 4; lane++)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(next + lane * 16));
+        __m128i file = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(FILE_RECORD_IDENTIFIER));
+        __m128i dir = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(DIR_RECORD_IDENTIFIER));
+        __m128i deleted = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(DELETED_RECORD_IDENTIFIER));
+        __m128i content = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(RECORD_CONTENT_IDENTIFIER));
+        __m128i body = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(BODY_RECORD_IDENTIFIER));
+        __m128i reference = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(REFERENCE_IDENTIFIER));
+        __m128i block = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(BLOCK_IDENTIFIER));
+
+        __m128i matches = _mm_setzero_si128();
+        if (classes & FILE_LINE) matches = _mm_or_si128(matches, file);
+        if (classes & DIR_LINE) matches = _mm_or_si128(matches, dir);
+        if (classes & DELETED_LINE) matches = _mm_or_si128(matches, deleted);
+        if (classes & CONTENT_LINE) matches = _mm_or_si128(matches, content);
+        if (classes & BODY_LINE) matches = _mm_or_si128(matches, body);
+        if (classes & REFERENCE_LINE) matches = _mm_or_si128(matches, reference);
+        if (classes & BLOCK_LINE) matches = _mm_or_si128(matches, block);
+        if (classes & OTHER_LINE)
+        {
+            __m128i known = _mm_or_si128(_mm_or_si128(_mm_or_si128(file, dir), _mm_or_si128(deleted, content)),
+                _mm_or_si128(_mm_or_si128(body, reference), block));
+            matches = _mm_or_si128(matches, _mm_andnot_si128(known, _mm_set1_epi8(-1)));
+        }
+
+        mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(matches) << (lane * 16);
+    }
+
+    return mask;
+}
+
+__attribute__((target("sse2")))
+size_t find_line_sse2(const char* data, size_t size, size_t offset, unsigned int classes, size_t& newline_count)
+{
+    newline_count = 0;
+
+    // Each block also reads the byte after it
+    size_t block = offset;
+    for (; block + 65 <= size; block += 64)
+    {
+        uint64_t newlines = 0;
+        for (int lane = 0; lane < 4; lane++)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + block + lane * 16));
+            newlines |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')))
+                << (lane * 16);
+        }
+
+        if (!newlines)
+            continue;
+
+        uint64_t found = newlines & class_mask_sse2(data + block + 1, classes);
+        if (found)
+        {
+            // Only count newlines up to and including the one found
+            uint64_t first = found & -found;
+            newline_count += __builtin_popcountll(newlines & (first | (first - 1)));
+            return block + __builtin_ctzll(found) + 1;
+        }
+
+        newline_count += __builtin_popcountll(newlines);
+    }
+
+    size_t tail_newlines;
+    size_t line_start = find_line_scalar(data, size, block, classes, tail_newlines);
+    newline_count += tail_newlines;
+    return line_start;
+}
+
+__attribute__((target("avx2")))
+uint64_t class_mask_avx2(const char* next, unsigned int classes)
+{
+    uint64_t mask = 0;
+    for (int lane = 0; lane < 2; lane++)
+    {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(next + lane * 32));
+        __m256i file = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(FILE_RECORD_IDENTIFIER));
+        __m256i dir = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(DIR_RECORD_IDENTIFIER));
+        __m256i deleted = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(DELETED_RECORD_IDENTIFIER));
+        __m256i content = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(RECORD_CONTENT_IDENTIFIER));
+        __m256i body = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(BODY_RECORD_IDENTIFIER));
+        __m256i reference = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(REFERENCE_IDENTIFIER));
+        __m256i block = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(BLOCK_IDENTIFIER));
+
+        __m256i matches = _mm256_setzero_si256();
+        if (classes & FILE_LINE) matches = _mm256_or_si256(matches, file);
+        if (classes & DIR_LINE) matches = _mm256_or_si256(matches, dir);
+        if (classes & DELETED_LINE) matches = _mm256_or_si256(matches, deleted);
+        if (classes & CONTENT_LINE) matches = _mm256_or_si256(matches, content);
+        if (classes & BODY_LINE) matches = _mm256_or_si256(matches, body);
+        if (classes & REFERENCE_LINE) matches = _mm256_or_si256(matches, reference);
+        if (classes & BLOCK_LINE) matches = _mm256_or_si256(matches, block);
+        if (classes & OTHER_LINE)
+        {
+            __m256i known = _mm256_or_si256(
+                _mm256_or_si256(_mm256_or_si256(file, dir), _mm256_or_si256(deleted, content)),
+                _mm256_or_si256(_mm256_or_si256(body, reference), block));
+            matches = _mm256_or_si256(matches, _mm256_andnot_si256(known, _mm256_set1_epi8(-1)));
+        }
+
+        mask |= (uint64_t) (uint32_t) _mm256_movemask_epi8(matches) << (lane * 32);
+    }
+
+    return mask;
+}
+
+__attribute__((target("avx2")))
+size_t find_line_avx2(const char* data, size_t size, size_t offset, unsigned int classes, size_t& newline_count)
+{
+    newline_count = 0;
+
+    // Each block also reads the byte after it
+    size_t block = offset;
+    for (; block + 65 <= size; block += 64)
+    {
+        __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + block));
+        __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + block + 32));
+        uint64_t newlines = (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, _mm256_set1_epi8('\n')))
+            | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, _mm256_set1_epi8('\n'))) << 32;
+
+        if (!newlines)
+            continue;
+
+        uint64_t found = newlines & class_mask_avx2(data + block + 1, classes);
+        if (found)
+        {
+            // Only count newlines up to and including the one found
+            uint64_t first = found & -found;
+            newline_count += __builtin_popcountll(newlines & (first | (first - 1)));
+            return block + __builtin_ctzll(found) + 1;
+        }
+
+        newline_count += __builtin_popcountll(newlines);
+    }
+
+    size_t tail_newlines;
+    size_t line_start = find_line_scalar(data, size, block, classes, tail_newlines);
+    newline_count += tail_newlines;
+    return line_start;
+}
+
+#endif // VSFS_SCAN_X86
+
+find_line_kernel select_find_line()
+{
+#ifdef VSFS_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return find_line_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return find_line_sse2;
+#endif
+    return find_line_scalar;
+}
+
+size_t find_deleted_run_end(std::string_view data, size_t offset, size_t& newline_count)
+{
+    static const find_line_kernel kernel = select_find_line();
+    return find_deleted_run_end(data, offset, kernel, newline_count);
+}
+
+size_t find_deleted_run_end(std::string_view data, size_t offset, find_line_kernel kernel, size_t& newline_count)
+{
+    newline_count = 0;
+    size_t run_end = offset, line_count;
+    while (run_end < data.size() && data[run_end] == DELETED_RECORD_IDENTIFIER)
+    {
+        run_end = kernel(data.data(), data.size(), run_end, ANY_LINE & ~DELETED_LINE, line_count);
+        newline_count += line_count;
+
+        // Lines after a deleted dir record belong to the file before it, the last deleted line ends before run_end
+        size_t line_end = data[run_end - 1] == '\n' ? run_end - 1 : run_end;
+        constexpr unsigned int content_classes = CONTENT_LINE | REFERENCE_LINE | BLOCK_LINE;
+        if (run_end == data.size() || !(classify_line(data[run_end]) & content_classes) || data[line_end - 1] == '/')
+            break;
+
+        // A deleted file record's content, block and reference lines were deleted along with it
+        run_end = kernel(data.data(), data.size(), run_end, ANY_LINE & ~content_classes, line_count);
+        newline_count += line_count;
+    }
+
+    return run_end;
+}
+
+template<typename Callback>
+bool scan_records(std::string_view fs_data, size_t offset, Callback&& on_record)
+{
+    size_t line_start = offset;
+    while (line_start < fs_data.size())
+    {
+        char record_type = fs_data[line_start] == '\n' ? '\0' : fs_data[line_start];
+        fs_record record{record_type, {}, line_start, 1};
+        size_t next_line;
+
+        if (record_type == RECORD_CONTENT_IDENTIFIER || record_type == BLOCK_IDENTIFIER
+            || record_type == DELETED_RECORD_IDENTIFIER)
+        {
+            // Group the lines that follow with the same identifier into a single run, along with the content of a
+            // deleted file
+            next_line = record_type == DELETED_RECORD_IDENTIFIER
+                ? find_deleted_run_end(fs_data, line_start, record.line_count)
+                : find_line(fs_data, line_start, ANY_LINE & ~classify_line(record_type), record.line_count);
+
+            // The FS' last line may not be terminated
+            if (next_line == fs_data.size() && fs_data.back() != '\n')
+                record.line_count++;
+
+            record.text = fs_data.substr(line_start, next_line - line_start);
+        }
+        else
+        {
+            // Skip the identifier of a single line record
+            next_line = find_line(fs_data, line_start, ANY_LINE);
+            size_t line_end = fs_data[next_line - 1] == '\n' ? next_line - 1 : next_line;
+            size_t text_start = std::min(line_start + 1, line_end);
+            record.text = fs_data.substr(text_start, line_end - text_start);
+        }
+
+        if (!on_record(record))
+            return false;
+
+        line_start = next_line;
+    }
+
+    return true;
+}
+
+size_t find_record_boundary(std::string_view fs_data, size_t offset)
+{
+    constexpr unsigned int boundary_classes = FILE_LINE | DIR_LINE | DELETED_LINE;
+
+    // Offset may itself be the start of a record
+    if (offset < fs_data.size()
+        && (offset == 0 || fs_data[offset - 1] == '\n')
+        && (classify_line(fs_data[offset]) & boundary_classes))
+    {
+        return offset;
+    }
+
+    return find_line(fs_data, std::min(offset, fs_data.size()), boundary_classes);
+}
+
+size_t find_record(std::string_view fs_data, std::string_view path, unsigned int classes)
+{
+    // Jump from record to record of the given classes, comparing their paths
+    size_t line_start = 0;
+    while ((line_start = find_line(fs_data, line_start, classes)) < fs_data.size())
+    {
+        std::string_view record_path = fs_data.substr(line_start + 1, path.size());
+        size_t path_end = line_start + 1 + path.size();
+
+        if (record_path == path && (path_end == fs_data.size() || fs_data[path_end] == '\n'))
+            return line_start;
+    }
+
+    return std::string_view::npos;
+}
+
+template<typename Callback>
+bool scan_records_parallel(
+    std::string_view fs_data,
+    size_t offset,
+    fs_map& fs_mapping,
+    unsigned int thread_count,
+    Callback&& on_record)
+{
+    // Several chunks per thread keep the threads busy when chunks differ in their number of records
+    size_t chunk_target = std::max(PARALLEL_PARSE_MIN_CHUNK, (fs_data.size() - offset) / (thread_count * 8));
+
+    // Split the FS at record boundaries so no run of content lines crosses chunks
+    std::vector<size_t> chunk_starts{offset};
+    while (chunk_starts.back() < fs_data.size())
+        chunk_starts.push_back(find_record_boundary(fs_data, chunk_starts.back() + chunk_target));
+
+    size_t chunk_count = chunk_starts.size() - 1;
+    std::vector<std::vector<fs_record>> chunk_records(chunk_count);
+    std::vector<std::promise<void>> chunk_scanned(chunk_count);
+    std::atomic<size_t> next_chunk{0};
+    std::atomic<bool> is_stopped{false};
+
+    // Each thread takes the next unscanned chunk until none are left or merging has stopped. An exception, e.g. from
+    // running out of memory, is handed over with the chunk to be thrown on the calling thread
+    auto scan_chunks = [&]()
+    {
+        size_t chunk;
+        while ((chunk = next_chunk.fetch_add(1)) < chunk_count)
+        {
+            try
+            {
+                if (!is_stopped)
+                {
+                    std::string_view chunk_data = fs_data.substr(0, chunk_starts.at(chunk + 1));
+                    scan_records(chunk_data, chunk_starts.at(chunk), [&](const fs_record& record)
+                    {
+                        chunk_records.at(chunk).push_back(record);
+                        return true;
+                    });
+                }
+
+                chunk_scanned.at(chunk).set_value();
+            }
+            catch (...)
+            {
+                chunk_scanned.at(chunk).set_exception(std::current_exception());
+            }
+        }
+    };
+
+    // Threads must be joined however merging ends, or starting them fails
+    std::vector<std::thread> threads;
+    auto join_threads = [&]()
+    {
+        is_stopped = true;
+        for (std::thread& thread: threads)
+            thread.join();
+    };
+
+    try
+    {
+        for (unsigned int i = 0; i < std::min<size_t>(thread_count, chunk_count); i++)
+            threads.emplace_back(scan_chunks);
+    }
+    catch (...)
+    {
+        join_threads();
+        throw;
+    }
+
+    // Merge the chunks in order of the FS as soon as each is scanned
+    bool is_merged = true;
+    try
+    {
+        for (size_t chunk = 0; chunk < chunk_count && is_merged; chunk++)
+        {
+            chunk_scanned.at(chunk).get_future().get();
+            for (const fs_record& record: chunk_records.at(chunk))
+            {
+                if (!on_record(record))
+                {
+                    is_merged = false;
+                    break;
+                }
+            }
+
+            // Records of a merged chunk are no longer needed, nor are its pages
+            std::vector<fs_record>().swap(chunk_records.at(chunk));
+            fs_mapping.drop_before(chunk_starts.at(chunk + 1));
+        }
+    }
+    catch (...)
+    {
+        join_threads();
+        throw;
+    }
+
+    join_threads();
+    return is_merged;
+}
+
+#endif // VSFS_SCAN_H
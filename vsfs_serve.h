@@ -0,0 +1,670 @@
+#ifndef VSFS_SERVE_H
+#define VSFS_SERVE_H
+
+#include "vsfs_list.h"
+#include "vsfs_batch.h"
+#include "vsfs_helpers.h"
+#include "vsfs_constants.h"
+
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/*
+ * Serves commands against an FS that a long running process keeps open, over a Unix domain socket.
+ *
+ * The server builds the FS' tree once, only counting the content lines of files, and keeps it resident along with an
+ * index of the records. Commands that change the FS write it straight away and are then applied to the tree, which
+ * list is answered from. Requests are served one at a time, in groups of those already waiting, which are committed
+ * together before any of them is replied to.
+ *
+ * A client sends the command line it was run with, along with its working dir, stdout and stderr. The command then
+ * resolves paths and prints as it would have, had it run in the client.
+ */
+
+// Sent ahead of a request's arguments, along with the client's working dir, stdout and stderr
+struct request_header
+{
+    uint32_t argument_count;
+    uint32_t payload_size;
+};
+
+// Descriptors sent with a request
+constexpr int REQUEST_FD_COUNT = 3;
+
+// Longest a request is waited on, a client that sends nothing for that long is dropped so as not to stall the others
+constexpr time_t REQUEST_TIMEOUT_SEC = 2;
+
+// Most requests served in a group, before the FS is committed and they are replied to
+constexpr size_t GROUP_REQUEST_COUNT = 64;
+
+// The FS a server keeps open between requests
+struct served_fs
+{
+    // Full path of the FS as served, and where it is read from, in memory if zipped
+    std::string name;
+    std::string path;
+    std::fstream stream;
+    bool is_compressed{};
+
+    fs_journal log;
+    fs_journal* journal = nullptr;
+
+    fs_index lookup;
+    fs_index* index = nullptr;
+    bool is_sidecar{};
+
+    // Resident tree and its records in order of the FS, built up to parsed_end
+    fs_arena tree;
+    dir* root = nullptr;
+    std::vector<file*> records;
+    fs_bodies bodies;
+    size_t parsed_end{};
+};
+
+/*
+ * Declarations
+ */
+
+// Whether the command can be forwarded to a server
+bool is_command_served(const char* command);
+
+// Run the command line on the server listening at the socket, returning the command's exit status
+int forward_command(const char* socket_path, int argc, char** argv);
+
+// Build the resident tree from the whole FS
+bool load_tree(served_fs& served);
+
+// Add the records written past the end of the resident tree to it
+bool extend_tree(served_fs& served);
+
+// Remove the record at the given path, and any children, from the resident tree
+bool remove_from_tree(served_fs& served, std::string_view path);
+
+// Apply a command that changed the FS to the resident tree, rebuilding it if it cannot be applied
+void update_tree(served_fs& served, const std::vector<std::string>& arguments);
+
+// Run a request, made of a command, the FS and the command's arguments, is_changed is set if it changed the FS
+int serve_request(served_fs& served, const std::vector<std::string>& request, bool& is_changed);
+
+// Read a request from the client and run it in the client's working dir and with its output, leaving the reply
+int serve_client(served_fs& served, int client, const int server_fds[REQUEST_FD_COUNT], bool& is_changed);
+
+// Commit the changes of the requests served in a group, writing the index and re-zipping the FS once for all
+int commit_requests(served_fs& served);
+
+// Open a socket listening at the given path, replacing any left behind by a server no longer running
+int listen_socket(const std::string& socket_path);
+
+// Write or read exactly size bytes, false if the connection ended first
+bool write_all(int fd, const void* data, size_t size);
+
+bool read_all(int fd, void* data, size_t size);
+
+int vsfs_serve(int argc, char** argv);
+
+/*
+ * Definitions
+ */
+
+// Cleared by SIGINT and SIGTERM to stop serving
+volatile sig_atomic_t is_serving = 1;
+
+bool is_command_served(const char* command)
+{
+    for (int command_id = LIST; command_id <= STATS; command_id++)
+    {
+        if (strcmp(command, commands[command_id]) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+int forward_command(const char* socket_path, int argc, char** argv)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "%s Socket path is too long \"%s\"\n", VSFS_ERROR_PREFIX, socket_path);
+        return EXIT_FAILURE;
+    }
+
+    strcpy(address.sun_path, socket_path);
+
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server == -1 || connect(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "%s Server could not be reached at \"%s\": %s\n",
+            VSFS_ERROR_PREFIX, socket_path, strerror(errno));
+        if (server != -1)
+            close(server);
+        return EIO;
+    }
+
+    // Arguments are sent as they were given, each terminated by a '\0'
+    std::string payload;
+    for (int i = 1; i < argc; i++)
+        payload.append(argv[i]).push_back('\0');
+
+    request_header header{(uint32_t) argc - 1, (uint32_t) payload.size()};
+    int cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int fds[REQUEST_FD_COUNT]{cwd_fd, STDOUT_FILENO, STDERR_FILENO};
+
+    // The descriptors go along with the header
+    iovec header_vector{&header, sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))]{};
+    msghdr message{};
+    message.msg_iov = &header_vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    cmsghdr* control_message = CMSG_FIRSTHDR(&message);
+    control_message->cmsg_level = SOL_SOCKET;
+    control_message->cmsg_type = SCM_RIGHTS;
+    control_message->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(control_message), fds, sizeof(fds));
+
+    // Output of the command is written straight to stdout and stderr, so nothing may be left buffered before it
+    fflush(stdout);
+    fflush(stderr);
+
+    int32_t err_code;
+    bool is_served = cwd_fd != -1
+        && sendmsg(server, &message, MSG_NOSIGNAL) == (ssize_t) sizeof(header)
+        && write_all(server, payload.data(), payload.size())
+        && read_all(server, &err_code, sizeof(err_code));
+
+    if (cwd_fd != -1)
+        close(cwd_fd);
+    close(server);
+
+    if (!is_served)
+    {
+        fprintf(stderr, "%s Command could not be served at \"%s\"\n", VSFS_ERROR_PREFIX, socket_path);
+        return EIO;
+    }
+
+    return err_code;
+}
+
+bool load_tree(served_fs& served)
+{
+    // Lines deleted must reach the FS before it is read
+    if (!commit_journal(served.stream, served.journal))
+        return false;
+
+    served.bodies.clear();
+    served.tree.release();
+    served.records.clear();
+
+    // Files only count their content lines, so the tree does not depend on the mapping once built
+    fs_map fs_mapping;
+    served.root = build_tree(served.path, served.stream, fs_mapping, served.tree, served.records, served.bodies, false,
+        true);
+    served.parsed_end = fs_mapping.get_data().size();
+
+    return served.root != nullptr;
+}
+
+bool extend_tree(served_fs& served)
+{
+    fs_map fs_mapping;
+    if (!served.root || !map_fs(served.path, served.stream, fs_mapping))
+        return false;
+
+    // Records are only ever appended, so those past the tree's end are all new
+    std::string_view fs_data = fs_mapping.get_data();
+    file* curr_file = nullptr;
+    bool is_inserted = scan_records(fs_data, served.parsed_end, [&](const fs_record& record)
+    {
+        return insert_record(
+            record, served.root, curr_file, served.tree, served.records, served.bodies, false, true);
+    });
+
+    served.parsed_end = fs_data.size();
+    return is_inserted;
+}
+
+bool remove_from_tree(served_fs& served, std::string_view path)
+{
+    if (!served.root)
+        return false;
+
+    // Walk down the dirs of the path, which are named with their trailing '/'
+    dir* curr_dir = served.root;
+    file* found = nullptr;
+    size_t name_start = 0;
+    while (curr_dir && name_start < path.size())
+    {
+        size_t name_end = path.find(PATH_SEPARATOR, name_start);
+        name_end = name_end == std::string_view::npos ? path.size() : name_end + 1;
+
+        found = curr_dir->find_by_name(path.substr(name_start, name_end - name_start));
+        curr_dir = dynamic_cast<dir*>(found);
+        name_start = name_end;
+    }
+
+    if (!found || name_start < path.size())
+        return false;
+
+    found->get_parent()->remove_child(found);
+
+    // The records of a dir's children share its path as a prefix, nodes are freed along with the tree
+    bool is_dir = dynamic_cast<dir*>(found) != nullptr;
+    served.records.erase(std::remove_if(served.records.begin(), served.records.end(), [&](file* record)
+    {
+        return record == found || (is_dir && std::string_view(record->get_path()).substr(0, path.size()) == path);
+    }), served.records.end());
+
+    return true;
+}
+
+void update_tree(served_fs& served, const std::vector<std::string>& arguments)
+{
+    const std::string& command = arguments[0];
+    bool is_updated;
+
+    if (command == commands[COPYIN])
+    {
+        // An existing IF is deleted before the new one is appended
+        remove_from_tree(served, arguments[2]);
+        is_updated = extend_tree(served);
+    }
+    else if (command == commands[MKDIR])
+    {
+        is_updated = extend_tree(served);
+    }
+    else if (command == commands[RM] || command == commands[RMDIR])
+    {
+        // Targets not found are skipped, a glob may match any number of records so the tree is then rebuilt
+        is_updated = true;
+        for (auto target = arguments.begin() + 1; target != arguments.end() && is_updated; target++)
+        {
+            // The FS always has dirs ending with '/'
+            std::string path = *target;
+            if (command == commands[RMDIR] && (path.empty() || path.back() != PATH_SEPARATOR))
+                path += PATH_SEPARATOR;
+
+            is_updated = !is_glob(path);
+            if (is_updated)
+                remove_from_tree(served, path);
+        }
+    }
+    else
+    {
+        // Every record moved
+        is_updated = load_tree(served);
+    }
+
+    if (!is_updated)
+        load_tree(served);
+}
+
+int serve_request(served_fs& served, const std::vector<std::string>& request, bool& is_changed)
+{
+    // The FS is given as it would be on the command line, it must be the one served
+    char* fs_name = realpath(request[1].c_str(), nullptr);
+    if (!fs_name)
+    {
+        fprintf(stderr, "%s FS could not be found %s\n", VSFS_ERROR_PREFIX, request[1].c_str());
+        return ENOENT;
+    }
+
+    bool is_served_fs = served.name == fs_name;
+    free(fs_name);
+    if (!is_served_fs)
+    {
+        fprintf(stderr, "%s FS is not the one served \"%s\"\n", VSFS_ERROR_PREFIX, request[1].c_str());
+        return EXIT_FAILURE;
+    }
+
+    // Commands of a request are run as those of a batch, which are given without the FS
+    std::vector<std::string> arguments{request[0]};
+    arguments.insert(arguments.end(), request.begin() + 2, request.end());
+
+    // The resident tree already is what list would build
+    if (arguments[0] == commands[LIST] && arguments.size() == 1)
+    {
+        if (!served.root && !load_tree(served))
+            return EXIT_FAILURE;
+
+        list_records(served.name, served.records);
+        return EXIT_SUCCESS;
+    }
+
+    // Set by requests before in the group too, so whether this one changed the FS is kept apart
+    bool is_request_changed{};
+    int err_code = run_operation(arguments, request[1].c_str(), served.path, served.stream, served.is_compressed,
+        served.index, served.journal, is_request_changed);
+
+    is_changed |= is_request_changed;
+    if (!is_request_changed)
+    {
+        // A failed command may still have written part of a record
+        served.stream.clear();
+        served.stream.flush();
+
+        struct stat fs_attr{};
+        if (stat(served.path.c_str(), &fs_attr) == EXIT_SUCCESS && (size_t) fs_attr.st_size != served.parsed_end)
+            load_tree(served);
+
+        return err_code;
+    }
+
+    update_tree(served, arguments);
+    return err_code;
+}
+
+int serve_client(served_fs& served, int client, const int server_fds[REQUEST_FD_COUNT], bool& is_changed)
+{
+    request_header header{};
+    iovec header_vector{&header, sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * REQUEST_FD_COUNT)]{};
+    msghdr message{};
+    message.msg_iov = &header_vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(client, &message, MSG_CMSG_CLOEXEC);
+
+    // Take the descriptors first, so that none are leaked whatever the request is
+    int client_fds[REQUEST_FD_COUNT]{-1, -1, -1};
+    cmsghdr* control_message = CMSG_FIRSTHDR(&message);
+    bool has_fds = control_message
+        && control_message->cmsg_level == SOL_SOCKET
+        && control_message->cmsg_type == SCM_RIGHTS
+        && control_message->cmsg_len == CMSG_LEN(sizeof(client_fds));
+    if (has_fds)
+        memcpy(client_fds, CMSG_DATA(control_message), sizeof(client_fds));
+
+    // The arguments are a command line, which can be no longer than the system allows, checked before they are read
+    long arg_max = sysconf(_SC_ARG_MAX);
+    bool is_sized = received == (ssize_t) sizeof(header)
+        && header.payload_size <= (arg_max > 0 ? (size_t) arg_max : (size_t) _POSIX_ARG_MAX);
+
+    std::string payload(is_sized ? header.payload_size : 0, '\0');
+    bool is_valid = has_fds
+        && is_sized
+        && read_all(client, payload.data(), payload.size())
+        && (payload.empty() || payload.back() == '\0');
+
+    // Split the arguments, each terminated by a '\0'
+    std::vector<std::string> request;
+    for (size_t argument_start = 0; is_valid && argument_start < payload.size();)
+    {
+        size_t argument_end = payload.find('\0', argument_start);
+        request.emplace_back(payload, argument_start, argument_end - argument_start);
+        argument_start = argument_end + 1;
+    }
+
+    is_valid = is_valid && request.size() == header.argument_count && request.size() >= 2;
+
+    int32_t err_code = EXIT_FAILURE;
+    if (is_valid)
+    {
+        // Run as the command would have in the client
+        fflush(stdout);
+        fflush(stderr);
+        dup2(client_fds[1], STDOUT_FILENO);
+        dup2(client_fds[2], STDERR_FILENO);
+
+        // Paths would otherwise resolve against the server's working dir
+        if (fchdir(client_fds[0]) != EXIT_SUCCESS)
+        {
+            err_code = errno;
+            fprintf(stderr, "%s Working dir could not be entered: %s\n", VSFS_ERROR_PREFIX, strerror(err_code));
+        }
+        else
+        {
+            try
+            {
+                err_code = serve_request(served, request, is_changed);
+            }
+            catch (const std::exception& exception)
+            {
+                // Reported as the dispatch in main would, the server keeps serving
+                fprintf(stderr, "%s %s\n", VSFS_ERROR_PREFIX, exception.what());
+                served.stream.clear();
+            }
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+        dup2(server_fds[1], STDOUT_FILENO);
+        dup2(server_fds[2], STDERR_FILENO);
+
+        // Later requests would run in the last client's working dir, stop serving once this group is replied to
+        if (fchdir(server_fds[0]) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "%s Working dir of the server could not be restored: %s\n",
+                VSFS_ERROR_PREFIX, strerror(errno));
+            is_serving = 0;
+        }
+    }
+
+    for (int fd: client_fds)
+    {
+        if (fd != -1)
+            close(fd);
+    }
+
+    return err_code;
+}
+
+int commit_requests(served_fs& served)
+{
+    if (!commit_journal(served.stream, served.journal))
+        return EIO;
+
+    // Defrag the FS once deleted records exceed the compaction policy, if any, every record then moved
+    bool is_compacted;
+    int err_code = compact_fs(served.path, served.stream, served.is_compressed, std::ios::in | std::ios::out,
+        served.index, served.journal, is_compacted);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    if (is_compacted)
+        load_tree(served);
+
+    if (served.is_sidecar)
+        save_index(served.path, served.stream, served.index);
+
+    // If FS was found zipped, re-zip it once for the whole group
+    if (served.is_compressed)
+        return deflate_fs(served.path, served.stream, served.name);
+
+    return EXIT_SUCCESS;
+}
+
+int listen_socket(const std::string& socket_path)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "%s Socket path is too long \"%s\"\n", VSFS_ERROR_PREFIX, socket_path.c_str());
+        return -1;
+    }
+
+    strcpy(address.sun_path, socket_path.c_str());
+
+    // A socket nothing accepts connections on is left behind by a server that is no longer running
+    struct stat socket_attr{};
+    if (stat(socket_path.c_str(), &socket_attr) == EXIT_SUCCESS && S_ISSOCK(socket_attr.st_mode))
+    {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe != -1
+            && connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != EXIT_SUCCESS
+            && errno == ECONNREFUSED)
+        {
+            unlink(socket_path.c_str());
+        }
+
+        if (probe != -1)
+            close(probe);
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1
+        || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != EXIT_SUCCESS
+        || listen(listener, SOMAXCONN) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "%s Socket could not be opened at \"%s\": %s\n",
+            VSFS_ERROR_PREFIX, socket_path.c_str(), strerror(errno));
+        if (listener != -1)
+            close(listener);
+        return -1;
+    }
+
+    return listener;
+}
+
+bool write_all(int fd, const void* data, size_t size)
+{
+    auto bytes = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        ssize_t written = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+
+        bytes += written;
+        size -= (size_t) written;
+    }
+
+    return true;
+}
+
+bool read_all(int fd, void* data, size_t size)
+{
+    auto bytes = static_cast<char*>(data);
+    while (size > 0)
+    {
+        ssize_t read_size = recv(fd, bytes, size, 0);
+        if (read_size == -1 && errno == EINTR)
+            continue;
+        if (read_size <= 0)
+            return false;
+
+        bytes += read_size;
+        size -= (size_t) read_size;
+    }
+
+    return true;
+}
+
+int vsfs_serve(int argc, char** argv)
+{
+    // Verify number of arguments
+    if (argc != 4)
+    {
+        fprintf(stderr, "%s Arguments for command \"serve\", expected 2, received %d\n",
+            VSFS_ERROR_PREFIX, argc - 2);
+        return EXIT_FAILURE;
+    }
+
+    // Requests name the FS relative to the client's working dir, so it is served by its full path
+    char* fs_name = realpath(argv[2], nullptr);
+    if (!fs_name)
+    {
+        fprintf(stderr, "%s FS could not be found %s\n", VSFS_ERROR_PREFIX, argv[2]);
+        return ENOENT;
+    }
+
+    served_fs served;
+    served.name = served.path = fs_name;
+    free(fs_name);
+
+    // Open the FS file in both read and write mode, once for every request
+    int err_code = open_fs(served.path, served.stream, served.is_compressed, std::ios::in | std::ios::out);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    // Recover the FS from any change left incomplete, if journaled
+    if (!open_journal(served.path, served.is_compressed, served.log, served.journal))
+        return EIO;
+
+    // Records are found through an index, kept as a sidecar if in use or else only in memory
+    served.index = open_lookup(served.path, served.is_compressed, served.lookup, served.is_sidecar);
+    if (!served.index || !load_tree(served))
+        return EXIT_FAILURE;
+
+    int listener = listen_socket(argv[3]);
+    if (listener == -1)
+        return EIO;
+
+    // Stop serving on SIGINT or SIGTERM, a client going away does not stop the server
+    struct sigaction stop_action{};
+    stop_action.sa_handler = [](int) { is_serving = 0; };
+    sigaction(SIGINT, &stop_action, nullptr);
+    sigaction(SIGTERM, &stop_action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Restored after every request
+    int server_fds[REQUEST_FD_COUNT]{
+        open(".", O_PATH | O_DIRECTORY | O_CLOEXEC), dup(STDOUT_FILENO), dup(STDERR_FILENO)};
+
+    // Clients already waiting are taken without blocking, to be served in the same group
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+    // Client and exit status of each request of a group, replied to once the group is committed
+    std::vector<std::pair<int, int32_t>> replies;
+    while (is_serving)
+    {
+        pollfd listening{listener, POLLIN, 0};
+        if (poll(&listening, 1, -1) <= 0)
+            continue;
+
+        bool is_changed{};
+        replies.clear();
+        for (int client; replies.size() < GROUP_REQUEST_COUNT
+            && (client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)) != -1;)
+        {
+            // A client that sends nothing, or does not take its reply, is given up on rather than waited for
+            timeval timeout{REQUEST_TIMEOUT_SEC, 0};
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            replies.emplace_back(client, serve_client(served, client, server_fds, is_changed));
+        }
+
+        // Requests that succeeded only did once the group is committed
+        int group_code = is_changed ? commit_requests(served) : EXIT_SUCCESS;
+        for (auto& [client, err_code]: replies)
+        {
+            if (err_code == EXIT_SUCCESS)
+                err_code = group_code;
+
+            write_all(client, &err_code, sizeof(err_code));
+            close(client);
+        }
+    }
+
+    // Every group was committed, so the journal is left empty
+    if (served.journal)
+        served.journal->checkpoint();
+
+    close(listener);
+    unlink(argv[3]);
+    for (int fd: server_fds)
+        close(fd);
+
+    return EXIT_SUCCESS;
+}
+
+#endif // VSFS_SERVE_H
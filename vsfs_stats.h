@@ -0,0 +1,232 @@
+#ifndef VSFS_STATS_H
+#define VSFS_STATS_H
+
+#include "vsfs_defrag.h"
+#include "vsfs_helpers.h"
+#include "vsfs_constants.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <string_view>
+
+/*
+ * Reports how much of an FS deleted records take, and compacts an FS once they exceed the policy set in VSFS_COMPACT.
+ *
+ * A deleted record takes the bytes from its deleted line up to the next file or dir record, which the scanner jumps to
+ * without reading the content lines in between one by one.
+ */
+
+// Bytes of an FS by whether they belong to live or deleted records, the first record counting as live
+struct fs_stats
+{
+    size_t live_bytes;
+    size_t deleted_bytes;
+    size_t live_records;
+};
+
+// Deleted bytes past which an FS is compacted, as a percentage of the FS and as a size, 0 for either not to apply
+struct compaction_policy
+{
+    double deleted_percent;
+    size_t deleted_bytes;
+};
+
+/*
+ * Declarations
+ */
+
+// Count the live and deleted bytes of the mapped FS
+fs_stats get_fs_stats(std::string_view fs_data);
+
+// Read the compaction policy from VSFS_COMPACT, false if it is not set or invalid
+bool get_compaction_policy(compaction_policy& policy);
+
+// Report the stats of the FS at the given path, read through fs_file
+int stats_fs(const std::string& fs_path, std::fstream& fs_file);
+
+/*
+ * Defrag the FS at the given path, read through fs_file, if its deleted records exceed the compaction policy, as
+ * defrag_fs does. is_compacted is then set and the index, if given, rebuilt from the defragged FS.
+ */
+int compact_fs(
+    std::string& fs_path,
+    std::fstream& fs_file,
+    bool is_compressed,
+    std::_Ios_Openmode open_mode,
+    fs_index* index,
+    fs_journal* journal,
+    bool& is_compacted);
+
+int vsfs_stats(int argc, char** argv);
+
+/*
+ * Definitions
+ */
+
+fs_stats get_fs_stats(std::string_view fs_data)
+{
+    // The FS' first record is always live
+    size_t line_start = find_line(fs_data, 0, ANY_LINE);
+    fs_stats stats{line_start, 0, 0};
+
+    while (line_start < fs_data.size())
+    {
+        // Deleted records end at the next live line, content after a deleted dir belonging to the file before it
+        if (fs_data[line_start] == DELETED_RECORD_IDENTIFIER)
+        {
+            size_t newline_count;
+            size_t next_record = find_deleted_run_end(fs_data, line_start, newline_count);
+            stats.deleted_bytes += next_record - line_start;
+            line_start = next_record;
+            continue;
+        }
+
+        if (classify_line(fs_data[line_start]) & (FILE_LINE | DIR_LINE))
+            stats.live_records++;
+
+        // A body's bytes are live, though it is not a record of its own
+        size_t next_record = find_line(fs_data, line_start, FILE_LINE | DIR_LINE | BODY_LINE | DELETED_LINE);
+        stats.live_bytes += next_record - line_start;
+        line_start = next_record;
+    }
+
+    return stats;
+}
+
+bool get_compaction_policy(compaction_policy& policy)
+{
+    policy = {};
+
+    const char* policy_variable = getenv(COMPACT_VARIABLE);
+    if (!policy_variable || !*policy_variable)
+        return false;
+
+    // Either threshold, or both separated by ',', e.g. "25%,64M"
+    std::string_view thresholds = policy_variable;
+    bool is_valid = true;
+    while (is_valid && !thresholds.empty())
+    {
+        size_t threshold_end = std::min(thresholds.find(','), thresholds.size());
+        std::string threshold(thresholds.substr(0, threshold_end));
+        thresholds.remove_prefix(std::min(threshold_end + 1, thresholds.size()));
+
+        if (!threshold.empty() && threshold.back() == '%')
+        {
+            char* end;
+            policy.deleted_percent = strtod(threshold.c_str(), &end);
+            is_valid = end == &threshold.back() && policy.deleted_percent > 0 && policy.deleted_percent <= 100;
+            continue;
+        }
+
+        // Sizes are in bytes unless followed by K, M or G
+        is_valid = parse_size(threshold, policy.deleted_bytes);
+    }
+
+    if (!is_valid)
+    {
+        fprintf(stderr, "%s Ignoring invalid %s \"%s\"\n", VSFS_ERROR_PREFIX, COMPACT_VARIABLE, policy_variable);
+        policy = {};
+        return false;
+    }
+
+    return true;
+}
+
+int stats_fs(const std::string& fs_path, std::fstream& fs_file)
+{
+    fs_map fs_mapping;
+    if (!map_fs(fs_path, fs_file, fs_mapping))
+    {
+        fprintf(stderr, "%s FS could not be mapped: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+        return EIO;
+    }
+
+    fs_stats stats = get_fs_stats(fs_mapping.get_data());
+    size_t fs_size = stats.live_bytes + stats.deleted_bytes;
+
+    printf("Live: %zu bytes in %zu records\n", stats.live_bytes, stats.live_records);
+    printf("Deleted: %zu bytes\n", stats.deleted_bytes);
+    printf("Fragmentation: %.1f%%\n", fs_size ? 100.0 * (double) stats.deleted_bytes / (double) fs_size : 0.0);
+
+    return EXIT_SUCCESS;
+}
+
+int compact_fs(
+    std::string& fs_path,
+    std::fstream& fs_file,
+    bool is_compressed,
+    std::_Ios_Openmode open_mode,
+    fs_index* index,
+    fs_journal* journal,
+    bool& is_compacted)
+{
+    is_compacted = false;
+
+    compaction_policy policy{};
+    if (!get_compaction_policy(policy))
+        return EXIT_SUCCESS;
+
+    fs_stats stats{};
+    {
+        fs_map fs_mapping;
+        if (!map_fs(fs_path, fs_file, fs_mapping))
+        {
+            fprintf(stderr, "%s FS could not be mapped: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+            return EIO;
+        }
+
+        stats = get_fs_stats(fs_mapping.get_data());
+    }
+
+    double fs_size = (double) (stats.live_bytes + stats.deleted_bytes);
+    bool is_due = (policy.deleted_percent > 0 && (double) stats.deleted_bytes * 100 > policy.deleted_percent * fs_size)
+        || (policy.deleted_bytes > 0 && stats.deleted_bytes > policy.deleted_bytes);
+    if (!is_due)
+        return EXIT_SUCCESS;
+
+    int err_code = defrag_fs(fs_path, fs_file, is_compressed, open_mode, journal);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    is_compacted = true;
+
+    // Every record moved, the index is rebuilt from the defragged FS
+    if (index)
+    {
+        fs_map fs_mapping;
+        if (!map_fs(fs_path, fs_file, fs_mapping))
+        {
+            fprintf(stderr, "%s FS could not be mapped: %s\n", VSFS_ERROR_PREFIX, fs_path.c_str());
+            return EIO;
+        }
+
+        rebuild_index(fs_mapping.get_data(), *index);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int vsfs_stats(int argc, char** argv)
+{
+    // Verify number of arguments
+    if (argc != 3)
+    {
+        fprintf(stderr, "%s Arguments for command \"stats\", expected 1, received %d\n",
+            VSFS_ERROR_PREFIX, argc - 2);
+        return EXIT_FAILURE;
+    }
+
+    std::string fs_path = argv[2];
+    std::fstream fs_file;
+    bool is_compressed{};
+
+    // Open the FS file in read mode
+    int err_code = open_fs(fs_path, fs_file, is_compressed, std::ios::in);
+    if (err_code != EXIT_SUCCESS)
+        return err_code;
+
+    // The FS is read as it is, opening its journal would lock it and could write to it to recover any incomplete change
+    return stats_fs(fs_path, fs_file);
+}
+
+#endif // VSFS_STATS_H